@@ -0,0 +1,122 @@
+/*  Count a program's calls to the allocator: `make bench-alloc'.
+    Copyright (C) 2026 Free Software Foundation, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2, or (at your option)
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.  */
+
+/* Built as a shared object and put in LD_PRELOAD, this passes malloc,
+   calloc, realloc and free on to the C library, counting them.  When
+   the program exits, the counts are written, as "MALLOCS FREES
+   REALLOCS\n" (calloc counts as malloc), to the file descriptor named
+   by SEDBENCH_ALLOC_FD, or to the standard error if that isn't set.
+   sedbench -a uses it.  Only GCC and a dlsym with RTLD_NEXT will do. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dlfcn.h>
+
+static void *(*real_malloc)(size_t);
+static void *(*real_calloc)(size_t, size_t);
+static void *(*real_realloc)(void *, size_t);
+static void (*real_free)(void *);
+
+static unsigned long mallocs, frees, reallocs;
+
+/* dlsym may itself allocate while we are looking the real functions
+   up; that comes out of here, and is never freed */
+static char early[4096];
+static size_t early_used;
+static int resolving;
+
+static void *early_alloc(size_t size)
+{
+    void *p;
+
+    size = (size + 15) & ~(size_t)15;
+    if (size > sizeof early - early_used) {
+        return NULL;
+    }
+    p = early + early_used;
+    early_used += size;
+    return p;
+}
+
+static void resolve(void)
+{
+    resolving = 1;
+    real_malloc = dlsym(RTLD_NEXT, "malloc");
+    real_calloc = dlsym(RTLD_NEXT, "calloc");
+    real_realloc = dlsym(RTLD_NEXT, "realloc");
+    real_free = dlsym(RTLD_NEXT, "free");
+    resolving = 0;
+}
+
+void *malloc(size_t size)
+{
+    if (!real_malloc) {
+        if (resolving) {
+            return early_alloc(size);
+        }
+        resolve();
+    }
+    __sync_fetch_and_add(&mallocs, 1);
+    return real_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+    if (!real_calloc) {
+        if (resolving) {
+            return early_alloc(n * size); /* static, so already zero */
+        }
+        resolve();
+    }
+    __sync_fetch_and_add(&mallocs, 1);
+    return real_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    if (!real_realloc) {
+        resolve();
+    }
+    __sync_fetch_and_add(&reallocs, 1);
+    return real_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+    if (!ptr || ((char *)ptr >= early && (char *)ptr < early + sizeof early)) {
+        return;
+    }
+    if (!real_free) {
+        resolve();
+    }
+    __sync_fetch_and_add(&frees, 1);
+    real_free(ptr);
+}
+
+__attribute__((destructor)) static void report(void)
+{
+    char *env = getenv("SEDBENCH_ALLOC_FD");
+    int fd = env ? atoi(env) : 2;
+    char buf[100];
+    int len;
+
+    len = snprintf(buf, sizeof buf, "%lu %lu %lu\n", mallocs, frees, reallocs);
+    write(fd, buf, len);
+}
@@ -0,0 +1,473 @@
+/*  Benchmarks for sed: `make bench'.
+    Copyright (C) 2026 Free Software Foundation, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2, or (at your option)
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.  */
+
+/* Usage: sedbench [-s megabytes] [-d dir] [-r runs] [-a alloccount.so] sed [case...]
+
+   Makes the corpora in DIR, if they aren't there already, and runs SED
+   over them with each of the scripts below (or just the CASEs named),
+   RUNS times apiece, printing the best time of each as megabytes and
+   lines per second, along with the most memory the sed used.
+
+   With -a, each case is run once more with the allocation counter
+   (alloccount.c) preloaded, and how many times the sed called malloc,
+   free and realloc is printed too.  The counts don't depend on the
+   machine, so they can be compared from one build to the next.
+
+   The corpora are made by a fixed pseudo-random sequence, so they are
+   the same from one run, and one machine, to the next, as long as they
+   are the same size.  The file names carry the size, so corpora of
+   different sizes can sit side by side.  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+static char *myname;
+
+/* A corpus, and how to make a line of it (returning its length) */
+struct corpus {
+    char *name;
+    long (*line)(FILE *fp);
+};
+
+/* A benchmark: the corpus to run over, and the arguments for sed.  A
+   "@many" argument stands for the many-command script, which is made
+   along with the corpora. */
+struct bench_case {
+    char *name;
+    char *corpus;
+    char *args[6];
+};
+
+static long log_line(FILE *fp);
+static long csv_line(FILE *fp);
+static long long_line(FILE *fp);
+static long binary_line(FILE *fp);
+
+static struct corpus corpora[] = {
+    {"log", log_line},
+    {"csv", csv_line},
+    {"long", long_line},
+    {"binary", binary_line},
+    {NULL, NULL}
+};
+
+static struct bench_case cases[] = {
+    {"filter-regex", "log", {"-n", "/ERROR/p"}},
+    {"filter-range", "log", {"-n", "/WARN/,/ERROR/p"}},
+    {"filter-lines", "csv", {"-n", "1000,2000p"}},
+    {"subst-global", "log", {"s/[0-9]/#/g"}},
+    {"subst-group", "log", {"s/\\(user[0-9]*\\) from/<\\1> from/g"}},
+    {"subst-literal", "csv", {"s/,/\t/g"}},
+    {"subst-long", "long", {"s/lorem/LOREM/g"}},
+    {"hold-append", "csv", {"-n", "H;${x;s/\\n/|/g;p;}"}},
+    {"n-slurp", "log", {":a\nN\n$!ba\ns/\\n/ /g"}},
+    {"translit", "binary", {"y/abcdefghij/ABCDEFGHIJ/"}},
+    {"binary-filter", "binary", {"/x[0-9][0-9]y/d"}},
+    {"many-commands", "log", {"-f", "@many"}},
+    {NULL, NULL, {NULL}}
+};
+
+/* The corpora are made from this, xorshift64, with a fresh seed for
+   each one. */
+static unsigned long long rand_state;
+
+static unsigned long next_rand()
+{
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 7;
+    rand_state ^= rand_state << 17;
+    return (unsigned long)(rand_state >> 16);
+}
+
+#define pick(n) (next_rand() % (n))
+
+static char *levels[] = {"INFO", "INFO", "INFO", "DEBUG", "WARN", "ERROR"};
+static char *words[] = {"lorem", "ipsum", "dolor", "sit", "amet", "consectetur",
+                        "adipiscing", "elit", "sed", "do", "eiusmod", "tempor"};
+static char *cities[] = {"Oslo", "Lima", "Kyoto", "Accra", "Quito", "Hanoi", "Perth", "Bern"};
+
+#define NWORDS (sizeof(words) / sizeof(words[0]))
+
+/* A line of a server log */
+static long log_line(FILE *fp)
+{
+    static long seconds;
+    long len;
+
+    seconds += pick(3);
+    len = fprintf(fp, "2024-03-%02ld %02ld:%02ld:%02ld host%lu sshd[%lu]: %s ",
+            1 + seconds / 86400 % 28, seconds / 3600 % 24, seconds / 60 % 60, seconds % 60,
+            pick(40), 1000 + pick(30000), levels[pick(6)]);
+    switch (pick(3)) {
+        case 0:
+            len += fprintf(fp, "Accepted password for user%lu from 10.%lu.%lu.%lu port %lu ssh2\n",
+                    pick(500), pick(256), pick(256), pick(256), 1024 + pick(60000));
+            break;
+        case 1:
+            len += fprintf(fp, "Connection closed by %lu.%lu.%lu.%lu [preauth]\n",
+                    pick(256), pick(256), pick(256), pick(256));
+            break;
+        default:
+            len += fprintf(fp, "session opened for user%lu by (uid=%lu)\n", pick(500), pick(2000));
+            break;
+    }
+    return len;
+}
+
+/* A row of comma-separated values */
+static long csv_line(FILE *fp)
+{
+    static unsigned long id;
+
+    return fprintf(fp, "%lu,%s %s,%s,%lu.%02lu,2023-%02lu-%02lu,%s\n",
+            ++id, words[pick(NWORDS)], words[pick(NWORDS)], cities[pick(8)],
+            pick(100000), pick(100), 1 + pick(12), 1 + pick(28), pick(2) ? "yes" : "no");
+}
+
+/* Words, anything from a hundred kilobytes to a megabyte of them */
+static long long_line(FILE *fp)
+{
+    long want = 100000 + pick(900000);
+    long len = 0;
+
+    while (len < want) {
+        char *w = words[pick(NWORDS)];
+
+        fputs(w, fp);
+        putc(' ', fp);
+        len += strlen(w) + 1;
+    }
+    putc('\n', fp);
+    return len + 1;
+}
+
+/* Bytes of every value, mostly letters, with a newline now and then */
+static long binary_line(FILE *fp)
+{
+    long len = pick(400);
+    long i;
+
+    for (i = 0; i < len; i++) {
+        int ch = pick(4) ? 'a' + pick(26) : pick(256);
+
+        putc(ch == '\n' ? 0 : ch, fp);
+    }
+    putc('\n', fp);
+    return len + 1;
+}
+
+/* Make the corpus C, of MB megabytes, at PATH */
+static void make_corpus(struct corpus *c, char *path, long mb)
+{
+    char tmp[1100];
+    long size = 0;
+    FILE *fp;
+    char *p;
+
+    sprintf(tmp, "%s.tmp", path);
+    if (!(fp = fopen(tmp, "w"))) {
+        fprintf(stderr, "%s: can't create %s: %s\n", myname, tmp, strerror(errno));
+        exit(1);
+    }
+
+    rand_state = 0x9e3779b97f4a7c15ULL;
+    for (p = c->name; *p; p++) {
+        rand_state = rand_state * 31 + *p;
+    }
+
+    fprintf(stderr, "%s: making %s\n", myname, path);
+    while (size < mb * 1024 * 1024) {
+        size += c->line(fp);
+    }
+
+    if (fclose(fp) == EOF || rename(tmp, path) < 0) {
+        fprintf(stderr, "%s: can't write %s: %s\n", myname, path, strerror(errno));
+        exit(1);
+    }
+}
+
+/* Write a script of a hundred-odd commands, most of which do nothing
+   to most lines, to PATH */
+static void make_many(char *path)
+{
+    FILE *fp;
+    int i;
+
+    if (!(fp = fopen(path, "w"))) {
+        fprintf(stderr, "%s: can't create %s: %s\n", myname, path, strerror(errno));
+        exit(1);
+    }
+
+    for (i = 0; i < 40; i++) {
+        fprintf(fp, "/host%d /s/sshd\\[[0-9]*\\]/sshd/\n", i);
+    }
+    for (i = 0; i < 40; i++) {
+        fprintf(fp, "s/user%d from/u%d from/\n", i * 7, i);
+    }
+    fprintf(fp, "/ERROR/{\n  s/ERROR/E/\n  y/abcdef/ABCDEF/\n  /preauth/b done\n}\n");
+    for (i = 0; i < 20; i++) {
+        fprintf(fp, "/port %d/d\n", 1024 + i * 997);
+    }
+    fprintf(fp, ":done\n");
+
+    if (fclose(fp) == EOF) {
+        fprintf(stderr, "%s: can't write %s: %s\n", myname, path, strerror(errno));
+        exit(1);
+    }
+}
+
+/* The number of newlines in the file at PATH */
+static long count_lines(char *path)
+{
+    char buf[65536];
+    long lines = 0;
+    int fd;
+    int n;
+
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        fprintf(stderr, "%s: can't open %s: %s\n", myname, path, strerror(errno));
+        exit(1);
+    }
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        char *p = buf;
+
+        while ((p = memchr(p, '\n', buf + n - p))) {
+            lines++;
+            p++;
+        }
+    }
+    close(fd);
+    return lines;
+}
+
+/* Run SED with ARGV (ending in the corpus), its output thrown away.
+   Return how many seconds it took, and set *RSS to the most memory it
+   had, in kilobytes. */
+static double run_sed(char *sed, char **argv, long *rss)
+{
+    struct timeval start, end;
+    struct rusage usage;
+    int status;
+    pid_t pid;
+
+    gettimeofday(&start, NULL);
+    pid = fork();
+    if (pid < 0) {
+        fprintf(stderr, "%s: can't fork: %s\n", myname, strerror(errno));
+        exit(1);
+    }
+    if (pid == 0) {
+        int fd = open("/dev/null", O_WRONLY);
+
+        dup2(fd, 1);
+        execv(sed, argv);
+        fprintf(stderr, "%s: can't run %s: %s\n", myname, sed, strerror(errno));
+        _exit(127);
+    }
+
+    if (wait4(pid, &status, 0, &usage) < 0) {
+        fprintf(stderr, "%s: wait failed: %s\n", myname, strerror(errno));
+        exit(1);
+    }
+    gettimeofday(&end, NULL);
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "%s: %s failed\n", myname, sed);
+        exit(1);
+    }
+
+    *rss = usage.ru_maxrss;
+    return (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+}
+
+/* Run SED with ARGV once more, with the allocation counter SHIM
+   preloaded, and set COUNTS to the number of calls it made to malloc,
+   free and realloc. */
+static void count_allocs(char *sed, char **argv, char *shim, unsigned long counts[3])
+{
+    char buf[100];
+    int status;
+    int len = 0;
+    int n;
+    int fds[2];
+    pid_t pid;
+
+    if (pipe(fds) < 0) {
+        fprintf(stderr, "%s: can't make a pipe: %s\n", myname, strerror(errno));
+        exit(1);
+    }
+    pid = fork();
+    if (pid < 0) {
+        fprintf(stderr, "%s: can't fork: %s\n", myname, strerror(errno));
+        exit(1);
+    }
+    if (pid == 0) {
+        int fd = open("/dev/null", O_WRONLY);
+
+        dup2(fd, 1);
+        close(fds[0]);
+        sprintf(buf, "%d", fds[1]);
+        setenv("SEDBENCH_ALLOC_FD", buf, 1);
+        setenv("LD_PRELOAD", shim, 1);
+        execv(sed, argv);
+        fprintf(stderr, "%s: can't run %s: %s\n", myname, sed, strerror(errno));
+        _exit(127);
+    }
+
+    close(fds[1]);
+    while (len < (int)sizeof(buf) - 1 && (n = read(fds[0], buf + len, sizeof(buf) - 1 - len)) > 0) {
+        len += n;
+    }
+    buf[len] = 0;
+    close(fds[0]);
+
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "%s: %s failed\n", myname, sed);
+        exit(1);
+    }
+    if (sscanf(buf, "%lu %lu %lu", &counts[0], &counts[1], &counts[2]) != 3) {
+        fprintf(stderr, "%s: %s didn't count anything; is %s right?\n", myname, sed, shim);
+        exit(1);
+    }
+}
+
+static void usage()
+{
+    fprintf(stderr, "Usage: %s [-s megabytes] [-d dir] [-r runs] [-a alloccount.so] sed [case...]\n", myname);
+    exit(4);
+}
+
+int main(int argc, char **argv)
+{
+    char *dir = "bench-data";
+    char *shim = NULL;
+    long mb = 64;
+    int runs = 3;
+    char *sed;
+    char many[1024];
+    struct bench_case *bc;
+    int opt;
+
+    myname = argv[0];
+    while ((opt = getopt(argc, argv, "s:d:r:a:")) != EOF) {
+        switch (opt) {
+            case 's':
+                mb = atol(optarg);
+                break;
+            case 'd':
+                dir = optarg;
+                break;
+            case 'r':
+                runs = atoi(optarg);
+                break;
+            case 'a':
+                shim = optarg;
+                break;
+            default:
+                usage();
+        }
+    }
+    if (optind == argc || mb < 1 || runs < 1) {
+        usage();
+    }
+    sed = argv[optind++];
+
+    if (mkdir(dir, 0777) < 0 && errno != EEXIST) {
+        fprintf(stderr, "%s: can't make %s: %s\n", myname, dir, strerror(errno));
+        exit(1);
+    }
+    sprintf(many, "%s/many.sed", dir);
+    make_many(many);
+
+    printf("%-16s %-8s %8s %10s %12s %10s", "case", "corpus", "seconds", "MB/s", "lines/s", "peak RSS");
+    if (shim) {
+        printf(" %10s %10s %10s", "mallocs", "frees", "reallocs");
+    }
+    printf("\n");
+    for (bc = cases; bc->name; bc++) {
+        char path[1024];
+        char *args[10];
+        struct corpus *c;
+        struct stat st;
+        double best = 0;
+        long best_rss = 0;
+        long lines;
+        int i, n;
+
+        if (optind < argc) {
+            for (i = optind; i < argc && strcmp(argv[i], bc->name); i++)
+                ;
+            if (i == argc) {
+                continue;
+            }
+        }
+
+        for (c = corpora; strcmp(c->name, bc->corpus); c++)
+            ;
+        sprintf(path, "%s/%s-%ld.txt", dir, c->name, mb);
+        if (stat(path, &st) < 0) {
+            make_corpus(c, path, mb);
+            stat(path, &st);
+        }
+        lines = count_lines(path);
+
+        n = 0;
+        args[n++] = sed;
+        for (i = 0; bc->args[i]; i++) {
+            args[n++] = strcmp(bc->args[i], "@many") ? bc->args[i] : many;
+        }
+        args[n++] = path;
+        args[n] = NULL;
+
+        for (i = 0; i < runs; i++) {
+            long rss;
+            double secs = run_sed(sed, args, &rss);
+
+            if (i == 0 || secs < best) {
+                best = secs;
+            }
+            if (rss > best_rss) {
+                best_rss = rss;
+            }
+        }
+        if (best <= 0) {
+            best = 1e-6;
+        }
+
+        printf("%-16s %-8s %8.3f %10.1f %12.0f %8ld MB", bc->name, c->name, best,
+               st.st_size / (1024.0 * 1024.0) / best, lines / best, (best_rss + 1023) / 1024);
+        if (shim) {
+            unsigned long counts[3];
+
+            count_allocs(sed, args, shim, counts);
+            printf(" %10lu %10lu %10lu", counts[0], counts[1], counts[2]);
+        }
+        printf("\n");
+        fflush(stdout);
+    }
+
+    return 0;
+}
@@ -0,0 +1,258 @@
+/*  Random comparison of sed with and without its optimizations: `make check'.
+    Copyright (C) 2026 Free Software Foundation, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2, or (at your option)
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.  */
+
+/* Usage: sedcheck [-c count] [-s seed] sed
+
+   Makes COUNT random scripts, each mostly a run of plain-string s
+   commands, and random inputs for them, and runs SED over each input
+   with and without -n, once as it is and once with --profile.  The
+   profiled run tries every command, and every regex, on its own: it
+   doesn't fuse runs of s commands into one pass (see fuse_run) or look
+   for the regex addresses as a set (see program_address_set).  So the
+   two must give the same output and exit status, and any script where
+   they don't is printed, with its input.  The exit status is 1 if there
+   were any.
+
+   The patterns and replacements are made from a few letters, so that
+   one command's replacement is often what a later one looks for, and
+   matches overlap; the flags include g, numbers and p; and some scripts
+   end with t, N or D, or have other commands in among the s commands.
+   The same SEED gives the same scripts. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+static char *myname;
+
+/* The same generator as sedbench's */
+static unsigned long long rand_state;
+
+static unsigned long next_rand()
+{
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 7;
+    rand_state ^= rand_state << 17;
+    return (unsigned long)(rand_state >> 16);
+}
+
+#define pick(n) (next_rand() % (n))
+
+static char *flags[] = {"", "", "g", "g", "2", "3", "2g", "p", "gp"};
+static char *others[] = {"s/a*b/Z/g", "y/ab/ba/", "/aa/d", "/ab/s/b/B/", "/b$/!s/a/A/2", "s/\\(a\\)b/\\1\\1/"};
+static char *tails[] = {"", "", "t\ns/^/T/", "$!N", "t x\ns/$/-/\n:x", "/ba/{P;D;}"};
+
+#define NFLAGS (sizeof(flags) / sizeof(flags[0]))
+#define NOTHERS (sizeof(others) / sizeof(others[0]))
+#define NTAILS (sizeof(tails) / sizeof(tails[0]))
+
+/* Append MIN to MAX letters from ALPHA to BUF */
+static char *letters(char *buf, char *alpha, int min, int max)
+{
+    int n = min + pick(max - min + 1);
+    int len = strlen(alpha);
+
+    while (n--) {
+        *buf++ = alpha[pick(len)];
+    }
+    *buf = 0;
+    return buf;
+}
+
+/* Make a script in SCRIPT and an input for it in INPUT */
+static void make_case(char *script, char *input)
+{
+    char *p = script;
+    int n = 4 + pick(9);
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (i) {
+            *p++ = '\n';
+        }
+        if (pick(8) == 0) {
+            p += sprintf(p, "%s", others[pick(NOTHERS)]);
+            continue;
+        }
+        *p++ = 's';
+        *p++ = '/';
+        p = letters(p, "ab", 1, 3);
+        *p++ = '/';
+        p = letters(p, "abXY&", 0, 3);
+        p += sprintf(p, "/%s", flags[pick(NFLAGS)]);
+    }
+    i = pick(NTAILS);
+    if (*tails[i]) {
+        p += sprintf(p, "\n%s", tails[i]);
+    }
+
+    p = input;
+    n = 1 + pick(5);
+    for (i = 0; i < n; i++) {
+        p = letters(p, "ab", 0, 20);
+        if (i < n - 1 || pick(4)) {
+            *p++ = '\n';
+        }
+    }
+    *p = 0;
+}
+
+/* Run SED with ARGV over INPUT, and put what it wrote to the standard
+   output in OUT, which has room for SIZE bytes.  Return its exit status,
+   or -1 if it died of a signal or wrote too much. */
+static int run_sed(char *sed, char **argv, char *input, char *out, int size)
+{
+    int in[2], from[2];
+    int len = 0;
+    int status;
+    int n;
+    pid_t pid;
+
+    if (pipe(in) < 0 || pipe(from) < 0) {
+        fprintf(stderr, "%s: can't make a pipe: %s\n", myname, strerror(errno));
+        exit(2);
+    }
+    /* The input is small enough to sit in the pipe */
+    write(in[1], input, strlen(input));
+    close(in[1]);
+
+    pid = fork();
+    if (pid < 0) {
+        fprintf(stderr, "%s: can't fork: %s\n", myname, strerror(errno));
+        exit(2);
+    }
+    if (pid == 0) {
+        int fd = open("/dev/null", O_WRONLY);
+
+        dup2(in[0], 0);
+        dup2(from[1], 1);
+        dup2(fd, 2);
+        close(from[0]);
+        execv(sed, argv);
+        _exit(127);
+    }
+
+    close(in[0]);
+    close(from[1]);
+    while ((n = read(from[0], out + len, size - len)) > 0) {
+        len += n;
+    }
+    close(from[0]);
+    waitpid(pid, &status, 0);
+
+    if (len == size || !WIFEXITED(status)) {
+        return -1;
+    }
+    out[len] = 0;
+    return WEXITSTATUS(status);
+}
+
+/* Print S with its newlines showing */
+static void show(char *what, char *s)
+{
+    printf("  %s: ", what);
+    for (; *s; s++) {
+        if (*s == '\n') {
+            printf("\\n");
+        } else {
+            putchar(*s);
+        }
+    }
+    putchar('\n');
+}
+
+static void usage()
+{
+    fprintf(stderr, "Usage: %s [-c count] [-s seed] sed\n", myname);
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    static char plain_out[65536], profiled_out[65536];
+    char script[1024];
+    char input[256];
+    long count = 2000;
+    unsigned long seed = 1;
+    int failures = 0;
+    char *sed;
+    long i;
+    int opt;
+
+    myname = argv[0];
+    while ((opt = getopt(argc, argv, "c:s:")) != EOF) {
+        switch (opt) {
+            case 'c':
+                count = atol(optarg);
+                break;
+            case 's':
+                seed = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                usage();
+        }
+    }
+    if (optind != argc - 1 || count < 1) {
+        usage();
+    }
+    sed = argv[optind];
+    rand_state = 0x9e3779b97f4a7c15ULL ^ seed;
+
+    for (i = 0; i < count; i++) {
+        int quiet;
+
+        make_case(script, input);
+        for (quiet = 0; quiet < 2; quiet++) {
+            char *plain[5], *profiled[6];
+            int n = 0, m = 0;
+            int a, b;
+
+            plain[n++] = profiled[m++] = sed;
+            profiled[m++] = "--profile";
+            if (quiet) {
+                plain[n++] = profiled[m++] = "-n";
+            }
+            plain[n++] = profiled[m++] = "-e";
+            plain[n++] = profiled[m++] = script;
+            plain[n] = profiled[m] = NULL;
+
+            a = run_sed(sed, plain, input, plain_out, sizeof plain_out - 1);
+            b = run_sed(sed, profiled, input, profiled_out, sizeof profiled_out - 1);
+            if (a == 127 || b == 127) {
+                fprintf(stderr, "%s: can't run %s\n", myname, sed);
+                exit(2);
+            }
+            if (a != b || a < 0 || strcmp(plain_out, profiled_out)) {
+                if (++failures <= 10) {
+                    printf("case %ld%s differs:\n", i, quiet ? " with -n" : "");
+                    show("script", script);
+                    show("input", input);
+                    show("output", plain_out);
+                    show("with --profile", profiled_out);
+                }
+            }
+        }
+    }
+
+    printf("%s: %ld scripts, %d differences\n", myname, count, failures);
+    return failures != 0;
+}
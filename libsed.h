@@ -0,0 +1,77 @@
+/* Declarations for libsed, the sed script engine as a library.
+   Copyright (C) 1989, 1990, 1991 Free Software Foundation, Inc.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.  */
+
+/* A script is compiled once into a `struct sed_program', which is never
+   changed afterwards, and can then be run over any number of inputs,
+   from any number of threads at once.  Nothing is written to the
+   standard output and nothing calls exit(): output goes to a sink the
+   caller supplies, and errors are returned, with the message left for
+   sed_error.
+
+   The `r' and `w' commands still work on files.  Each program opens
+   the files it names when it is compiled and closes them when it is
+   freed, so two programs writing the same file each truncate it.  */
+
+#ifndef _LIBSED_H
+#define _LIBSED_H 1
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct sed_program;
+
+/* Flags for sed_compile */
+#define SED_QUIET 01 /* As -n: only print when told to */
+
+/* Called with each block of output.  Return 0 to go on, anything else
+   to stop the run with an error.  */
+typedef int (*sed_sink) (void *arg, const char *buf, size_t len);
+
+/* Called for more input.  Put up to SIZE bytes at BUF and return how
+   many, 0 at the end of the input, or -1 for an error.  */
+typedef long (*sed_source) (void *arg, char *buf, size_t size);
+
+/* Compile SCRIPT (one or more commands, as for -e).  Return 0 if it
+   can't be compiled.  */
+extern struct sed_program *sed_compile (const char *script, int flags);
+
+/* Free a program made by sed_compile, once no run is using it.  */
+extern void sed_program_free (struct sed_program *program);
+
+/* Run PROGRAM over the LEN bytes at BUF, passing the output to SINK.
+   Return 0, or -1 if something went wrong.  BUF must stay unchanged
+   until the run returns, but is only read.  */
+extern int sed_run_buffer (const struct sed_program *program,
+                           const char *buf, size_t len,
+                           sed_sink sink, void *sink_arg);
+
+/* The same, for input read a block at a time from SOURCE.  */
+extern int sed_run_stream (const struct sed_program *program,
+                           sed_source source, void *source_arg,
+                           sed_sink sink, void *sink_arg);
+
+/* Why the last call in this thread that failed did so.  */
+extern const char *sed_error (void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _LIBSED_H */
@@ -0,0 +1,149 @@
+/* C++ wrapper for libsed.
+   Copyright (C) 1989, 1990, 1991 Free Software Foundation, Inc.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.  */
+
+/* sed::program owns a compiled script and frees it when it goes;
+   errors are thrown as sed::error.  Exceptions from a sink are carried
+   past the C code and thrown again once the run is over.  */
+
+#ifndef _LIBSED_HPP
+#define _LIBSED_HPP 1
+
+#include <exception>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include "libsed.h"
+
+namespace sed {
+
+class error : public std::runtime_error {
+  public:
+    explicit error(const char *what) : std::runtime_error(what) {}
+};
+
+class program {
+  public:
+    explicit program(const std::string &script, int flags = 0)
+        : prog_(sed_compile(script.c_str(), flags))
+    {
+        if (!prog_) {
+            throw error(sed_error());
+        }
+    }
+
+    ~program() { sed_program_free(prog_); }
+
+    program(program &&other) noexcept : prog_(other.prog_) { other.prog_ = nullptr; }
+
+    program &operator=(program &&other) noexcept
+    {
+        std::swap(prog_, other.prog_);
+        return *this;
+    }
+
+    program(const program &) = delete;
+    program &operator=(const program &) = delete;
+
+    /* Run the script over INPUT, calling SINK(buf, len) with the output. */
+    template <class Sink>
+    void run(const char *input, size_t len, Sink &&sink) const
+    {
+        call<Sink> c{sink, nullptr};
+
+        check(sed_run_buffer(prog_, input, len, &call<Sink>::thunk, &c), c);
+    }
+
+    /* Run the script over what SOURCE(buf, size) reads, as for sed_source. */
+    template <class Source, class Sink>
+    void run_stream(Source &&source, Sink &&sink) const
+    {
+        feed<Source> f{source, nullptr};
+        call<Sink> c{sink, nullptr};
+
+        int status = sed_run_stream(prog_, &feed<Source>::thunk, &f, &call<Sink>::thunk, &c);
+        if (f.caught) {
+            std::rethrow_exception(f.caught);
+        }
+        check(status, c);
+    }
+
+    std::string run(const std::string &input) const
+    {
+        std::string out;
+
+        run(input.data(), input.size(), [&out](const char *buf, size_t len) { out.append(buf, len); });
+        return out;
+    }
+
+    const sed_program *get() const { return prog_; }
+
+  private:
+    template <class Sink>
+    struct call {
+        Sink &sink;
+        std::exception_ptr caught;
+
+        static int thunk(void *arg, const char *buf, size_t len)
+        {
+            call *c = static_cast<call *>(arg);
+
+            try {
+                c->sink(buf, len);
+                return 0;
+            } catch (...) {
+                c->caught = std::current_exception();
+                return -1;
+            }
+        }
+    };
+
+    template <class Source>
+    struct feed {
+        Source &source;
+        std::exception_ptr caught;
+
+        static long thunk(void *arg, char *buf, size_t size)
+        {
+            feed *f = static_cast<feed *>(arg);
+
+            try {
+                return f->source(buf, size);
+            } catch (...) {
+                f->caught = std::current_exception();
+                return -1;
+            }
+        }
+    };
+
+    template <class Sink>
+    static void check(int status, const call<Sink> &c)
+    {
+        if (c.caught) {
+            std::rethrow_exception(c.caught);
+        }
+        if (status) {
+            throw error(sed_error());
+        }
+    }
+
+    sed_program *prog_;
+};
+
+} // namespace sed
+
+#endif /* _LIBSED_HPP */
@@ -0,0 +1,578 @@
+/*  Substring search for literal patterns.
+    Copyright (C) 1989, 1990, 1991 Free Software Foundation, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2, or (at your option)
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.  */
+
+/* When a regular expression is nothing but a string of ordinary
+   characters, sed looks for it with memsearch instead of the regex
+   matcher.
+
+   The vector versions compare a whole block of candidate positions
+   against the first and the last byte of the needle at once, and only
+   call memcmp where both agree.  That rejects almost every position
+   without looking at it twice, even when the first byte is common.
+
+   multisearch looks for a whole set of strings in one pass, for scripts
+   with many regex addresses to try on every line, or long runs of s
+   commands with plain strings.  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#if HAVE_STRING_H || defined(STDC_HEADERS)
+#include <string.h>
+#else
+#include <strings.h>
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/* Return the first position in the HAY_LEN bytes at HAY where the LEN
+   bytes at NEEDLE occur, or 0 if they don't.  */
+char *memsearch(char *hay, int hay_len, char *needle, int len)
+{
+    char *p = hay;
+    char *last;
+
+    if (len <= 0) {
+        return hay;
+    }
+
+    if (len > hay_len) {
+        return 0;
+    }
+
+    if (len == 1) {
+        return memchr(hay, *needle, hay_len);
+    }
+
+    /* The last place a match could start.  */
+    last = hay + hay_len - len;
+
+#if defined(__AVX2__)
+    {
+        __m256i first = _mm256_set1_epi8(needle[0]);
+        __m256i final = _mm256_set1_epi8(needle[len - 1]);
+
+        for (; p + 32 <= last + 1; p += 32) {
+            __m256i a = _mm256_loadu_si256((__m256i *)p);
+            __m256i b = _mm256_loadu_si256((__m256i *)(p + len - 1));
+            unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, final)));
+
+            while (mask) {
+                int i = __builtin_ctz(mask);
+
+                if (!memcmp(p + i + 1, needle + 1, len - 2)) {
+                    return p + i;
+                }
+                mask &= mask - 1;
+            }
+        }
+    }
+#elif defined(__SSE2__)
+    {
+        __m128i first = _mm_set1_epi8(needle[0]);
+        __m128i final = _mm_set1_epi8(needle[len - 1]);
+
+        for (; p + 16 <= last + 1; p += 16) {
+            __m128i a = _mm_loadu_si128((__m128i *)p);
+            __m128i b = _mm_loadu_si128((__m128i *)(p + len - 1));
+            unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, final)));
+
+            while (mask) {
+                int i = __builtin_ctz(mask);
+
+                if (!memcmp(p + i + 1, needle + 1, len - 2)) {
+                    return p + i;
+                }
+                mask &= mask - 1;
+            }
+        }
+    }
+#endif
+
+    /* What's left (all of it, without vector instructions): let memchr
+       find the first byte, and check the rest by hand.  */
+    while (p <= last) {
+        p = memchr(p, *needle, last - p + 1);
+        if (!p) {
+            return 0;
+        }
+
+        if (p[len - 1] == needle[len - 1] && !memcmp(p + 1, needle + 1, len - 2)) {
+            return p;
+        }
+        p++;
+    }
+
+    return 0;
+}
+
+/* Looking for many strings at once, with an Aho-Corasick automaton.
+
+   The needles are put in a trie, and each node gets a failure link to
+   the node for the longest proper suffix of its string that is also in
+   the trie.  While the whole table fits in MS_DENSE_MAX entries, the
+   links are folded into a full transition table, so that the scan is
+   one lookup per byte of the haystack, however many needles there are.
+   Bytes that no needle uses all behave alike, so the table has a column
+   for each byte that does, and one more for the rest.  Bigger sets keep
+   each node's edges sorted, and follow the failure links at run time.  */
+
+#ifndef MS_DENSE_MAX
+#define MS_DENSE_MAX (4 * 1024 * 1024)
+#endif
+
+struct ms_needle
+{
+    char *text;
+    int len;
+    int id;
+};
+
+struct multisearch
+{
+    struct ms_needle *needles;
+    int n_needles;
+    int max_id;
+    int n_nodes;
+
+    /* Node 0 is the root.  For each node, its failure link, the first
+       needle that ends there (or -1), and the nearest node down its
+       chain of failure links with a needle of its own (or -1).  */
+    int *fail;
+    int *needle;
+    int *out;
+
+    /* For each id, the next needle with the same string, or -1.  */
+    int *same;
+
+    /* What column of DELTA each byte uses, and how many columns; DELTA
+       has a row for each node, or is null if that would be too big.  */
+    unsigned char class[256];
+    int n_classes;
+    int *delta;
+
+    /* Without DELTA: the root's edges, where 0 is no edge, and the
+       other nodes' edges, EDGE_START[S] up to EDGE_START[S + 1] in
+       EDGE_BYTE and EDGE_TO, sorted by byte.  */
+    int root[256];
+    int *edge_start;
+    unsigned char *edge_byte;
+    int *edge_to;
+};
+
+void *ck_malloc(int size);
+void *ck_realloc(void *ptr, int size);
+
+struct multisearch *multisearch_new(void)
+{
+    struct multisearch *ms = (struct multisearch *)ck_malloc(sizeof(struct multisearch));
+
+    memset(ms, 0, sizeof *ms);
+    ms->max_id = -1;
+    return ms;
+}
+
+/* Add the LEN bytes at NEEDLE (which must not be empty, and are not
+   copied) to those MS looks for, to be reported as ID.  */
+void multisearch_add(struct multisearch *ms, char *needle, int len, int id)
+{
+    struct ms_needle *n;
+
+    if (!(ms->n_needles & (ms->n_needles - 1))) {
+        ms->needles = (struct ms_needle *)ck_realloc(ms->needles, (ms->n_needles ? 2 * ms->n_needles : 8) * sizeof(struct ms_needle));
+    }
+
+    n = &ms->needles[ms->n_needles++];
+    n->text = needle;
+    n->len = len;
+    n->id = id;
+    if (id > ms->max_id) {
+        ms->max_id = id;
+    }
+}
+
+/* The child of trie node S on C, or 0 if there isn't one.  */
+static int ms_child(struct multisearch *ms, int *child, int *sibling, unsigned char *byte, int s, unsigned char c)
+{
+    int t;
+
+    if (!s) {
+        return ms->root[c];
+    }
+    for (t = child[s]; t; t = sibling[t]) {
+        if (byte[t] == c) {
+            return t;
+        }
+    }
+    return 0;
+}
+
+/* Build the automaton, once every needle has been added.  */
+void multisearch_compile(struct multisearch *ms)
+{
+    int total = 1, i, j, c, head, tail;
+    int *child, *sibling, *queue;
+    unsigned char *byte;
+    char used[256];
+
+    memset(used, 0, sizeof used);
+    for (i = 0; i < ms->n_needles; i++) {
+        total += ms->needles[i].len;
+        for (j = 0; j < ms->needles[i].len; j++) {
+            used[(unsigned char)ms->needles[i].text[j]] = 1;
+        }
+    }
+
+    ms->n_classes = 1;
+    for (c = 0; c < 256; c++) {
+        ms->class[c] = used[c] ? ms->n_classes++ : 0;
+    }
+
+    ms->fail = (int *)ck_malloc(total * sizeof(int));
+    ms->needle = (int *)ck_malloc(total * sizeof(int));
+    ms->out = (int *)ck_malloc(total * sizeof(int));
+    ms->same = (int *)ck_malloc((ms->max_id + 1) * sizeof(int));
+    child = (int *)ck_malloc(total * sizeof(int));
+    sibling = (int *)ck_malloc(total * sizeof(int));
+    byte = (unsigned char *)ck_malloc(total);
+    queue = (int *)ck_malloc(total * sizeof(int));
+
+    /* The trie, with the root's edges in ROOT and the rest in lists */
+    memset(ms->root, 0, sizeof ms->root);
+    child[0] = 0;
+    ms->needle[0] = ms->out[0] = -1;
+    ms->n_nodes = 1;
+    for (i = 0; i < ms->n_needles; i++) {
+        struct ms_needle *n = &ms->needles[i];
+        int s = 0;
+
+        for (j = 0; j < n->len; j++) {
+            unsigned char b = n->text[j];
+            int t = ms_child(ms, child, sibling, byte, s, b);
+
+            if (!t) {
+                t = ms->n_nodes++;
+                child[t] = 0;
+                byte[t] = b;
+                ms->needle[t] = ms->out[t] = -1;
+                if (s) {
+                    sibling[t] = child[s];
+                    child[s] = t;
+                } else {
+                    ms->root[b] = t;
+                }
+            }
+            s = t;
+        }
+        ms->same[n->id] = ms->needle[s];
+        ms->needle[s] = n->id;
+    }
+
+    /* The failure links, breadth first, so that a node's link (which is
+       shallower) is finished by the time the node is looked at.  */
+    head = tail = 0;
+    ms->fail[0] = 0;
+    for (c = 0; c < 256; c++) {
+        if (ms->root[c]) {
+            ms->fail[ms->root[c]] = 0;
+            queue[tail++] = ms->root[c];
+        }
+    }
+    while (head < tail) {
+        int s = queue[head++];
+        int t;
+
+        for (t = child[s]; t; t = sibling[t]) {
+            int f = ms->fail[s];
+
+            while (f && !ms_child(ms, child, sibling, byte, f, byte[t])) {
+                f = ms->fail[f];
+            }
+            f = ms_child(ms, child, sibling, byte, f, byte[t]);
+            ms->fail[t] = f;
+            ms->out[t] = ms->needle[f] >= 0 ? f : ms->out[f];
+            queue[tail++] = t;
+        }
+    }
+
+    if ((double)ms->n_nodes * ms->n_classes <= MS_DENSE_MAX) {
+        /* Each row is its failure link's row (which comes earlier in
+           QUEUE), with the node's own edges put in.  */
+        int *row;
+
+        ms->delta = (int *)ck_malloc(ms->n_nodes * ms->n_classes * sizeof(int));
+        memset(ms->delta, 0, ms->n_classes * sizeof(int));
+        for (c = 0; c < 256; c++) {
+            if (ms->root[c]) {
+                ms->delta[ms->class[c]] = ms->root[c];
+            }
+        }
+        for (i = 0; i < tail; i++) {
+            int s = queue[i];
+            int t;
+
+            row = &ms->delta[s * ms->n_classes];
+            memcpy(row, &ms->delta[ms->fail[s] * ms->n_classes], ms->n_classes * sizeof(int));
+            for (t = child[s]; t; t = sibling[t]) {
+                row[ms->class[byte[t]]] = t;
+            }
+        }
+    } else {
+        int n_edges = 0;
+
+        ms->edge_start = (int *)ck_malloc((ms->n_nodes + 1) * sizeof(int));
+        ms->edge_byte = (unsigned char *)ck_malloc(total);
+        ms->edge_to = (int *)ck_malloc(total * sizeof(int));
+        for (i = 0; i < ms->n_nodes; i++) {
+            int t;
+
+            ms->edge_start[i] = n_edges;
+            for (t = i ? child[i] : 0; t; t = sibling[t]) {
+                /* Keep them sorted as they go in; there are few */
+                for (j = n_edges++; j > ms->edge_start[i] && ms->edge_byte[j - 1] > byte[t]; j--) {
+                    ms->edge_byte[j] = ms->edge_byte[j - 1];
+                    ms->edge_to[j] = ms->edge_to[j - 1];
+                }
+                ms->edge_byte[j] = byte[t];
+                ms->edge_to[j] = t;
+            }
+        }
+        ms->edge_start[ms->n_nodes] = n_edges;
+    }
+
+    free(child);
+    free(sibling);
+    free(byte);
+    free(queue);
+}
+
+/* The node to go to from S on C.  */
+static int ms_step(struct multisearch *ms, int s, unsigned char c)
+{
+    if (ms->delta) {
+        return ms->delta[s * ms->n_classes + ms->class[c]];
+    }
+
+    for (;;) {
+        int lo, hi, end;
+
+        if (!s) {
+            return ms->root[c];
+        }
+
+        lo = ms->edge_start[s];
+        end = hi = ms->edge_start[s + 1];
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+
+            if (ms->edge_byte[mid] < c) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        if (lo < end && ms->edge_byte[lo] == c) {
+            return ms->edge_to[lo];
+        }
+
+        s = ms->fail[s];
+    }
+}
+
+/* The first node, from S down its failure links, where a needle ends,
+   or -1 if there's none.  */
+#define MS_HIT(ms, s) ((ms)->needle[s] >= 0 ? (s) : (ms)->out[s])
+
+/* Set bit ID of FOUND for each needle of MS that occurs in the HAY_LEN
+   bytes at HAY.  Other bits are left alone.  */
+void multisearch_mark(struct multisearch *ms, char *hay, int hay_len, unsigned long *found)
+{
+    int bits = 8 * sizeof(unsigned long);
+    int left = ms->n_needles;
+    unsigned char *p = (unsigned char *)hay;
+    unsigned char *end = p + hay_len;
+    int s = 0;
+
+    while (p < end) {
+        int t;
+
+        if (ms->delta) {
+            s = ms->delta[s * ms->n_classes + ms->class[*p++]];
+        } else {
+            s = ms_step(ms, s, *p++);
+        }
+
+        for (t = MS_HIT(ms, s); t >= 0; t = ms->out[t]) {
+            int id;
+
+            for (id = ms->needle[t]; id >= 0; id = ms->same[id]) {
+                if (!(found[id / bits] & (1UL << id % bits))) {
+                    found[id / bits] |= 1UL << id % bits;
+                    left--;
+                }
+            }
+        }
+
+        /* Once everything has turned up there is nothing more to learn */
+        if (!left) {
+            return;
+        }
+    }
+}
+
+/* Find every place a needle of MS occurs in the HAY_LEN bytes at HAY,
+   overlapping or not.  Put the needle's id and the offset of the byte
+   after it, for each, one after the other in *FOUND, which is *ALLOC
+   ints long and grown with ck_realloc as need be, in the order they
+   end, and return how many there are.  */
+int multisearch_all(struct multisearch *ms, char *hay, int hay_len, int **found, int *alloc)
+{
+    unsigned char *p = (unsigned char *)hay;
+    unsigned char *end = p + hay_len;
+    int s = 0;
+    int n = 0;
+
+    while (p < end) {
+        int t, id;
+
+        if (ms->delta) {
+            s = ms->delta[s * ms->n_classes + ms->class[*p++]];
+        } else {
+            s = ms_step(ms, s, *p++);
+        }
+
+        for (t = MS_HIT(ms, s); t >= 0; t = ms->out[t]) {
+            for (id = ms->needle[t]; id >= 0; id = ms->same[id]) {
+                if (2 * n + 2 > *alloc) {
+                    *alloc = *alloc ? 2 * *alloc : 64;
+                    *found = (int *)ck_realloc(*found, *alloc * sizeof(int));
+                }
+                (*found)[2 * n] = id;
+                (*found)[2 * n + 1] = (char *)p - hay;
+                n++;
+            }
+        }
+    }
+
+    return n;
+}
+
+void multisearch_free(struct multisearch *ms)
+{
+    if (!ms) {
+        return;
+    }
+    free(ms->needles);
+    free(ms->fail);
+    free(ms->needle);
+    free(ms->out);
+    free(ms->same);
+    free(ms->delta);
+    free(ms->edge_start);
+    free(ms->edge_byte);
+    free(ms->edge_to);
+    free(ms);
+}
+
+/* Of N strings NEEDLE[I] (NEEDLE_LEN[I] bytes long, none empty), each
+   to be replaced in a text by REPL[I], one after another, find runs
+   where every needle can be looked for in the text as it was before
+   any of them was replaced, and set STARTS[I] if a new run starts at
+   I.  That can be done if no needle in the run can overlap the
+   replacement of an earlier one, or take in the join where an earlier
+   one was deleted: then replacing leaves no new needle behind, and only
+   takes away those it overlaps.  */
+void multisearch_groups(char **needle, int *needle_len, char **repl, int *repl_len, int n, char *starts)
+{
+    struct multisearch *ms = multisearch_new();
+    int *rlast, *rend, *rin;
+    int start = 0, last_empty = -1;
+    int i, k;
+
+    for (i = 0; i < n; i++) {
+        multisearch_add(ms, needle[i], needle_len[i], i);
+        if (repl_len[i]) {
+            multisearch_add(ms, repl[i], repl_len[i], n + i);
+        }
+    }
+    multisearch_compile(ms);
+
+    /* For each node, the last replacement whose string goes through it,
+       and the last with a suffix that ends there; for each needle, the
+       last replacement it's inside (all -1 until they're set) */
+    rlast = (int *)ck_malloc(2 * ms->n_nodes * sizeof(int));
+    rend = rlast + ms->n_nodes;
+    memset(rlast, -1, 2 * ms->n_nodes * sizeof(int));
+    rin = (int *)ck_malloc(n * sizeof(int) + 1);
+    memset(rin, -1, n * sizeof(int));
+
+    for (k = 0; k < n; k++) {
+        int clash = last_empty >= start || rin[k] >= start;
+        int s = 0, t, id;
+
+        /* A replacement of the run inside this needle, or ending in a
+           prefix of it */
+        for (i = 0; i < needle_len[k] && !clash; i++) {
+            s = ms_step(ms, s, needle[k][i]);
+            clash = rend[s] >= start;
+            for (t = MS_HIT(ms, s); t >= 0 && !clash; t = ms->out[t]) {
+                for (id = ms->needle[t]; id >= 0; id = ms->same[id]) {
+                    if (id >= n && id - n >= start && id - n < k) {
+                        clash = 1;
+                    }
+                }
+            }
+        }
+
+        /* A replacement of the run starting in a suffix of it */
+        for (t = s; t && !clash; t = ms->fail[t]) {
+            clash = rlast[t] >= start;
+        }
+
+        if (clash) {
+            start = k;
+        }
+        starts[k] = k == start;
+
+        if (!repl_len[k]) {
+            last_empty = k;
+            continue;
+        }
+
+        for (s = i = 0; i < repl_len[k]; i++) {
+            s = ms_step(ms, s, repl[k][i]);
+            rlast[s] = k;
+            for (t = MS_HIT(ms, s); t >= 0; t = ms->out[t]) {
+                for (id = ms->needle[t]; id >= 0; id = ms->same[id]) {
+                    if (id < n) {
+                        rin[id] = k;
+                    }
+                }
+            }
+        }
+        for (t = s; t; t = ms->fail[t]) {
+            rend[t] = k;
+        }
+    }
+
+    free(rlast);
+    free(rin);
+    multisearch_free(ms);
+}
@@ -121,9 +121,22 @@ static void init_syntax_once() {
 /* Get the interface, including the syntax bits.  */
 #include "regex.h"
 
+#ifndef NO_THREADS
+#include <pthread.h>
+#endif
+
 /* isalpha etc. are used for the character classes.  */
 #include <ctype.h>
 
+/* On x86, `re_search_2' can scan for possible starting points with
+   vector instructions, picking SSE2, SSSE3 or AVX2 code according to
+   what the processor it is running on supports.  Define REGEX_NO_SIMD
+   to do without.  */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && !defined(REGEX_NO_SIMD) && !defined(emacs)
+#define REGEX_SIMD
+#include <immintrin.h>
+#endif
+
 #ifndef isascii
 #define isascii(c) 1
 #endif
@@ -180,6 +193,7 @@ static void init_syntax_once() {
 
 #define REGEX_ALLOCATE malloc
 #define REGEX_REALLOCATE(source, osize, nsize) realloc(source, nsize)
+#define REGEX_FREE free
 
 #else /* not REGEX_MALLOC  */
 
@@ -209,6 +223,9 @@ char *alloca();
      bcopy(source, destination, osize),        \
      destination)
 
+/* No need to free the memory for alloca.  */
+#define REGEX_FREE(arg) ((void)0)
+
 #endif /* not REGEX_MALLOC */
 
 /* True if `size1' is non-NULL and PTR is pointing anywhere inside
@@ -2153,8 +2170,8 @@ typedef struct
 /* Push the information about the state we will need
    if we ever fail back to it.
 
-   Requires variables fail_stack, regstart, regend, reg_info, and
-   num_regs be declared.  DOUBLE_FAIL_STACK requires `destination' be
+   Requires variables fail_stack, regstart, regend, reg_info, num_regs
+   and stats be declared.  DOUBLE_FAIL_STACK requires `destination' be
    declared.
 
    Does `return FAILURE_CODE' if runs out of memory.  */
@@ -2177,8 +2194,10 @@ typedef struct
                                                                              \
         /* Ensure we have enough space allocated for what we will push.  */  \
         while (REMAINING_AVAIL_SLOTS < NUM_FAILURE_ITEMS) {                  \
-            if (!DOUBLE_FAIL_STACK(fail_stack))                              \
+            if (!DOUBLE_FAIL_STACK(fail_stack)) {                            \
+                FREE_VARIABLES();                                            \
                 return failure_code;                                         \
+            }                                                                \
                                                                              \
             DEBUG_PRINT2("\n  Doubled stack; size now: %d\n",                \
                          (fail_stack).size);                                 \
@@ -2229,6 +2248,9 @@ typedef struct
                                                                              \
         DEBUG_PRINT2("  Pushing failure id: %u\n", failure_id);              \
         DEBUG_PUSH(failure_id);                                              \
+                                                                             \
+        if (stats && (fail_stack).avail > stats->max_failures)               \
+            stats->max_failures = (fail_stack).avail;                        \
     } while (0)
 
 /* This is the number of items that are pushed and popped on the stack
@@ -2333,6 +2355,97 @@ typedef struct
 
    Returns 0 if we succeed, -2 if an internal error.   */
 
+/* Fill in the `fastmap_scan', `fastmap_bytes', `fastmap_lo' and
+   `fastmap_hi' fields of BUFP from its fastmap and translate table.
+
+   The nibble tables work by sorting the bytes that can start a match by
+   their high four bits, and giving each distinct set of low four bits
+   that occurs one of eight bucket bits.  If there are more than eight
+   distinct sets, some share a bucket, and the tables then let through a
+   few bytes they shouldn't; `fastmap_skip' checks every candidate
+   against the fastmap itself, so that only costs time.  */
+static void
+compile_fastmap_scan(bufp) struct re_pattern_buffer *bufp;
+{
+    register char *fastmap = bufp->fastmap;
+    register char *translate = bufp->translate;
+    unsigned lows[16];  /* Low nibbles allowed, by high nibble.  */
+    unsigned buckets[8];
+    int nbuckets = 0;
+    int count = 0;
+    int c, h, k;
+
+    bufp->fastmap_scan = 0;
+    bzero(lows, sizeof lows);
+    bzero(bufp->fastmap_lo, sizeof bufp->fastmap_lo);
+    bzero(bufp->fastmap_hi, sizeof bufp->fastmap_hi);
+
+    for (c = 0; c < 1 << BYTEWIDTH; c++)
+        if (fastmap[(unsigned char)TRANSLATE(c)]) {
+            if (count < 3)
+                bufp->fastmap_bytes[count] = c;
+            count++;
+            lows[c >> 4] |= 1 << (c & 15);
+        }
+
+    /* If every byte will do, there is nothing to skip.  */
+    if (count == 1 << BYTEWIDTH)
+        return;
+
+    if (count >= 1 && count <= 3) {
+        bufp->fastmap_scan = count;
+        return;
+    }
+
+    for (h = 0; h < 16; h++) {
+        if (!lows[h])
+            continue;
+
+        for (k = 0; k < nbuckets; k++)
+            if (buckets[k] == lows[h])
+                break;
+
+        if (k == nbuckets) {
+            if (nbuckets < 8)
+                buckets[nbuckets++] = lows[h];
+            else {
+                /* Share the bucket that lets through the fewest extra
+                   bytes.  */
+                int best = 0, best_extra = 17;
+
+                for (k = 0; k < 8; k++) {
+                    unsigned extra = lows[h] & ~buckets[k];
+                    int n = 0;
+
+                    for (; extra; extra &= extra - 1)
+                        n++;
+                    if (n < best_extra)
+                        best = k, best_extra = n;
+                }
+                k = best;
+                buckets[k] |= lows[h];
+            }
+        }
+
+        bufp->fastmap_hi[h] |= 1 << k;
+    }
+
+    for (k = 0; k < nbuckets; k++)
+        for (c = 0; c < 16; c++)
+            if (buckets[k] & (1 << c))
+                bufp->fastmap_lo[c] |= 1 << k;
+
+    bufp->fastmap_scan = 4;
+}
+
+/* The failure stack has to go however we leave; with REGEX_MALLOC it
+   would otherwise be lost every time a pattern is compiled.  */
+#define FASTMAP_RETURN(value)            \
+    do {                                 \
+        REGEX_FREE(fail_stack.stack);    \
+        return value;                    \
+    } while (0)
+
 int
     re_compile_fastmap(bufp) struct re_pattern_buffer *bufp;
 {
@@ -2365,6 +2478,7 @@ int
     bzero(fastmap, 1 << BYTEWIDTH); /* Assume nothing's valid.  */
     bufp->fastmap_accurate = 1;     /* It will be when we're done.  */
     bufp->can_be_null = 0;
+    bufp->fastmap_scan = 0;
 
     while (p != pend || !FAIL_STACK_EMPTY()) {
         if (p == pend) {
@@ -2393,7 +2507,7 @@ int
            that is all we do.  */
             case duplicate:
                 bufp->can_be_null = 1;
-                return 0;
+                FASTMAP_RETURN(0);
 
                 /* Following are the cases which match a character.  These end
          with `break'.  */
@@ -2442,7 +2556,7 @@ int
                 /* Return if we have already set `can_be_null'; if we have,
              then the fastmap is irrelevant.  Something's wrong here.  */
                 else if (bufp->can_be_null)
-                    return 0;
+                    FASTMAP_RETURN(0);
 
                 /* Otherwise, have to check alternative paths.  */
                 break;
@@ -2526,7 +2640,7 @@ int
              the null string, though.  */
                 if (p + j < pend) {
                     if (!PUSH_PATTERN_OP(p + j, fail_stack))
-                        return -2;
+                        FASTMAP_RETURN(-2);
                 } else
                     bufp->can_be_null = 1;
 
@@ -2576,9 +2690,13 @@ int
     /* Set `can_be_null' for the last path (also the first path, if the
      pattern is empty).  */
     bufp->can_be_null |= path_can_be_null;
-    return 0;
+
+    compile_fastmap_scan(bufp);
+    FASTMAP_RETURN(0);
 } /* re_compile_fastmap */
 
+#undef FASTMAP_RETURN
+
 /* Set REGS to hold NUM_REGS registers, storing them in STARTS and
    ENDS.  Subsequent matches using PATTERN_BUFFER and REGS will use
    this memory for recording register information.  STARTS and ENDS
@@ -2607,6 +2725,135 @@ void re_set_registers(struct re_pattern_buffer *bufp, struct re_registers *regs,
 
 /* Searching routines.  */
 
+/* Is the byte C a possible start of a match, according to the fastmap?
+   Assumes `fastmap' and `translate' variables.  */
+#define FASTMAP_HIT(c) (fastmap[(unsigned char)TRANSLATE(c)])
+
+#ifdef REGEX_SIMD
+
+/* The vector scanners below look at the N bytes at D a block at a time,
+   and return either the index of the first byte that could start a
+   match, or the index of the first byte they didn't get to.  */
+
+/* For when only two or three bytes can start a match.  */
+__attribute__((target("sse2"))) static int
+fastmap_skip_sse2(struct re_pattern_buffer *bufp, const unsigned char *d, int n)
+{
+    __m128i b0 = _mm_set1_epi8(bufp->fastmap_bytes[0]);
+    __m128i b1 = _mm_set1_epi8(bufp->fastmap_bytes[1]);
+    __m128i b2 = _mm_set1_epi8(bufp->fastmap_bytes[bufp->fastmap_scan == 3 ? 2 : 1]);
+    int i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(d + i));
+        __m128i eq = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, b0), _mm_cmpeq_epi8(v, b1)),
+                                  _mm_cmpeq_epi8(v, b2));
+        unsigned bits = _mm_movemask_epi8(eq);
+
+        if (bits)
+            return i + __builtin_ctz(bits);
+    }
+    return i;
+}
+
+__attribute__((target("ssse3"))) static int
+fastmap_skip_ssse3(struct re_pattern_buffer *bufp, const unsigned char *d, int n)
+{
+    register char *fastmap = bufp->fastmap;
+    register char *translate = bufp->translate;
+    __m128i lo = _mm_loadu_si128((const __m128i *)bufp->fastmap_lo);
+    __m128i hi = _mm_loadu_si128((const __m128i *)bufp->fastmap_hi);
+    __m128i nibble = _mm_set1_epi8(0x0f);
+    __m128i zero = _mm_setzero_si128();
+    int i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(d + i));
+        __m128i l = _mm_shuffle_epi8(lo, _mm_and_si128(v, nibble));
+        __m128i h = _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi16(v, 4), nibble));
+        unsigned bits = ~_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(l, h), zero)) & 0xffff;
+
+        for (; bits; bits &= bits - 1) {
+            int j = i + __builtin_ctz(bits);
+
+            if (FASTMAP_HIT(d[j]))
+                return j;
+        }
+    }
+    return i;
+}
+
+__attribute__((target("avx2"))) static int
+fastmap_skip_avx2(struct re_pattern_buffer *bufp, const unsigned char *d, int n)
+{
+    register char *fastmap = bufp->fastmap;
+    register char *translate = bufp->translate;
+    __m256i lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)bufp->fastmap_lo));
+    __m256i hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)bufp->fastmap_hi));
+    __m256i nibble = _mm256_set1_epi8(0x0f);
+    __m256i zero = _mm256_setzero_si256();
+    int i;
+
+    for (i = 0; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(d + i));
+        __m256i l = _mm256_shuffle_epi8(lo, _mm256_and_si256(v, nibble));
+        __m256i h = _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+        unsigned bits = ~(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(l, h), zero));
+
+        for (; bits; bits &= bits - 1) {
+            int j = i + __builtin_ctz(bits);
+
+            if (FASTMAP_HIT(d[j]))
+                return j;
+        }
+    }
+    return i;
+}
+
+#endif /* REGEX_SIMD */
+
+/* Return the index of the first of the N bytes at D that could start a
+   match of BUFP, according to its fastmap, or N if none of them could.
+   This is the loop at the top of `re_search_2', done in bigger steps
+   when the pattern buffer says how.  */
+static int fastmap_skip(struct re_pattern_buffer *bufp, const unsigned char *d, int n)
+{
+    register char *fastmap = bufp->fastmap;
+    register char *translate = bufp->translate;
+    int i = 0;
+
+    if (n >= 16)
+        switch (bufp->fastmap_scan) {
+            case 1: {
+                const unsigned char *p = memchr(d, bufp->fastmap_bytes[0], n);
+                return p ? p - d : n;
+            }
+#ifdef REGEX_SIMD
+            case 2:
+            case 3:
+                if (__builtin_cpu_supports("sse2"))
+                    i = fastmap_skip_sse2(bufp, d, n);
+                break;
+            case 4:
+                if (n >= 32 && __builtin_cpu_supports("avx2"))
+                    i = fastmap_skip_avx2(bufp, d, n);
+                else if (__builtin_cpu_supports("ssse3"))
+                    i = fastmap_skip_ssse3(bufp, d, n);
+                break;
+#endif
+        }
+
+    /* Written out as an if-else to avoid testing `translate'
+       inside the loop.  */
+    if (translate)
+        while (i < n && !fastmap[(unsigned char)translate[d[i]]])
+            i++;
+    else
+        while (i < n && !fastmap[d[i]])
+            i++;
+    return i;
+}
+
 /* Like re_search_2, below, but only one string is specified, and
    doesn't let you say where to stop matching. */
 
@@ -2615,6 +2862,22 @@ int re_search(struct re_pattern_buffer *bufp, const char *string, int size, int
     return re_search_2(bufp, NULL, 0, string, size, startpos, range, regs, size);
 }
 
+/* Storage class for data that each thread needs its own copy of.  */
+#if defined(__GNUC__) && !defined(REGEX_NO_THREAD_LOCAL)
+#define REGEX_THREAD_LOCAL __thread
+#else
+#define REGEX_THREAD_LOCAL
+#endif
+
+/* Where this thread's searches and matches are being counted, if
+   anywhere.  */
+static REGEX_THREAD_LOCAL struct re_stats *re_stats;
+
+void re_set_stats(stats) struct re_stats *stats;
+{
+    re_stats = stats;
+}
+
 /* Using the compiled pattern in BUFP->buffer, first tries to match the
    virtual concatenation of STRING1 and STRING2, starting first at index
    STARTPOS, then at STARTPOS + 1, and so on.
@@ -2650,6 +2913,10 @@ int stop;
     register char *translate = bufp->translate;
     int total_size = size1 + size2;
     int endpos = startpos + range;
+    struct re_stats *stats = re_stats;
+
+    if (stats)
+        stats->searches++;
 
     /* Check for out-of-range STARTPOS.  */
     if (startpos < 0 || startpos > total_size)
@@ -2694,25 +2961,22 @@ int stop;
 
                 d = (startpos >= size1 ? string2 - size1 : string1) + startpos;
 
-                /* Written out as an if-else to avoid testing `translate'
-                 inside the loop.  */
-                if (translate)
-                    while (range > lim && !fastmap[(unsigned char)
-                                                       translate[(unsigned char)*d++]])
-                        range--;
-                else
-                    while (range > lim && !fastmap[(unsigned char)*d++])
-                        range--;
+                range -= fastmap_skip(bufp, (const unsigned char *)d, range - lim);
 
                 startpos += irange - range;
+                if (stats)
+                    stats->fastmap_skips += irange - range;
             } else /* Searching backwards.  */
             {
                 register char c = (size1 == 0 || startpos >= size1
                                        ? string2[startpos - size1]
                                        : string1[startpos]);
 
-                if (!fastmap[(unsigned char)TRANSLATE(c)])
+                if (!fastmap[(unsigned char)TRANSLATE(c)]) {
+                    if (stats)
+                        stats->fastmap_skips++;
                     goto advance;
+                }
             }
         }
 
@@ -2720,6 +2984,8 @@ int stop;
         if (range >= 0 && startpos == total_size && fastmap && !bufp->can_be_null)
             return -1;
 
+        if (stats)
+            stats->attempts++;
         val = re_match_2(bufp, string1, size1, string2, size2,
                          startpos, regs, stop);
         if (val >= 0)
@@ -2834,23 +3100,108 @@ typedef union {
 #define AT_WORD_BOUNDARY(d) \
     (AT_STRINGS_BEG(d) || AT_STRINGS_END(d) || WORDCHAR_P(d - 1) != WORDCHAR_P(d))
 
-/* Free everything we malloc.  */
 #ifdef REGEX_MALLOC
-#define FREE_VAR(var)   \
-    if (var) free(var); \
-    var = NULL
-#define FREE_VARIABLES()            \
-    do {                            \
-        FREE_VAR(fail_stack.stack); \
-        FREE_VAR(regstart);         \
-        FREE_VAR(regend);           \
-        FREE_VAR(old_regstart);     \
-        FREE_VAR(old_regend);       \
-        FREE_VAR(best_regstart);    \
-        FREE_VAR(best_regend);      \
-        FREE_VAR(reg_info);         \
-        FREE_VAR(reg_dummy);        \
-        FREE_VAR(reg_info_dummy);   \
+/* With REGEX_MALLOC, `re_match_2' would have to malloc its register
+   arrays and failure stack afresh on every call, and `re_search_2' calls
+   it once for every starting position it tries.  So instead they are
+   kept here between calls.  The register arrays only ever grow; a
+   failure stack that grew past MATCH_SPACE_KEEP items is given back
+   when the match is done.  There is one of these per thread, so that a
+   compiled pattern can be used by several threads, and it is freed when
+   the thread exits.  */
+
+#define MATCH_SPACE_KEEP 16384
+
+typedef struct
+{
+    /* Number of registers the arrays below have room for.  */
+    unsigned num_regs;
+    const char **regstart, **regend;
+    const char **old_regstart, **old_regend;
+    const char **best_regstart, **best_regend;
+    const char **reg_dummy;
+    register_info_type *reg_info, *reg_info_dummy;
+
+    /* The failure stack, and how many items it has room for.  */
+    fail_stack_elt_t *fail_stack;
+    unsigned fail_stack_size;
+} match_space_type;
+
+static REGEX_THREAD_LOCAL match_space_type match_space;
+
+#if !defined(NO_THREADS) && defined(__GNUC__) && !defined(REGEX_NO_THREAD_LOCAL)
+#define MATCH_SPACE_FREE_AT_EXIT
+static pthread_key_t match_space_key;
+static pthread_once_t match_space_once = PTHREAD_ONCE_INIT;
+
+static void match_space_exit(void *unused)
+{
+    free(match_space.fail_stack);
+    free(match_space.regstart);
+    match_space.fail_stack = NULL;
+    match_space.fail_stack_size = 0;
+    match_space.regstart = NULL;
+    match_space.num_regs = 0;
+}
+
+static void match_space_make_key(void)
+{
+    pthread_key_create(&match_space_key, match_space_exit);
+}
+#endif
+
+/* Make sure `match_space' has room for NUM_REGS registers and has a
+   failure stack.  Return 0 if we run out of memory.  */
+static boolean get_match_space(unsigned num_regs)
+{
+    if (!match_space.fail_stack) {
+        match_space.fail_stack = TALLOC(INIT_FAILURE_ALLOC, fail_stack_elt_t);
+        if (!match_space.fail_stack)
+            return false;
+        match_space.fail_stack_size = INIT_FAILURE_ALLOC;
+#ifdef MATCH_SPACE_FREE_AT_EXIT
+        pthread_once(&match_space_once, match_space_make_key);
+        pthread_setspecific(match_space_key, &match_space);
+#endif
+    }
+
+    if (num_regs > match_space.num_regs) {
+        /* All nine arrays live in one block; the pointer arrays first,
+           so everything stays suitably aligned.  */
+        unsigned n = MAX(num_regs, 2 * match_space.num_regs);
+        const char **block;
+
+        block = (const char **)realloc(match_space.regstart,
+                                       n * (7 * sizeof(const char *) + 2 * sizeof(register_info_type)));
+        if (!block)
+            return false;
+
+        match_space.num_regs = n;
+        match_space.regstart = block;
+        match_space.regend = block + n;
+        match_space.old_regstart = block + 2 * n;
+        match_space.old_regend = block + 3 * n;
+        match_space.best_regstart = block + 4 * n;
+        match_space.best_regend = block + 5 * n;
+        match_space.reg_dummy = block + 6 * n;
+        match_space.reg_info = (register_info_type *)(block + 7 * n);
+        match_space.reg_info_dummy = match_space.reg_info + n;
+    }
+
+    return true;
+}
+
+/* Hand the failure stack back to `match_space'; `DOUBLE_FAIL_STACK' may
+   have moved it.  Unless it has grown too big to keep, nothing else
+   needs freeing.  */
+#define FREE_VARIABLES()                                                \
+    do {                                                                \
+        if (fail_stack.stack && fail_stack.size > MATCH_SPACE_KEEP) {   \
+            free(fail_stack.stack);                                     \
+            fail_stack.stack = NULL;                                    \
+        }                                                               \
+        match_space.fail_stack = fail_stack.stack;                      \
+        match_space.fail_stack_size = fail_stack.stack ? fail_stack.size : 0; \
     } while (0)
 #else /* not REGEX_MALLOC */
 /* Some MIPS systems (at least) want this to free alloca'd storage.  */
@@ -2924,6 +3275,9 @@ int stop;
     /* We use this to map every character in the string.  */
     char *translate = bufp->translate;
 
+    /* Where to count this attempt and the failure stack's depth.  */
+    struct re_stats *stats = re_stats;
+
     /* Failure point stack.  Each place that can handle a failure further
      down the line pushes a failure point on this stack.  It consists of
      restart, regend, and reg_info for all registers corresponding to
@@ -3000,6 +3354,29 @@ int stop;
 
     DEBUG_PRINT1("\n\nEntering re_match_2.\n");
 
+#ifdef REGEX_MALLOC
+    if (!get_match_space(num_regs))
+        return -2;
+
+    fail_stack.stack = match_space.fail_stack;
+    fail_stack.size = match_space.fail_stack_size;
+    fail_stack.avail = 0;
+
+    if (bufp->re_nsub) {
+        regstart = match_space.regstart;
+        regend = match_space.regend;
+        old_regstart = match_space.old_regstart;
+        old_regend = match_space.old_regend;
+        best_regstart = match_space.best_regstart;
+        best_regend = match_space.best_regend;
+        reg_info = match_space.reg_info;
+        reg_dummy = match_space.reg_dummy;
+        reg_info_dummy = match_space.reg_info_dummy;
+    } else {
+        regstart = regend = old_regstart = old_regend = best_regstart = best_regend = reg_dummy = NULL;
+        reg_info = reg_info_dummy = (register_info_type *)NULL;
+    }
+#else  /* not REGEX_MALLOC */
     INIT_FAIL_STACK();
 
     /* Do not bother to initialize all the register variables if there are
@@ -3023,14 +3400,7 @@ int stop;
             return -2;
         }
     }
-#ifdef REGEX_MALLOC
-    else {
-        /* We must initialize all our variables to NULL, so that
-         `FREE_VARIABLES' doesn't try to free them.  */
-        regstart = regend = old_regstart = old_regend = best_regstart = best_regend = reg_dummy = NULL;
-        reg_info = reg_info_dummy = (register_info_type *)NULL;
-    }
-#endif /* REGEX_MALLOC */
+#endif /* not REGEX_MALLOC */
 
     /* The starting position is bogus.  */
     if (pos < 0 || pos > size1 + size2) {
@@ -4236,6 +4606,760 @@ const char *re_compile_pattern(const char *pattern, int length, struct re_patter
     return re_error_msg[(int)ret];
 }
 
+/* A lazily built DFA, for callers that only need to know whether a
+   pattern matches somewhere in a string, and not where or how.  It
+   looks at each character of the string once, so its running time is
+   linear however the pattern is written.
+
+   The compiled pattern is turned into an NFA with one node for each
+   character-matching position (each character of an `exactn' gets its
+   own node).  Jumps become epsilon edges, `on_failure_jump' and friends
+   become splits, the anchors become assertions and the group markers
+   disappear.  DFA states are sets of NFA nodes; each is built the first
+   time it's needed, and there is a limit on how many are kept.
+
+   Back references (`duplicate') take us outside what a DFA can do, and
+   intervals (`succeed_n', `jump_n', `set_number_at') and the word
+   boundary assertions aren't handled either; `re_dfa_compile' returns
+   NULL for those and the caller should use `re_search'.  */
+
+typedef enum {
+    dfa_set,     /* Match one character in `set', then go to `next'.  */
+    dfa_jump,    /* Go to `next'.  */
+    dfa_split,   /* Go to both `next' and `alt'.  */
+    dfa_begbuf,  /* Assertions; if they hold, go to `next'.  */
+    dfa_endbuf,
+    dfa_begline,
+    dfa_endline,
+    dfa_accept   /* The pattern has matched.  */
+} dfa_node_type;
+
+struct dfa_node
+{
+    dfa_node_type type;
+    int next, alt;
+    unsigned char set[(1 << BYTEWIDTH) / BYTEWIDTH];
+};
+
+struct re_dfa
+{
+    struct dfa_node *nodes;
+    int n_nodes;
+
+    /* Which slot in each thread's `dfa_caches' is ours, and which of
+       the DFAs to have had that slot we are.  */
+    int id;
+    unsigned gen;
+
+    /* Nonzero if the pattern starts with `begbuf', so that there is no
+       point in looking for a match that starts further on.  */
+    int anchored;
+
+    char *translate;
+    unsigned not_bol : 1;
+    unsigned not_eol : 1;
+    unsigned newline_anchor : 1;
+};
+
+/* What came before the current position, as far as `begbuf' and
+   `begline' care.  */
+#define DFA_AT_START 0
+#define DFA_AFTER_NEWLINE 1
+#define DFA_AFTER_OTHER 2
+
+/* Flags for `dfa_closure': what comes after the current position, as
+   far as `endbuf' and `endline' care.  Without them, those nodes stay
+   in the set to be looked at again once we know.  */
+#define DFA_PASS_ENDLINE 1
+#define DFA_PASS_ENDBUF 2
+
+struct dfa_state
+{
+    int *nodes; /* Sorted.  */
+    int n_nodes;
+    int context;
+    unsigned hash;
+
+    /* Nonzero if the set contains the accepting node.  */
+    char accepting;
+
+    /* Nonzero if the set contains an `endline' node.  */
+    char has_endline;
+
+    /* Whether the pattern matches if the string ends here; -1 if we
+       haven't worked that out yet.  */
+    char accepts_at_end;
+
+    struct dfa_state *hash_next;
+
+    /* The state to go to on each character, or NULL if not known yet.  */
+    struct dfa_state *trans[1 << BYTEWIDTH];
+};
+
+/* Above this many states, the cache is thrown away and started afresh.  */
+#ifndef DFA_MAX_STATES
+#define DFA_MAX_STATES 1024
+#endif
+
+#define DFA_HASH_SIZE 1024
+
+/* The mutable half of a DFA.  Each thread has its own, so that a
+   compiled DFA can be shared.  */
+struct dfa_cache
+{
+    /* The `gen' of the DFA this was made for; a cache left by a DFA
+       that has been freed is thrown away when its slot is next used.  */
+    unsigned gen;
+
+    struct dfa_state *table[DFA_HASH_SIZE];
+    int n_states;
+    struct dfa_state *start;
+
+    /* Counts calls to `dfa_flush'.  */
+    unsigned flushes;
+
+    /* Scratch space for `dfa_closure' and `dfa_step', sized for the
+       number of nodes.  */
+    int *mark;
+    int generation;
+    int *stack;
+    int *set1, *set2;
+};
+
+static REGEX_THREAD_LOCAL struct dfa_cache **dfa_caches;
+static REGEX_THREAD_LOCAL int dfa_n_caches;
+
+/* Slots are handed out again once their DFA is freed, so that the
+   threads' `dfa_caches' only grow with the number of DFAs there are at
+   once.  DFA_ID_GEN counts how many DFAs each slot has had.  */
+static int dfa_next_id = 0;
+static int *dfa_free_ids;
+static int dfa_n_free;
+static unsigned *dfa_id_gen;
+#ifndef NO_THREADS
+static pthread_mutex_t dfa_id_lock = PTHREAD_MUTEX_INITIALIZER;
+#define DFA_LOCK() pthread_mutex_lock(&dfa_id_lock)
+#define DFA_UNLOCK() pthread_mutex_unlock(&dfa_id_lock)
+#else
+#define DFA_LOCK()
+#define DFA_UNLOCK()
+#endif
+
+/* Give DFA a slot.  Return 0 if memory runs out.  */
+static int dfa_take_id(struct re_dfa *dfa)
+{
+    int ok = 1;
+
+    DFA_LOCK();
+    if (dfa_n_free) {
+        dfa->id = dfa_free_ids[--dfa_n_free];
+    } else {
+        unsigned *gen = (unsigned *)realloc(dfa_id_gen, (dfa_next_id + 1) * sizeof *gen);
+        int *ids = (int *)realloc(dfa_free_ids, (dfa_next_id + 1) * sizeof *ids);
+
+        if (gen)
+            dfa_id_gen = gen;
+        if (ids)
+            dfa_free_ids = ids;
+        if (gen && ids) {
+            dfa->id = dfa_next_id++;
+            dfa_id_gen[dfa->id] = 0;
+        } else
+            ok = 0;
+    }
+    if (ok)
+        dfa->gen = ++dfa_id_gen[dfa->id];
+    DFA_UNLOCK();
+    return ok;
+}
+
+static void dfa_cache_free(struct dfa_cache *cache);
+
+#if !defined(NO_THREADS) && defined(__GNUC__) && !defined(REGEX_NO_THREAD_LOCAL)
+/* A thread's caches are freed when it exits.  */
+#define DFA_FREE_AT_EXIT
+static pthread_key_t dfa_exit_key;
+static pthread_once_t dfa_exit_once = PTHREAD_ONCE_INIT;
+
+static void dfa_thread_exit(void *unused)
+{
+    int i;
+
+    for (i = 0; i < dfa_n_caches; i++)
+        if (dfa_caches[i])
+            dfa_cache_free(dfa_caches[i]);
+    free(dfa_caches);
+    dfa_caches = NULL;
+    dfa_n_caches = 0;
+}
+
+static void dfa_make_exit_key(void)
+{
+    pthread_key_create(&dfa_exit_key, dfa_thread_exit);
+}
+#endif
+
+/* Let another DFA have DFA's slot.  */
+static void dfa_give_id(struct re_dfa *dfa)
+{
+    DFA_LOCK();
+    dfa_free_ids[dfa_n_free++] = dfa->id;
+    DFA_UNLOCK();
+}
+
+/* How many NFA nodes the operation at P needs, or -1 if we can't do it.  */
+static int dfa_op_size(unsigned char *p)
+{
+    switch ((re_opcode_t)*p) {
+        case exactn:
+            return p[1];
+
+        case no_op:
+        case anychar:
+        case charset:
+        case charset_not:
+        case wordchar:
+        case notwordchar:
+        case start_memory:
+        case stop_memory:
+        case begline:
+        case endline:
+        case begbuf:
+        case endbuf:
+        case jump:
+        case jump_past_alt:
+        case on_failure_jump:
+        case on_failure_keep_string_jump:
+        case pop_failure_jump:
+        case maybe_pop_jump:
+        case dummy_failure_jump:
+        case push_dummy_failure:
+            return 1;
+
+        default:
+            return -1;
+    }
+}
+
+/* How many bytes of pattern the operation at P takes up.  */
+static int dfa_op_length(unsigned char *p)
+{
+    switch ((re_opcode_t)*p) {
+        case exactn:
+            return 2 + p[1];
+
+        case charset:
+        case charset_not:
+            return 2 + p[1];
+
+        case start_memory:
+        case stop_memory:
+            return 3;
+
+        case jump:
+        case jump_past_alt:
+        case on_failure_jump:
+        case on_failure_keep_string_jump:
+        case pop_failure_jump:
+        case maybe_pop_jump:
+        case dummy_failure_jump:
+            return 3;
+
+        default:
+            return 1;
+    }
+}
+
+/* Build a DFA for the pattern compiled in BUFP.  Return NULL if the
+   pattern uses something the DFA can't do, or if memory runs out.  */
+struct re_dfa *re_dfa_compile(struct re_pattern_buffer *bufp)
+{
+    unsigned char *pattern = bufp->buffer;
+    unsigned char *pend = pattern + bufp->used;
+    unsigned char *p;
+    int *op_node;
+    int n_nodes = 0;
+    int n, i;
+    struct re_dfa *dfa;
+    struct dfa_node *node;
+
+#if !defined(emacs) && !defined(SYNTAX_TABLE)
+    init_syntax_once();
+#endif
+
+    /* First pass: find out which node each operation starts at.  */
+    op_node = TALLOC(bufp->used + 1, int);
+    if (!op_node)
+        return NULL;
+
+    for (p = pattern; p < pend; p += dfa_op_length(p)) {
+        n = dfa_op_size(p);
+        if (n < 0) {
+            free(op_node);
+            return NULL;
+        }
+
+        op_node[p - pattern] = n_nodes;
+        n_nodes += n;
+    }
+    op_node[bufp->used] = n_nodes++; /* The accepting node.  */
+
+    dfa = TALLOC(1, struct re_dfa);
+    if (!dfa) {
+        free(op_node);
+        return NULL;
+    }
+
+    dfa->nodes = TALLOC(n_nodes, struct dfa_node);
+    if (!dfa->nodes) {
+        free(dfa);
+        free(op_node);
+        return NULL;
+    }
+
+    dfa->n_nodes = n_nodes;
+    dfa->translate = bufp->translate;
+    dfa->not_bol = bufp->not_bol;
+    dfa->not_eol = bufp->not_eol;
+    dfa->newline_anchor = bufp->newline_anchor;
+    dfa->anchored = bufp->used > 0 && (re_opcode_t)*pattern == begbuf;
+
+    /* Second pass: fill the nodes in.  */
+    node = dfa->nodes;
+    for (p = pattern; p < pend; p += dfa_op_length(p)) {
+        int next_node = op_node[p - pattern] + dfa_op_size(p);
+        int c, mcnt;
+        unsigned char *p1;
+
+        switch ((re_opcode_t)*p) {
+            case exactn:
+                for (i = 0; i < p[1]; i++, node++) {
+                    node->type = dfa_set;
+                    node->next = node - dfa->nodes + 1;
+                    bzero(node->set, sizeof node->set);
+                    node->set[p[2 + i] / BYTEWIDTH] |= 1 << (p[2 + i] % BYTEWIDTH);
+                }
+                continue;
+
+            case anychar:
+                node->type = dfa_set;
+                for (c = 0; c < sizeof node->set; c++)
+                    node->set[c] = 0xff;
+                if (!(bufp->syntax & RE_DOT_NEWLINE))
+                    node->set['\n' / BYTEWIDTH] &= ~(1 << ('\n' % BYTEWIDTH));
+                if (bufp->syntax & RE_DOT_NOT_NULL)
+                    node->set[0] &= ~1;
+                break;
+
+            case charset:
+            case charset_not:
+                node->type = dfa_set;
+                bzero(node->set, sizeof node->set);
+                bcopy(p + 2, node->set, MIN(p[1], sizeof node->set));
+                if ((re_opcode_t)*p == charset_not)
+                    for (c = 0; c < sizeof node->set; c++)
+                        node->set[c] = ~node->set[c];
+                break;
+
+            case wordchar:
+            case notwordchar:
+                node->type = dfa_set;
+                bzero(node->set, sizeof node->set);
+                for (c = 0; c < (1 << BYTEWIDTH); c++)
+                    if ((SYNTAX(c) == Sword) == ((re_opcode_t)*p == wordchar))
+                        node->set[c / BYTEWIDTH] |= 1 << (c % BYTEWIDTH);
+                break;
+
+            case begbuf:
+                node->type = dfa_begbuf;
+                break;
+
+            case endbuf:
+                node->type = dfa_endbuf;
+                break;
+
+            case begline:
+                node->type = dfa_begline;
+                break;
+
+            case endline:
+                node->type = dfa_endline;
+                break;
+
+            case jump:
+            case jump_past_alt:
+            case pop_failure_jump:
+            case maybe_pop_jump:
+            case dummy_failure_jump:
+                p1 = p + 1;
+                EXTRACT_NUMBER_AND_INCR(mcnt, p1);
+                node->type = dfa_jump;
+                next_node = op_node[p1 + mcnt - pattern];
+                break;
+
+            case on_failure_jump:
+            case on_failure_keep_string_jump:
+                p1 = p + 1;
+                EXTRACT_NUMBER_AND_INCR(mcnt, p1);
+                node->type = dfa_split;
+                node->alt = op_node[p1 + mcnt - pattern];
+                break;
+
+            default:
+                node->type = dfa_jump;
+                break;
+        }
+
+        node->next = next_node;
+        node++;
+    }
+    node->type = dfa_accept;
+    node->next = -1;
+
+    free(op_node);
+
+    if (!dfa_take_id(dfa)) {
+        free(dfa->nodes);
+        free(dfa);
+        return NULL;
+    }
+    return dfa;
+}
+
+/* Find (or make) the calling thread's cache for DFA.  */
+static struct dfa_cache *dfa_get_cache(struct re_dfa *dfa)
+{
+    struct dfa_cache *cache;
+
+    if (dfa->id >= dfa_n_caches) {
+        int n = MAX(dfa->id + 1, 2 * dfa_n_caches);
+        struct dfa_cache **caches;
+
+        caches = (struct dfa_cache **)realloc(dfa_caches, n * sizeof *caches);
+        if (!caches)
+            return NULL;
+        bzero(caches + dfa_n_caches, (n - dfa_n_caches) * sizeof *caches);
+#ifdef DFA_FREE_AT_EXIT
+        if (!dfa_caches) {
+            pthread_once(&dfa_exit_once, dfa_make_exit_key);
+            pthread_setspecific(dfa_exit_key, caches);
+        }
+#endif
+        dfa_caches = caches;
+        dfa_n_caches = n;
+    }
+
+    cache = dfa_caches[dfa->id];
+    if (cache && cache->gen == dfa->gen)
+        return cache;
+    if (cache) {
+        dfa_cache_free(cache);
+        dfa_caches[dfa->id] = NULL;
+    }
+
+    cache = TALLOC(1, struct dfa_cache);
+    if (!cache)
+        return NULL;
+    bzero(cache, sizeof *cache);
+    cache->gen = dfa->gen;
+
+    cache->mark = TALLOC(dfa->n_nodes, int);
+    cache->stack = TALLOC(dfa->n_nodes, int);
+    cache->set1 = TALLOC(dfa->n_nodes, int);
+    cache->set2 = TALLOC(dfa->n_nodes, int);
+    if (!(cache->mark && cache->stack && cache->set1 && cache->set2)) {
+        free(cache->mark);
+        free(cache->stack);
+        free(cache->set1);
+        free(cache->set2);
+        free(cache);
+        return NULL;
+    }
+    bzero(cache->mark, dfa->n_nodes * sizeof(int));
+
+    dfa_caches[dfa->id] = cache;
+    return cache;
+}
+
+/* Throw away every state in CACHE.  */
+static void dfa_flush(struct dfa_cache *cache)
+{
+    int i;
+    struct dfa_state *s, *next;
+
+    for (i = 0; i < DFA_HASH_SIZE; i++) {
+        for (s = cache->table[i]; s; s = next) {
+            next = s->hash_next;
+            free(s->nodes);
+            free(s);
+        }
+        cache->table[i] = NULL;
+    }
+
+    cache->n_states = 0;
+    cache->start = NULL;
+    cache->flushes++;
+}
+
+/* Free CACHE and every state in it.  */
+static void dfa_cache_free(struct dfa_cache *cache)
+{
+    dfa_flush(cache);
+    free(cache->mark);
+    free(cache->stack);
+    free(cache->set1);
+    free(cache->set2);
+    free(cache);
+}
+
+/* Follow epsilon edges from the N nodes in IN, as they stand in
+   CONTEXT, and put the nodes reached that match a character, accept,
+   or wait on `endline'/`endbuf' into OUT, sorted.  FLAGS say which of
+   those end assertions to let through.  Return how many nodes went in
+   OUT.  */
+static int dfa_closure(struct re_dfa *dfa, struct dfa_cache *cache, int *in, int n, int context, int flags, int *out)
+{
+    int sp = 0, n_out = 0, i, j;
+    int gen = ++cache->generation;
+
+    for (i = n - 1; i >= 0; i--) {
+        if (cache->mark[in[i]] != gen) {
+            cache->mark[in[i]] = gen;
+            cache->stack[sp++] = in[i];
+        }
+    }
+
+    while (sp) {
+        int x = cache->stack[--sp];
+        struct dfa_node *node = &dfa->nodes[x];
+        int to = -1, to2 = -1;
+
+        switch (node->type) {
+            case dfa_set:
+            case dfa_accept:
+                out[n_out++] = x;
+                break;
+
+            case dfa_jump:
+                to = node->next;
+                break;
+
+            case dfa_split:
+                to = node->next;
+                to2 = node->alt;
+                break;
+
+            case dfa_begbuf:
+                if (context == DFA_AT_START)
+                    to = node->next;
+                break;
+
+            case dfa_begline:
+                if (context == DFA_AT_START ? !dfa->not_bol : context == DFA_AFTER_NEWLINE && dfa->newline_anchor)
+                    to = node->next;
+                break;
+
+            case dfa_endline:
+                if (flags & DFA_PASS_ENDLINE)
+                    to = node->next;
+                else
+                    out[n_out++] = x;
+                break;
+
+            case dfa_endbuf:
+                if (flags & DFA_PASS_ENDBUF)
+                    to = node->next;
+                else
+                    out[n_out++] = x;
+                break;
+        }
+
+        if (to2 >= 0 && cache->mark[to2] != gen) {
+            cache->mark[to2] = gen;
+            cache->stack[sp++] = to2;
+        }
+        if (to >= 0 && cache->mark[to] != gen) {
+            cache->mark[to] = gen;
+            cache->stack[sp++] = to;
+        }
+    }
+
+    /* Sort, so that equal sets look equal.  They're small.  */
+    for (i = 1; i < n_out; i++) {
+        int x = out[i];
+        for (j = i; j > 0 && out[j - 1] > x; j--)
+            out[j] = out[j - 1];
+        out[j] = x;
+    }
+
+    return n_out;
+}
+
+/* Find the state for the N sorted nodes in SET in CONTEXT, making it
+   if need be.  Return NULL if memory runs out.  */
+static struct dfa_state *dfa_intern(struct re_dfa *dfa, struct dfa_cache *cache, int *set, int n, int context)
+{
+    unsigned hash = context;
+    struct dfa_state *s;
+    int i;
+
+    for (i = 0; i < n; i++)
+        hash = hash * 31 + set[i];
+
+    for (s = cache->table[hash % DFA_HASH_SIZE]; s; s = s->hash_next)
+        if (s->hash == hash && s->context == context && s->n_nodes == n && !bcmp(s->nodes, set, n * sizeof(int)))
+            return s;
+
+    if (cache->n_states >= DFA_MAX_STATES)
+        dfa_flush(cache);
+
+    s = TALLOC(1, struct dfa_state);
+    if (!s)
+        return NULL;
+    bzero(s, sizeof *s);
+
+    s->nodes = TALLOC(n ? n : 1, int);
+    if (!s->nodes) {
+        free(s);
+        return NULL;
+    }
+    bcopy(set, s->nodes, n * sizeof(int));
+    s->n_nodes = n;
+    s->context = context;
+    s->hash = hash;
+    s->accepts_at_end = -1;
+
+    for (i = 0; i < n; i++) {
+        if (dfa->nodes[set[i]].type == dfa_accept)
+            s->accepting = 1;
+        else if (dfa->nodes[set[i]].type == dfa_endline)
+            s->has_endline = 1;
+    }
+
+    s->hash_next = cache->table[hash % DFA_HASH_SIZE];
+    cache->table[hash % DFA_HASH_SIZE] = s;
+    cache->n_states++;
+    return s;
+}
+
+/* Work out the state to go to from S on character C.  This may empty
+   the cache, so S must not be used afterwards; the transition is only
+   recorded in S if S survived.  */
+static struct dfa_state *dfa_step(struct re_dfa *dfa, struct dfa_cache *cache, struct dfa_state *s, int c)
+{
+    int *from = s->nodes, n_from = s->n_nodes;
+    int n = 0, i, context;
+    unsigned tc = dfa->translate ? (unsigned char)dfa->translate[c] : c;
+    unsigned flushes = cache->flushes;
+    struct dfa_state *next;
+
+    /* An `endline' waiting in S holds if C is a newline.  */
+    if (c == '\n' && s->has_endline && dfa->newline_anchor) {
+        n_from = dfa_closure(dfa, cache, s->nodes, s->n_nodes, s->context, DFA_PASS_ENDLINE, cache->set1);
+        from = cache->set1;
+    }
+
+    for (i = 0; i < n_from; i++) {
+        struct dfa_node *node = &dfa->nodes[from[i]];
+
+        if (node->type == dfa_accept) {
+            /* The pattern matched just before C.  */
+            n = 0;
+            cache->set2[n++] = from[i];
+            break;
+        }
+
+        if (node->type == dfa_set && node->set[tc / BYTEWIDTH] & (1 << (tc % BYTEWIDTH)))
+            cache->set2[n++] = node->next;
+    }
+
+    /* Every position is somewhere a match might start.  */
+    if (!dfa->anchored)
+        cache->set2[n++] = 0;
+
+    context = c == '\n' ? DFA_AFTER_NEWLINE : DFA_AFTER_OTHER;
+    n = dfa_closure(dfa, cache, cache->set2, n, context, 0, cache->set1);
+
+    next = dfa_intern(dfa, cache, cache->set1, n, context);
+    if (next && cache->flushes == flushes)
+        s->trans[c] = next;
+    return next;
+}
+
+/* Return 1 if the DFA compiled by `re_dfa_compile' matches somewhere in
+   the SIZE characters at STRING, 0 if it doesn't, and -2 if memory ran
+   out (in which case use `re_search').  Like `re_search' with no
+   registers over the whole of STRING.  */
+int re_dfa_search(struct re_dfa *dfa, const char *string, int size)
+{
+    struct dfa_cache *cache = dfa_get_cache(dfa);
+    struct dfa_state *s;
+    const unsigned char *d = (const unsigned char *)string;
+    const unsigned char *dend = d + size;
+    int n;
+
+    if (!cache)
+        return -2;
+
+    if (re_stats)
+        re_stats->dfa_scans++;
+
+    s = cache->start;
+    if (!s) {
+        int zero = 0;
+
+        n = dfa_closure(dfa, cache, &zero, 1, DFA_AT_START, 0, cache->set1);
+        s = dfa_intern(dfa, cache, cache->set1, n, DFA_AT_START);
+        if (!s)
+            return -2;
+        cache->start = s;
+    }
+
+    while (d < dend) {
+        if (s->accepting)
+            return 1;
+
+        /* Nothing left that could match, and no match can start later.  */
+        if (!s->n_nodes && dfa->anchored)
+            return 0;
+
+        if (s->trans[*d])
+            s = s->trans[*d];
+        else if (!(s = dfa_step(dfa, cache, s, *d)))
+            return -2;
+        d++;
+    }
+
+    if (s->accepts_at_end < 0) {
+        int flags = DFA_PASS_ENDBUF | (dfa->not_eol ? 0 : DFA_PASS_ENDLINE);
+
+        n = dfa_closure(dfa, cache, s->nodes, s->n_nodes, s->context, flags, cache->set1);
+        s->accepts_at_end = 0;
+        while (n--)
+            if (dfa->nodes[cache->set1[n]].type == dfa_accept)
+                s->accepts_at_end = 1;
+    }
+
+    return s->accepts_at_end;
+}
+
+/* Free a DFA made by `re_dfa_compile', along with the calling thread's
+   cache for it.  */
+void re_dfa_free(struct re_dfa *dfa)
+{
+    if (!dfa)
+        return;
+
+    if (dfa->id < dfa_n_caches && dfa_caches[dfa->id] && dfa_caches[dfa->id]->gen == dfa->gen) {
+        dfa_cache_free(dfa_caches[dfa->id]);
+        dfa_caches[dfa->id] = NULL;
+    }
+
+    dfa_give_id(dfa);
+    free(dfa->nodes);
+    free(dfa);
+}
+
 /* Entry points compatible with 4.2 BSD regex library.  We don't define
    them if this is an Emacs or POSIX compilation.  */
 
@@ -319,6 +319,18 @@ struct re_pattern_buffer {
     /* If true, an anchor at a newline matches.  */
     unsigned newline_anchor : 1;
 
+    /* Set by `re_compile_fastmap' from the fastmap (and the translate
+           table) so that `re_search_2' can pass over impossible starting
+           points many bytes at a time.  If `fastmap_scan' is between 1 and
+           3, those are the only bytes that can start a match, and they are
+           in `fastmap_bytes'.  If it is 4, a byte B may start a match only
+           if `fastmap_lo[B & 15] & fastmap_hi[B >> 4]' is nonzero.  If it
+           is zero, the fastmap is looked at a byte at a time.  */
+    unsigned char fastmap_scan;
+    unsigned char fastmap_bytes[3];
+    unsigned char fastmap_lo[16];
+    unsigned char fastmap_hi[16];
+
     /* [[[end pattern_buffer]]] */
 };
 
@@ -433,6 +445,38 @@ extern void re_set_registers
     _RE_ARGS((struct re_pattern_buffer * buffer, struct re_registers *regs,
               unsigned num_regs, regoff_t *starts, regoff_t *ends));
 
+/* Build a DFA that tells whether the pattern compiled in BUFFER matches
+   anywhere in a string, in time linear in the length of the string.
+   Return NULL if the pattern has back references or other constructs
+   the DFA doesn't handle; use `re_search' for those.  */
+struct re_dfa;
+extern struct re_dfa *re_dfa_compile
+    _RE_ARGS((struct re_pattern_buffer * buffer));
+
+/* Return 1 if DFA matches somewhere in the LENGTH characters at STRING,
+   0 if not, or -2 for an internal error.  */
+extern int re_dfa_search
+    _RE_ARGS((struct re_dfa * dfa, const char *string, int length));
+
+/* Free a DFA made by `re_dfa_compile'.  */
+extern void re_dfa_free _RE_ARGS((struct re_dfa * dfa));
+
+/* What is counted for a thread that has asked for it with
+   `re_set_stats': how many times `re_search_2' was called, and the
+   places it tried a match at, the places the fastmap ruled out without
+   trying, and the most items the failure stack ever held; and how many
+   times `re_dfa_search' was called.  */
+struct re_stats {
+    unsigned long searches;
+    unsigned long attempts;
+    unsigned long fastmap_skips;
+    unsigned max_failures;
+    unsigned long dfa_scans;
+};
+
+/* Add this thread's counts to STATS from now on, or stop if it is 0.  */
+extern void re_set_stats _RE_ARGS((struct re_stats * stats));
+
 /* 4.2 bsd compatibility.  */
 extern char *re_comp _RE_ARGS((const char *));
 extern int re_exec _RE_ARGS((const char *));
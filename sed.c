@@ -27,7 +27,25 @@
 #define isblank(c) ((c) == ' ' || (c) == '\t')
 #endif
 #include <stdio.h>
+#include <limits.h>
 #include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#ifndef NO_MMAP
+#include <sys/mman.h>
+#endif
+#ifndef NO_THREADS
+#include <pthread.h>
+#include <sched.h>
+#endif
+#include <time.h>
 
 #include "getopt.h"
 #include "regex.h"
@@ -45,6 +63,16 @@
 
 
 #include <errno.h>
+#include <setjmp.h>
+
+#include "libsed.h"
+
+/* -i copies the part of a file that didn't change with copy_file_range(2),
+   which lets the kernel (or the file system, by sharing the blocks) do it
+   without passing the data through sed. */
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27)) && !defined(NO_COPY_FILE_RANGE)
+#define HAVE_COPY_FILE_RANGE
+#endif
 extern int errno;
 
 #define bcopy(FROM, TO, LEN) memcpy(TO, FROM, LEN)
@@ -77,6 +105,9 @@ struct vector {
  *
  * the NAME element is the null-terminated name of the label.
  * next is the next goto/label in the list.
+ *
+ * The labels are also kept in label_table, by name, until the jumps have
+ * been resolved (see link_program).
  */
 
 struct sed_label {
@@ -103,24 +134,66 @@ enum addr_types {
     addr_is_last = 3
 };
 
+/* A compiled regular expression, and the quicker ways we have of
+ * searching for it.  DFA answers yes-or-no questions in linear time, when
+ * the pattern allows it.  If the pattern is nothing but ordinary
+ * characters, LITERAL holds them (not null-terminated), and ANCHOR_START
+ * and ANCHOR_END say whether it was tied to the start or end of the
+ * pattern space with '^' or '$'.  Otherwise REQUIRED, if not null, is
+ * a string every match must contain, so that lines without it can be
+ * passed over without running the matcher at all. */
+struct sed_regex {
+    struct re_pattern_buffer pattern;
+    struct re_dfa *dfa;
+    char *literal;
+    int literal_len;
+    int anchor_start;
+    int anchor_end;
+    char *required;
+    int required_len;
+    struct sed_regex *next; /* The program's previous regex, for freeing */
+    int id;                 /* Its number in the program, from 0 */
+    char *file;             /* Where it is in the script, for --profile */
+    int line;
+    int in_set;             /* Looked for by the program's addr_set */
+};
+
 struct addr {
     int addr_type;
-    struct re_pattern_buffer *addr_regex;
+    struct sed_regex *addr_regex;
     int addr_number;
 };
 
 /* Aflags:
  *
- * If the low order bit is set, a1 has been matched; apply this command until a2 matches.
- * If the next bit is set, apply this command to all lines that DON'T match the address(es).
+ * If this bit is set, apply this command to all lines that DON'T match the address(es).
+ *
+ * Whether a1 has been matched (so the command applies until a2 matches) is
+ * kept in range_open[RANGE_ID], apart from the compiled program, so that
+ * threads running the program over different files don't share it.
  */
 
-#define A1_MATCHED_BIT 01
 #define ADDR_BANG_BIT 02
 
+/* The replacement part of an s command is compiled into a list of these.
+ * Each piece is PREFIX_LENGTH bytes of literal text, followed by group
+ * SUBST_ID of the match (0 for '&', the whole match), or by nothing if
+ * SUBST_ID is -1. */
+struct replacement {
+    char *prefix;
+    int prefix_length;
+    int subst_id;
+};
+
 struct sed_cmd {
     struct addr a1, a2;
     int aflags;
+    int range_id;
+
+    /* Where the command is in the script, for --profile.  The lines of
+       the -e scripts are counted as one script. */
+    char *file;
+    int line;
 
     char cmd;
 
@@ -132,9 +205,6 @@ struct sed_cmd {
             int text_len;
         } cmd_txt;
 
-        /* This is used for b and t commands */
-        struct sed_cmd *label;
-
         /* This for r and w commands */
         FILE *io_file;
 
@@ -152,12 +222,19 @@ struct sed_cmd {
 
         struct
         {
-            struct re_pattern_buffer *regx;
-            char *replacement;
-            int replace_length;
+            struct sed_regex *regx;
+            struct replacement *replacement;
+            int replace_pieces;
+            int replace_fixed; /* Sum of the pieces' prefix lengths */
             int flags;
             int numb;
             FILE *wio_file;
+
+            /* If FUSED isn't null, this command and the FUSED_CMDS - 1
+               after it are all done at once by substitute_fused (see
+               fuse_run) */
+            struct multisearch *fused;
+            int fused_cmds;
         } cmd_regex;
 
         /* This for the y command */
@@ -166,8 +243,15 @@ struct sed_cmd {
         /* For { */
         struct vector *sub;
 
-        /* for t and b */
-        struct sed_label *jump;
+        /* For t and b, once linked: the label's command, its vector, and
+           how many commands that leaves in the vector.  TARGET is null
+           for a jump to the end of the script. */
+        struct
+        {
+            struct sed_cmd *target;
+            struct vector *v;
+            int n;
+        } jump;
     } x;
 };
 
@@ -178,20 +262,282 @@ struct line {
     int alloc;  /* Allocated space for text. */
 };
 
+/* Input is read in large blocks rather than a character at a time.
+   Lines are located in the block with memchr and copied into the
+   pattern space in one piece.  CUR..LIM is the part of the block that
+   hasn't been consumed yet; EOF is set once read() has returned zero.
+
+   A regular file is mapped instead, if possible, and the mapping is used
+   as one big block (MAPPED is set while CUR..LIM lies in the mapping).
+   Once the mapping is used up we go back to read()ing from MAP_LEN
+   onwards, which picks up anything appended to the file meanwhile. */
+
+#define INPUT_BLOCK_SIZE (256 * 1024)
+
+struct input_buffer {
+    int fd;
+    char *name;
+    char *buf;
+    int alloc;
+    char *cur;
+    char *lim;
+    int eof;
+    char *map;
+    size_t map_len;
+    int mapped;
+    int piped;  /* Blocks come from the --pipeline reader thread */
+    sed_source source;  /* If set, read from this instead of FD */
+    VOID *source_arg;
+};
+
+/* Everything sed writes to the standard output is collected in one big
+   buffer and handed to write(2) when the buffer fills up, and at exit.
+   If LINE_BUFFERED is set (-u, or when the output is a terminal), the
+   buffer is also flushed at the end of every cycle.  A worker thread
+   sets CAPTURE instead, and the buffer just grows to hold all the output
+   for the piece of input it is working on. */
+#define OUTPUT_BLOCK_SIZE (256 * 1024)
+
+struct output_buffer {
+    char *buf;
+    int length;
+    int alloc;
+    int line_buffered;
+    int capture;
+    int exiting;
+    int piped;  /* Blocks go to the --pipeline writer thread */
+    sed_sink sink;  /* If set, write to this instead of the standard output */
+    VOID *sink_arg;
+};
+
+/* The file being edited by -i.  As long as what the script writes is the
+   same as what is already in the file, nothing is written, and SAME just
+   counts the bytes.  When the output first differs, the temporary file
+   TMP_NAME is made, the first SAME bytes are copied to it from the old
+   file, and the rest of the output is written there.  At the end of the
+   file, the new one takes the old one's place, unless they are the same. */
+struct edit_file {
+    char *name;
+    int in_fd;
+    struct stat st;
+    off_t same;
+    char *tmp_name;
+    int out_fd;
+};
+
+/* The state the script works on is kept per thread, so that when the
+   script doesn't carry anything from one line to the next, a large file
+   can be cut into pieces and each piece run through it in a thread of
+   its own.  Define NO_THREADS to do without. */
+#if defined(__GNUC__) && !defined(NO_THREADS)
+#define THREAD_LOCAL __thread
+#else
+#define THREAD_LOCAL
+#endif
+
+/* The pieces are about this big, give or take a line, and each thread
+   has at most CHUNK_WINDOW of them done or in hand and not yet written. */
+#define CHUNK_SIZE (1024 * 1024)
+#define CHUNK_WINDOW 4
+#define MAX_THREADS 64
+
+/* With --pipeline, a reader thread reads input blocks ahead of the
+   script and a writer thread writes output blocks behind it.  They pass
+   blocks to and from the main thread through rings of RING_SLOTS.  A
+   regular file is read too, not mapped, or the main thread would still
+   wait on every page fault. */
+#define RING_SLOTS 8
+
+/* A ring of buffers with one producer and one consumer.  HEAD counts the
+   slots the producer has filled and is only written by it; TAIL counts
+   the slots the consumer is done with and is only written by it.  So no
+   lock is needed, just the right ordering on the loads and stores. */
+struct ring {
+    char *buf[RING_SLOTS];
+    int len[RING_SLOTS];
+    unsigned head;
+    unsigned tail;
+};
+
+/* A compiled script: the commands, and what is needed to run them and,
+   once nobody is running them any more, to free them.  JUMPS and LABELS
+   are the lists made while compiling, and REGEXES is the chain of all
+   the regexes, which several commands may share.  If LAST_LINE isn't
+   zero, nothing will be printed, or done at all, once the input is past
+   that line and no range is open (see program_last_line).  WINDOWED is
+   set if a line too long to hold can be run through the script a piece
+   at a time (see program_is_windowed).  ADDR_SET, if not null, looks
+   for the strings of all the regex addresses at once (see
+   program_address_set).  FILES are the files its r and w commands
+   opened, which are closed when it is freed. */
+struct sed_program {
+    struct vector *vector;
+    int no_default_output;
+    int last_line;
+    int windowed;
+    int num_ranges;
+    int num_regexes;
+    struct sed_label *jumps;
+    struct sed_label *labels;
+    struct sed_regex *regexes;
+    struct multisearch *addr_set;
+    struct sed_file *files;
+};
+
+/* A program with fewer regex addresses than this to look for is left
+   to try them one at a time */
+#define ADDR_SET_MIN 4
+
+#define LONG_BITS (8 * (int)sizeof(unsigned long))
+#define ADDR_FOUND_WORDS(program) (((program)->num_regexes + LONG_BITS - 1) / LONG_BITS)
+
+/* Nor is a run of fewer s commands than this fused into one pass */
+#define SUBST_SET_MIN 4
+
+/* Everything that changes while a compiled program runs over its input
+   is kept in one of these, so that the program itself is never written
+   to, and any number of them can run it (or other programs) at once,
+   in different threads or taking turns in the same one. */
+struct sed_context {
+    /* The program, and whether to print the pattern space at the end of
+       each cycle (not if -n or #n) */
+    struct sed_program *program;
+    int no_default_output;
+
+    /* The 'current' input line. */
+    struct line line;
+
+    /* When the pattern space is a view into a mapped input file,
+       'line.text' points into the mapping and 'line_mapped' is set.  The
+       buffer that normally holds the pattern space is parked in
+       'line_store' until the view is unshared (copied) or discarded. */
+    int line_mapped;
+    struct line line_store;
+
+    /* An input line that's been stored by later use by the program */
+    struct line hold;
+
+    /* A 'line' to append to the current line when it comes time to write
+       it out */
+    struct line append;
+
+    /* Where the s command builds its result, and the match it found */
+    struct line subst;
+    struct re_registers regs;
+
+    /* Current input line # */
+    int input_line_number;
+
+    /* Are we on the last input file? */
+    int last_input_file;
+
+    /* Have we hit EOF on the last input file?  This is used to decide if
+       we have hit the '$' address yet. */
+    int input_EOF;
+
+    /* non-zero if a quit command has been executed. */
+    int quit_cmd;
+
+    /* non-zero once no command can act on any more input (see
+       program_last_line), so none need be read */
+    int input_done;
+
+    /* Have we done any replacements lately?  This is used by the 't'
+       command. */
+    int replaced;
+
+    /* Set when the rest of the program is to be skipped for this cycle */
+    int end_cycle;
+
+    /* One flag per command, set while the command's range is open */
+    char *range_open;
+
+    /* This is the input we're currently reading data from.  It may be
+       stdin */
+    struct input_buffer input;
+
+    /* Where output to stdout is gathered */
+    struct output_buffer output;
+
+    /* The file being edited in place, if any */
+    struct edit_file edit;
+
+    /* If this is non-zero at exit, one or more of the input files
+       couldn't be opened. */
+    int bad_input;
+
+    /* Set when the current line was too long for the pattern space and
+       has been run through the script, and written out, by stream_line
+       instead, which keeps a window for each command in WINDOWS */
+    int line_streamed;
+    struct line_window *windows;
+    int num_windows;
+
+    /* With --profile, counts for each command (by range_id) and each
+       regex (by id), and the command the clock is running for, since
+       PROF_STAMP */
+    struct cmd_profile *profile;
+    struct regex_profile *regex_profile;
+    struct sed_cmd *prof_cmd;
+    unsigned long long prof_stamp;
+
+    /* One bit per regex (by id) that the program's addr_set found in
+       the pattern space, if ADDR_FOUND_VALID says the pattern space
+       hasn't changed since it looked */
+    unsigned long *addr_found;
+    int addr_found_valid;
+
+    /* Where substitute_fused keeps the matches it has found, in pairs
+       of the command's place in its group and where the match ends, and
+       which bytes of the pattern space have been replaced */
+    int *fused_found;
+    int fused_alloc;
+    struct line fused_taken;
+};
+
+/* A command of a windowed program (see stream_line), with the bytes it
+   has been given but can't pass on yet, because a match might start in
+   them, and for an s command, the matches it has seen so far in the
+   line, and its replacement text. */
+struct line_window {
+    struct sed_cmd *cmd;
+    struct line carry;
+    struct line out;
+    int count;
+    int done;
+    struct line replacement;
+};
+
+/* What --profile counts for a command: how many times its address was
+   looked at and matched, how many times it ran (after any '!'), how
+   many regex searches it made, and the time from its start to the start
+   of whatever came after it */
+struct cmd_profile {
+    unsigned long evals;
+    unsigned long hits;
+    unsigned long runs;
+    unsigned long regex_calls;
+    unsigned long long cycles;
+};
+
+/* And for a regex: how many searches, how many found something, and
+   what the matcher itself saw (see re_set_stats) */
+struct regex_profile {
+    unsigned long calls;
+    unsigned long matches;
+    struct re_stats re;
+};
+
 /* This structure holds information about files opend by the 'r', 'w',
    and 's///w' commands.  In paticular, it holds the FILE pointer to
    use, the file's name, a flag that is non-zero if the file is being
-   read instead of written. */
-
-#define NUM_FPS 32
-struct
-{
+   read instead of written.  Each program has a chain of its own. */
+struct sed_file {
     FILE *phile;
     char *name;
     int readit;
-}
-
-file_ptrs[NUM_FPS];
+    struct sed_file *next;
+};
 
 #if defined(__STDC__)
 #define P_(s) s
@@ -199,17 +545,20 @@ file_ptrs[NUM_FPS];
 #define P_(s) ()
 #endif
 
-void close_files();
 void panic P_((char *str, ...));
+void close_files P_((struct sed_program * program));
 char *__fp_name P_((FILE * fp));
+void __fp_forget P_((FILE * fp));
 FILE *ck_fopen P_((char *name, char *mode));
 void ck_fwrite P_((char *ptr, int size, int nmemb, FILE *stream));
 void ck_fclose P_((FILE * stream));
 VOID *ck_malloc P_((int size));
 VOID *ck_realloc P_((VOID * ptr, int size));
+VOID *ck_grow P_((VOID * ptr, int *alloc, int need));
 char *ck_strdup P_((char *str));
 VOID *init_buffer P_((void));
 void flush_buffer P_((VOID * bb));
+void flush_all_buffers P_((void));
 int size_buffer P_((VOID * b));
 void add_buffer P_((VOID * bb, char *p, int n));
 void add1_buffer P_((VOID * bb, int ch));
@@ -217,45 +566,98 @@ char *get_buffer P_((VOID * bb));
 
 void compile_string P_((char *str));
 void compile_file P_((char *str));
+struct vector *new_vector P_((void));
 struct vector *compile_program P_((struct vector * vector, int));
+struct sed_program *link_program P_((void));
+struct sed_program *take_program P_((void));
+void free_program P_((struct sed_program * program));
+void free_vector P_((struct vector * vec));
 void bad_prog P_((char *why));
 int inchar P_((void));
 void savchar P_((int ch));
 int compile_address P_((struct addr * addr));
 void compile_regex P_((int slash));
+void compile_literal P_((struct sed_regex * regex, char *pat, int size));
+void compile_replacement P_((struct sed_cmd * cmd, char *rep, int size));
+void compile_required P_((struct sed_regex * regex, char *pat, int size));
+int match_regex P_((struct sed_regex * regex, char *text, int length, int start, struct re_registers *regs));
+char *memsearch P_((char *hay, int hay_len, char *needle, int len));
+int multisearch_all P_((struct multisearch * ms, char *hay, int hay_len, int **found, int *alloc));
+void multisearch_groups P_((char **needle, int *needle_len, char **repl, int *repl_len, int n, char *starts));
+struct multisearch *multisearch_new P_((void));
+void multisearch_add P_((struct multisearch * ms, char *needle, int len, int id));
+void multisearch_compile P_((struct multisearch * ms));
+void multisearch_mark P_((struct multisearch * ms, char *hay, int hay_len, unsigned long *found));
+void multisearch_free P_((struct multisearch * ms));
 struct sed_label *setup_jump P_((struct sed_label * list, struct sed_cmd *cmd, struct vector *vec));
+struct sed_label **find_label P_((char *name));
+void add_label P_((struct sed_label * lbl));
 FILE *compile_filename P_((int readit));
-void read_file P_((char *name));
-void execute_program P_((struct vector * vec));
-int match_address P_((struct addr * addr));
-int read_pattern_space P_((void));
-void append_pattern_space P_((void));
+void read_file P_((struct sed_context *ctx, char *name));
+void check_file P_((struct sed_context *ctx, char *name));
+void execute_program P_((struct sed_context *ctx, struct vector * vec));
+int match_address P_((struct sed_context *ctx, struct addr * addr));
+int fill_input P_((struct sed_context *ctx));
+int input_exhausted P_((struct sed_context *ctx));
+int read_input_line P_((struct sed_context *ctx));
+void map_input P_((struct sed_context *ctx));
+void unmap_input P_((struct sed_context *ctx));
+void line_unshare P_((struct sed_context *ctx));
+void line_discard P_((struct sed_context *ctx));
+int read_pattern_space P_((struct sed_context *ctx));
+void append_pattern_space P_((struct sed_context *ctx));
 void line_copy P_((struct line * from, struct line *to));
 void line_append P_((struct line * from, struct line *to));
 void str_append P_((struct line * to, char *string, int length));
+void str_reserve P_((struct line * to, int length));
+void append_replacement P_((struct line * to, struct sed_cmd * cmd, char *text, struct re_registers *regs));
+void output_write P_((struct sed_context *ctx, char *text, int length));
+void output_flush P_((struct sed_context *ctx));
+void output_exit P_((void));
+void process_input P_((struct sed_context *ctx));
+int edit_start P_((struct sed_context *ctx, char *name));
+void edit_write P_((struct sed_context *ctx, char *buf, int len));
+void edit_finish P_((struct sed_context *ctx));
+void edit_abandon P_((struct sed_context *ctx));
+int program_is_stateless P_((struct vector * vec));
+int program_last_line P_((struct vector * vec));
+int program_is_windowed P_((struct vector * vec));
+int program_address_set P_((struct multisearch * set, struct vector * vec));
+int subst_is_plain P_((struct sed_cmd * cmd));
+void fuse_substitutions P_((struct vector * vec));
+void fuse_run P_((struct sed_cmd * run, int count));
+void substitute_fused P_((struct sed_context *ctx, struct sed_cmd * cmd));
+int stream_line P_((struct sed_context *ctx));
+int read_file_parallel P_((struct sed_context *ctx));
+void start_reader P_((struct sed_context *ctx));
+void stop_reader P_((struct sed_context *ctx));
+int fill_from_reader P_((struct sed_context *ctx));
+void start_writer P_((struct sed_context *ctx));
+void writer_flush P_((struct sed_context *ctx));
+void stop_writer P_((struct sed_context *ctx));
+int program_is_file_local P_((struct vector * vec));
+void read_files_parallel P_((struct sed_context *ctx, char **names, int count));
+void context_init P_((struct sed_context *ctx, struct sed_program *program));
+void profile_start P_((struct sed_program * program));
+void profile_enter P_((struct sed_context *ctx, struct sed_cmd *cmd));
+int count_match P_((struct sed_context *ctx, struct sed_regex *regex, char *text, int length, int start, struct re_registers *regs));
+void profile_merge P_((struct sed_context *ctx));
+void profile_report P_((void));
+void context_free P_((struct sed_context *ctx));
+void new_stream P_((struct sed_context *ctx));
+void serve P_((struct sed_program * program, char *path));
 void usage P_((int));
+static int run_program P_((struct sed_context *ctx, const struct sed_program *program));
 
 extern char *myname;
 
+/* See panic() in utils.c */
+extern THREAD_LOCAL jmp_buf *panic_jump;
+extern THREAD_LOCAL char panic_message[];
+
 /* If set, don't write out the line unless explictly told to */
 int no_default_output = 0;
 
-/* Current input line # */
-int input_line_number = 0;
-
-/* Are we on the last input file? */
-int last_input_file = 0;
-
-/* Have we hit EOF on the last input file?  This is used to decide if we
-   have hit the '$' address yet. */
-int input_EOF = 0;
-
-/* non-zero if a quit command has been executed. */
-int quit_cmd = 0;
-
-/* Have we done any replacements lately?  This is used by the 't' command. */
-int replaced = 0;
-
 /* How many '{'s are we executing at the moment */
 int program_depth = 0;
 
@@ -267,14 +669,23 @@ struct vector *the_program = 0;
 struct sed_label *jumps = 0; /* 存放跳转标签动作 */
 struct sed_label *labels = 0; /* 存放标签 */
 
-/* The 'current' input line. */
-struct line line;
+/* The labels again, as an open hash table of LABEL_TABLE_SIZE slots (a
+   power of two, or zero before the first label), NUM_LABELS of them
+   full */
+struct sed_label **label_table = 0;
+int label_table_size = 0;
+int num_labels = 0;
 
-/* An input line that's been stored by later use by the program */
-struct line hold;
+/* The number of commands compiled so far, each of which has a flag in
+   range_open */
+int num_ranges = 0;
 
-/* A 'line' to append to the current line when it comes time to write it out */
-struct line append;
+/* All the regexes compiled so far, newest first, and how many */
+struct sed_regex *regexes = 0;
+int num_regexes = 0;
+
+/* The files opened by the r and w commands compiled so far */
+struct sed_file *script_files = 0;
 
 /* When we're reading a script command from a string, 'prog_start' and
    'prog_end' point to the beginning and end of the string.  This
@@ -301,19 +712,50 @@ FILE *prog_file;
    used to give out useful and informative error messages. */
 int prog_line = 1;
 
-/* This is the file pointer that we're currently reading data from.  It may
-   be stdin */
-FILE *input_file;
+/* The same, but counted for -e scripts too, to tell where each command
+   came from */
+int script_line = 1;
+
+/* Set if the script can be run over separate parts of the input at once
+   (see program_is_stateless), and the number of threads to do it with,
+   which -j sets. */
+int stateless_program = 0;
+int parallel_threads = 1;
+int jobs = 0;
 
-/* If this variable is non-zero at exit, one or more of the input
-   files couldn't be opened. */
+/* Set while files edited in place are being run through the script
+   several at a time (see read_files_parallel) */
+int files_parallel = 0;
 
-int bad_input = 0;
+/* Set by --pipeline */
+int pipelined = 0;
+
+/* Set by -i, and the suffix for the backup of each file, which may be "" */
+int in_place = 0;
+char *in_place_suffix = "";
+
+/* The socket to answer requests on, set by --serve */
+char *serve_path = 0;
+
+/* Set by --profile */
+int profiling = 0;
+
+/* What ends a line, of input and in the pattern space: a newline, or a
+   NUL with -z, or whatever --record-separator says */
+char record_sep = '\n';
+
+/* The most the pattern space may be filled with from the input, set by
+   --max-line-bytes, or 0 for no limit */
+long max_line_bytes = 0;
+
+/* The context this thread is running the script in, for the handlers
+   that aren't told: output_exit and input_sigbus */
+THREAD_LOCAL struct sed_context *current_ctx;
 
 /* 'an empty regular expression is equivalent to the last regular
    expression read' so we have to keep track of the last regex used.
    Here's where we store a pointer to it (it is only malloc()'d once) */
-struct re_pattern_buffer *last_regex;
+struct sed_regex *last_regex;
 
 /* Various error messages we may want to print */
 static char ONE_ADDR[] = "Command only uses one address";
@@ -323,12 +765,22 @@ static char BAD_EOF[] = "Unexpected End-of-file";
 static char NO_REGEX[] = "No previous regular expression";
 static char NO_COMMAND[] = "Missing command";
 
+#ifndef LIBSED
 static struct option longopts[] = {
     {"expression", 1, NULL, 'e'},
     {"file", 1, NULL, 'f'},
     {"quiet", 0, NULL, 'n'},
     {"silent", 0, NULL, 'n'},
     {"version", 0, NULL, 'V'},
+    {"unbuffered", 0, NULL, 'u'},
+    {"pipeline", 0, NULL, 'P'},
+    {"in-place", 2, NULL, 'i'},
+    {"jobs", 1, NULL, 'j'},
+    {"serve", 1, NULL, 'S'},
+    {"profile", 0, NULL, 'p'},
+    {"max-line-bytes", 1, NULL, 'M'},
+    {"null-data", 0, NULL, 'z'},
+    {"record-separator", 1, NULL, 'R'},
     {"help", 0, NULL, 'h'},
     {NULL, 0, NULL, 0}
 };
@@ -338,17 +790,106 @@ void main(int argc, char **argv)
     int opt;
     char *e_strings = NULL;
     int compiled = 0;
-    struct sed_label *go, *lbl;
+    struct sed_program *program;
+    struct sed_context *ctx;
 
     /* see regex.h */
     re_set_syntax(RE_SYNTAX_POSIX_BASIC);
 
     myname = argv[0];
-    while ((opt = getopt_long(argc, argv, "hne:f:V", longopts, (int *)0)) != EOF) {
+    ctx = (struct sed_context *)ck_malloc(sizeof(struct sed_context));
+    memset(ctx, 0, sizeof(struct sed_context));
+    ctx->output.line_buffered = isatty(1);
+    current_ctx = ctx;
+    atexit(output_exit);
+
+    while ((opt = getopt_long(argc, argv, "hne:f:i::j:uVz", longopts, (int *)0)) != EOF) {
         switch (opt) {
             case 'n':
                 no_default_output = 1;
                 break;
+            case 'u':
+                ctx->output.line_buffered = 1;
+                break;
+            case 'i':
+                in_place = 1;
+                if (optarg) {
+                    in_place_suffix = optarg;
+                }
+                break;
+            case 'j':
+                jobs = atoi(optarg);
+                if (jobs < 1) {
+                    usage(4);
+                }
+                break;
+            case 'P':
+#ifndef NO_THREADS
+                pipelined = 1;
+#endif
+                break;
+            case 'S':
+                serve_path = optarg;
+                break;
+            case 'p':
+                profiling = 1;
+                break;
+            case 'z':
+                record_sep = '\0';
+                break;
+            case 'R':
+                /* One byte, or an escape for one */
+                if (optarg[0] == '\\' && optarg[1] && !optarg[2]) {
+                    switch (optarg[1]) {
+                        case '0':
+                            record_sep = '\0';
+                            break;
+                        case 'n':
+                            record_sep = '\n';
+                            break;
+                        case 't':
+                            record_sep = '\t';
+                            break;
+                        case 'r':
+                            record_sep = '\r';
+                            break;
+                        case '\\':
+                            record_sep = '\\';
+                            break;
+                        default:
+                            usage(4);
+                    }
+                } else if (optarg[0] && !optarg[1]) {
+                    record_sep = optarg[0];
+                } else {
+                    usage(4);
+                }
+                break;
+            case 'M': {
+                char *end;
+
+                max_line_bytes = strtol(optarg, &end, 10);
+                switch (*end) {
+                    case 'k':
+                    case 'K':
+                        max_line_bytes <<= 10;
+                        end++;
+                        break;
+                    case 'm':
+                    case 'M':
+                        max_line_bytes <<= 20;
+                        end++;
+                        break;
+                    case 'g':
+                    case 'G':
+                        max_line_bytes <<= 30;
+                        end++;
+                        break;
+                }
+                if (*end || max_line_bytes < 1 || max_line_bytes > INT_MAX / 2) {
+                    usage(4);
+                }
+            } break;
             case 'e':
                 if (e_strings == NULL) {
                     e_strings = ck_malloc(strlen(optarg) + 2);
@@ -393,68 +934,375 @@ void main(int argc, char **argv)
         compile_string(argv[optind++]);
     }
 
-    /* 在跳转指令部分, 追加跳转目的地信息 */
-    for (go = jumps; go; go = go->next) {
-        for (lbl = labels; lbl; lbl = lbl->next) {
-            if (!strcmp(lbl->name, go->name)) {
-                break;
-            }
-        }
+    program = link_program();
+    if (profiling) {
+        profile_start(program);
+    }
 
-        if (*go->name && !lbl) {
-            panic("Can't find label for jump to '%s'", go->name);
-        }
+#ifndef NO_THREADS
+    /* The threads that take pieces of a file never finish, so they
+       would never hand in their counts */
+    stateless_program = !profiling && program_is_stateless(program->vector);
+    parallel_threads = jobs ? jobs : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (parallel_threads > MAX_THREADS) {
+        parallel_threads = MAX_THREADS;
+    }
+#endif
 
-        go->v->v[go->v_index].x.jump = lbl;
+    /* There is nothing to edit in place without files */
+    if (in_place && optind >= argc && !serve_path) {
+        usage(4);
     }
 
-    line.length = 0;
-    line.alloc = 50;
-    line.text = ck_malloc(50);
+    /* The input comes from the socket, and the output goes back there */
+    if (serve_path) {
+        if (optind < argc || in_place) {
+            usage(4);
+        }
+        serve(program, serve_path);
+    }
 
-    append.length = 0;
-    append.alloc = 50;
-    append.text = ck_malloc(50);
+    /* The writer thread only knows about the standard output */
+    if (pipelined && !in_place) {
+        start_writer(ctx);
+    }
 
-    hold.length = 1;
-    hold.alloc = 50;
-    hold.text = ck_malloc(50);
-    hold.text[0] = '\n';
+    context_init(ctx, program);
 
     if (argc <= optind) {
-        last_input_file++;
-        read_file("-");
+        ctx->last_input_file++;
+        read_file(ctx, "-");
+    } else if (in_place && parallel_threads > 1 && argc - optind > 1 && program_is_file_local(program->vector)) {
+        read_files_parallel(ctx, argv + optind, argc - optind);
     } else {
         while (optind < argc) {
             if (optind == argc - 1) {
-                last_input_file++;
+                ctx->last_input_file++;
             }
 
-            read_file(argv[optind]);
+            /* Each file edited in place is a stream of its own */
+            if (in_place) {
+                new_stream(ctx);
+            }
+
+            read_file(ctx, argv[optind]);
             optind++;
-            if (quit_cmd) {
+            if (ctx->quit_cmd) {
                 break;
             }
+
+            /* The rest won't be read, but one that can't be is still an error */
+            if (ctx->input_done) {
+                while (optind < argc) {
+                    check_file(ctx, argv[optind]);
+                    optind++;
+                }
+            }
         }
     }
 
-    close_files();
+    close_files(program);
 
-    if (bad_input) {
+    if (ctx->bad_input) {
         exit(2);
     }
 
     exit(0);
 }
+#endif /* LIBSED */
+
+/* Get CTX ready to run PROGRAM.  It should be zeroed beforehand, apart
+ * from the output options. */
+void context_init(struct sed_context *ctx, struct sed_program *program)
+{
+    ctx->program = program;
+    ctx->no_default_output = program->no_default_output;
+
+    ctx->line.length = 0;
+    ctx->line.alloc = 50;
+    ctx->line.text = ck_malloc(50);
+
+    ctx->append.length = 0;
+    ctx->append.alloc = 50;
+    ctx->append.text = ck_malloc(50);
+
+    ctx->hold.length = 1;
+    ctx->hold.alloc = 50;
+    ctx->hold.text = ck_malloc(50);
+    ctx->hold.text[0] = record_sep;
+
+    ctx->range_open = ck_malloc(program->num_ranges);
+    memset(ctx->range_open, 0, program->num_ranges);
+
+    if (profiling) {
+        ctx->profile = (struct cmd_profile *)ck_malloc(program->num_ranges * sizeof(struct cmd_profile) + 1);
+        memset(ctx->profile, 0, program->num_ranges * sizeof(struct cmd_profile));
+        ctx->regex_profile = (struct regex_profile *)ck_malloc(program->num_regexes * sizeof(struct regex_profile) + 1);
+        memset(ctx->regex_profile, 0, program->num_regexes * sizeof(struct regex_profile));
+    }
+
+    if (program->addr_set) {
+        ctx->addr_found = (unsigned long *)ck_malloc(ADDR_FOUND_WORDS(program) * sizeof(unsigned long));
+    }
+}
+
+/* Free what CTX has allocated (but not CTX itself). */
+void context_free(struct sed_context *ctx)
+{
+    line_discard(ctx);
+    free(ctx->line.text);
+    free(ctx->hold.text);
+    free(ctx->append.text);
+    if (ctx->subst.text) {
+        free(ctx->subst.text);
+    }
+    if (ctx->regs.start) {
+        free(ctx->regs.start);
+        free(ctx->regs.end);
+    }
+    free(ctx->range_open);
+    if (ctx->addr_found) {
+        free(ctx->addr_found);
+    }
+    if (ctx->fused_found) {
+        free(ctx->fused_found);
+    }
+    if (ctx->fused_taken.text) {
+        free(ctx->fused_taken.text);
+    }
+    if (ctx->windows) {
+        int i;
+
+        for (i = 0; i < ctx->num_windows; i++) {
+            free(ctx->windows[i].carry.text);
+            free(ctx->windows[i].out.text);
+            free(ctx->windows[i].replacement.text);
+        }
+        free(ctx->windows);
+    }
+    if (ctx->profile) {
+        profile_merge(ctx);
+        free(ctx->profile);
+        free(ctx->regex_profile);
+    }
+    if (ctx->input.buf) {
+        free(ctx->input.buf);
+    }
+    if (ctx->output.buf) {
+        free(ctx->output.buf);
+    }
+}
+
+/* Forget everything the script carries from one input line to the next,
+ * for a file that's a stream of its own. */
+void new_stream(struct sed_context *ctx)
+{
+    ctx->last_input_file = 1;
+    ctx->input_line_number = 0;
+    ctx->input_EOF = 0;
+    ctx->quit_cmd = 0;
+    ctx->hold.length = 1;
+    ctx->hold.text[0] = record_sep;
+    memset(ctx->range_open, 0, ctx->program->num_ranges);
+}
+
+/* --profile times commands with the processor's cycle counter where
+   there is one to hand, and with the clock (in nanoseconds) otherwise. */
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define cycle_count() __builtin_ia32_rdtsc()
+#define CYCLE_UNIT "cycles"
+#else
+static unsigned long long cycle_count()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+#define CYCLE_UNIT "ns"
+#endif
+
+/* The counts from every context that has finished with the program, and
+   the program, for profile_report */
+struct sed_program *profiled_program;
+struct cmd_profile *profile_totals;
+struct regex_profile *regex_totals;
+#ifndef NO_THREADS
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* Get ready to count what PROGRAM does, and to say so at exit. */
+void profile_start(struct sed_program *program)
+{
+    profiled_program = program;
+    profile_totals = (struct cmd_profile *)ck_malloc(program->num_ranges * sizeof(struct cmd_profile) + 1);
+    memset(profile_totals, 0, program->num_ranges * sizeof(struct cmd_profile));
+    regex_totals = (struct regex_profile *)ck_malloc(program->num_regexes * sizeof(struct regex_profile) + 1);
+    memset(regex_totals, 0, program->num_regexes * sizeof(struct regex_profile));
+    atexit(profile_report);
+}
+
+/* Charge the time since the last call to the command that was running
+   then, and start the clock for CMD (which is null between cycles). */
+void profile_enter(struct sed_context *ctx, struct sed_cmd *cmd)
+{
+    unsigned long long now = cycle_count();
+
+    if (ctx->prof_cmd) {
+        ctx->profile[ctx->prof_cmd->range_id].cycles += now - ctx->prof_stamp;
+    }
+    ctx->prof_cmd = cmd;
+    ctx->prof_stamp = now;
+}
+
+/* match_regex, counted against REGEX and the running command if CTX is
+   keeping a profile. */
+int count_match(struct sed_context *ctx, struct sed_regex *regex, char *text, int length, int start, struct re_registers *regs)
+{
+    struct regex_profile *rp;
+    int offset;
+
+    if (!ctx->profile) {
+        return match_regex(regex, text, length, start, regs);
+    }
+
+    if (ctx->prof_cmd) {
+        ctx->profile[ctx->prof_cmd->range_id].regex_calls++;
+    }
+    rp = &ctx->regex_profile[regex->id];
+    rp->calls++;
+    re_set_stats(&rp->re);
+    offset = match_regex(regex, text, length, start, regs);
+    re_set_stats((struct re_stats *)0);
+    if (offset >= 0) {
+        rp->matches++;
+    }
+    return offset;
+}
+
+/* Add CTX's counts to the totals, and start it again from zero. */
+void profile_merge(struct sed_context *ctx)
+{
+    struct sed_program *program = ctx->program;
+    int i;
+
+    if (program != profiled_program) {
+        return;
+    }
+
+#ifndef NO_THREADS
+    pthread_mutex_lock(&profile_lock);
+#endif
+    for (i = 0; i < program->num_ranges; i++) {
+        profile_totals[i].evals += ctx->profile[i].evals;
+        profile_totals[i].hits += ctx->profile[i].hits;
+        profile_totals[i].runs += ctx->profile[i].runs;
+        profile_totals[i].regex_calls += ctx->profile[i].regex_calls;
+        profile_totals[i].cycles += ctx->profile[i].cycles;
+    }
+    for (i = 0; i < program->num_regexes; i++) {
+        struct regex_profile *total = &regex_totals[i];
+        struct regex_profile *rp = &ctx->regex_profile[i];
+
+        total->calls += rp->calls;
+        total->matches += rp->matches;
+        total->re.searches += rp->re.searches;
+        total->re.dfa_scans += rp->re.dfa_scans;
+        total->re.attempts += rp->re.attempts;
+        total->re.fastmap_skips += rp->re.fastmap_skips;
+        if (rp->re.max_failures > total->re.max_failures) {
+            total->re.max_failures = rp->re.max_failures;
+        }
+    }
+#ifndef NO_THREADS
+    pthread_mutex_unlock(&profile_lock);
+#endif
+
+    memset(ctx->profile, 0, program->num_ranges * sizeof(struct cmd_profile));
+    memset(ctx->regex_profile, 0, program->num_regexes * sizeof(struct regex_profile));
+}
+
+/* Print a line of the report for each command in VEC, in script order. */
+static void profile_commands(struct vector *vec)
+{
+    struct sed_cmd *cur_cmd;
+    char where[64];
+
+    for (cur_cmd = vec->v; cur_cmd < vec->v + vec->v_length; cur_cmd++) {
+        struct cmd_profile *cp = &profile_totals[cur_cmd->range_id];
+
+        sprintf(where, "%.40s:%d", cur_cmd->file, cur_cmd->line);
+        fprintf(stderr, "%-24s %c %12lu %12lu %12lu %12lu %16llu\n",
+                where, cur_cmd->cmd, cp->evals, cp->hits, cp->runs, cp->regex_calls, cp->cycles);
+        if (cur_cmd->cmd == '{') {
+            profile_commands(cur_cmd->x.sub);
+        }
+    }
+}
+
+/* At exit, print what --profile counted to the standard error. */
+void profile_report()
+{
+    struct sed_program *program = profiled_program;
+    struct sed_regex **by_id;
+    struct sed_regex *regex;
+    char where[64];
+    int i;
+
+    if (current_ctx && current_ctx->profile) {
+        profile_merge(current_ctx);
+    }
+
+    fprintf(stderr, "%-24s %c %12s %12s %12s %12s %16s\n",
+            "command", ' ', "evals", "hits", "runs", "regex calls", CYCLE_UNIT);
+    profile_commands(program->vector);
+
+    if (!program->num_regexes) {
+        return;
+    }
+
+    by_id = (struct sed_regex **)ck_malloc(program->num_regexes * sizeof(struct sed_regex *));
+    for (regex = program->regexes; regex; regex = regex->next) {
+        by_id[regex->id] = regex;
+    }
+
+    /* Which matcher answered each call: memsearch (for a plain string,
+       or a string a match must have and the line hasn't), the DFA, or
+       re_search, the only one that makes attempts and keeps a failure
+       stack */
+    fprintf(stderr, "\n%-24s %12s %12s %12s %12s %12s %12s %14s %12s\n",
+            "regex", "calls", "matches", "memsearch", "dfa", "re_search", "attempts", "fastmap skips", "max failures");
+    for (i = 0; i < program->num_regexes; i++) {
+        struct regex_profile *rp = &regex_totals[i];
+        unsigned long searched = rp->re.dfa_scans + rp->re.searches;
+
+        sprintf(where, "%.40s:%d", by_id[i]->file, by_id[i]->line);
+        fprintf(stderr, "%-24s %12lu %12lu %12lu %12lu %12lu",
+                where, rp->calls, rp->matches, rp->calls > searched ? rp->calls - searched : 0, rp->re.dfa_scans, rp->re.searches);
+        if (rp->re.searches) {
+            fprintf(stderr, " %12lu %14lu %12u\n", rp->re.attempts, rp->re.fastmap_skips, rp->re.max_failures);
+        } else {
+            fprintf(stderr, " %12s %14s %12s\n", "-", "-", "-");
+        }
+    }
+    free(by_id);
+}
 
-void close_files() {
-    int nf;
+/* Close the files PROGRAM's r and w commands opened */
+void close_files(struct sed_program *program)
+{
+    struct sed_file *f, *next;
 
-    for (nf = 0; nf < NUM_FPS; nf++) {
-        if (file_ptrs[nf].phile) {
-            fclose(file_ptrs[nf].phile);
+    for (f = program->files; f; f = next) {
+        next = f->next;
+        if (f->phile) {
+            fclose(f->phile);
+            __fp_forget(f->phile);
         }
+        free(f->name);
+        free(f);
     }
+    program->files = 0;
 }
 
 /* 'str' is a string (from the command line) that contains a sed command.
@@ -463,9 +1311,13 @@ void compile_string(char *str)
 {
     prog_file = 0;
     prog_line = 0;
+    script_line = 1;
     prog_start = prog_cur = (unsigned char *)str;
     prog_end = (unsigned char *)str + strlen(str);
-    the_program = compile_program(the_program, prog_line);
+    if (!the_program) {
+        the_program = new_vector();
+    }
+    compile_program(the_program, prog_line);
 }
 
 /* 'str' is the name of a file containing sed commands.
@@ -500,11 +1352,29 @@ void compile_file(char *str)
     }
 
     /* 请注意这里 prof_file 是全局变量 */
-    the_program = compile_program(the_program, prog_line);
+    script_line = prog_line;
+    if (!the_program) {
+        the_program = new_vector();
+    }
+    compile_program(the_program, prog_line);
 }
 
 #define MORE_CMDS 40
 
+/* Make an empty vector to compile commands into. */
+struct vector *new_vector()
+{
+    struct vector *vector;
+
+    vector = (struct vector *)ck_malloc(sizeof(struct vector));
+    vector->v = (struct sed_cmd *)ck_malloc(MORE_CMDS * sizeof(struct sed_cmd));
+    vector->v_allocated = MORE_CMDS;
+    vector->v_length = 0;
+    vector->return_v = 0;
+    vector->return_i = 0;
+    return vector;
+}
+
 /* Read a program (or a subprogram within '{' '}' pairs) in and
  * store the compiled form in *'vector'.
  * Return a pointer to the new vector.
@@ -521,12 +1391,7 @@ struct vector *compile_program(struct vector *vector, int open_line)
     int num;
 
     if (!vector) {
-        vector = (struct vector *)ck_malloc(sizeof(struct vector));
-        vector->v = (struct sed_cmd *)ck_malloc(MORE_CMDS * sizeof(struct sed_cmd));
-        vector->v_allocated = MORE_CMDS;
-        vector->v_length = 0;
-        vector->return_v = 0;
-        vector->return_i = 0;
+        vector = new_vector();
     }
 
     for (;;) {
@@ -560,10 +1425,12 @@ struct vector *compile_program(struct vector *vector, int open_line)
         cur_cmd = vector->v + vector->v_length;
         vector->v_length++;
 
-        cur_cmd->a1.addr_type = 0;
-        cur_cmd->a2.addr_type = 0;
-        cur_cmd->aflags = 0;
-        cur_cmd->cmd = 0;
+        /* Zeroed, so that a command left half done by an error can still
+           be freed (see free_vector) */
+        memset(cur_cmd, 0, sizeof(struct sed_cmd));
+        cur_cmd->range_id = num_ranges++;
+        cur_cmd->file = prog_file ? prog_name : "-e";
+        cur_cmd->line = script_line;
 
         /* 命令可以不带任何地址. 必须要有地址的命令, 下面 switch 语句会有判断 */
         if (compile_address(&(cur_cmd->a1))) {
@@ -665,7 +1532,8 @@ struct vector *compile_program(struct vector *vector, int open_line)
                 /* {} 里面括起来的, 是子命令 */
                 cur_cmd->cmd = ch;
                 program_depth++;
-                cur_cmd->x.sub = compile_program((struct vector *)0, prog_line);
+                cur_cmd->x.sub = new_vector();
+                compile_program(cur_cmd->x.sub, prog_line);
                 /* FOO JF is this the right thing to do?
                    almost. don't forget a return addr.  -t */
                 cur_cmd->x.sub->return_v = vector;
@@ -698,6 +1566,7 @@ struct vector *compile_program(struct vector *vector, int open_line)
                 }
 
                 labels = setup_jump(labels, cur_cmd, vector);
+                add_label(labels);
                 break;
             case 'b':
             case 't':
@@ -782,9 +1651,7 @@ struct vector *compile_program(struct vector *vector, int open_line)
                 }
 
                 /* 替换操作数部分 */
-                cur_cmd->x.cmd_regex.replace_length = size_buffer(b);
-                cur_cmd->x.cmd_regex.replacement = ck_malloc(cur_cmd->x.cmd_regex.replace_length);
-                bcopy(get_buffer(b), cur_cmd->x.cmd_regex.replacement, cur_cmd->x.cmd_regex.replace_length);
+                compile_replacement(cur_cmd, get_buffer(b), size_buffer(b));
                 flush_buffer(b);
 
                 /* flags/numb 会在下面被重新写入 */
@@ -918,9 +1785,18 @@ struct vector *compile_program(struct vector *vector, int open_line)
     return vector;
 }
 
-/* Complain about a programming error and exit. */
+/* Complain about a programming error and exit, or, for a library caller
+   (see panic), return to it with the complaint. */
 void bad_prog(char *why)
 {
+    if (panic_jump) {
+        if (prog_line > 0)
+            sprintf(panic_message, "file %.100s line %d: %.100s", prog_name, prog_line, why);
+        else
+            sprintf(panic_message, "%.200s", why);
+        longjmp(*panic_jump, 1);
+    }
+
     if (prog_line > 0)
         fprintf(stderr, "%s: file %s line %d: %s\n",
                 myname, prog_name, prog_line, why);
@@ -955,8 +1831,11 @@ int inchar() {
         }
     }
 
-    if ((ch == '\n') && prog_line) {
-        prog_line++;
+    if (ch == '\n') {
+        script_line++;
+        if (prog_line) {
+            prog_line++;
+        }
     }
 
     return ch;
@@ -970,8 +1849,11 @@ void savchar(int ch)
         return;
     }
 
-    if (ch == '\n' && prog_line > 1) {
-        --prog_line;
+    if (ch == '\n') {
+        --script_line;
+        if (prog_line > 1) {
+            --prog_line;
+        }
     }
 
     if (prog_file) {
@@ -1136,25 +2018,32 @@ void compile_regex(int slash)
         }
     }
 
-    printf("AAAAAAAA--2\n->");
-    char *bbb = get_buffer(b);
-    for (int x = 0; x < size_buffer(b); x++) {
-        printf("%c", bbb[x]);
-    }
-    printf("<-\nAAAAAAAA--3\n");
-
-
     if (ch == EOF) {
         bad_prog(BAD_EOF);
     }
 
     if (size_buffer(b)) {
-        last_regex = (struct re_pattern_buffer *)ck_malloc(sizeof(struct re_pattern_buffer));
-        last_regex->allocated = size_buffer(b) + 10;
-        last_regex->buffer = (unsigned char *)ck_malloc(last_regex->allocated);
-        last_regex->fastmap = ck_malloc(256);
-        last_regex->translate = 0;
-        re_compile_pattern(get_buffer(b), size_buffer(b), last_regex);
+        last_regex = (struct sed_regex *)ck_malloc(sizeof(struct sed_regex));
+        memset(last_regex, 0, sizeof(struct sed_regex));
+        last_regex->next = regexes;
+        regexes = last_regex;
+        last_regex->id = num_regexes++;
+        last_regex->file = prog_file ? prog_name : "-e";
+        last_regex->line = script_line;
+        last_regex->pattern.allocated = size_buffer(b) + 10;
+        last_regex->pattern.buffer = (unsigned char *)ck_malloc(last_regex->pattern.allocated);
+        last_regex->pattern.fastmap = ck_malloc(256);
+        last_regex->pattern.translate = 0;
+        re_compile_pattern(get_buffer(b), size_buffer(b), &last_regex->pattern);
+
+        /* Settle everything re_search would otherwise fill in on first use,
+         * so that threads can share the pattern: the fastmap, and the
+         * register arrays, which match_regex sees are big enough. */
+        re_compile_fastmap(&last_regex->pattern);
+        last_regex->pattern.regs_allocated = REGS_REALLOCATE;
+        last_regex->dfa = re_dfa_compile(&last_regex->pattern);
+        compile_literal(last_regex, get_buffer(b), size_buffer(b));
+        compile_required(last_regex, get_buffer(b), size_buffer(b));
     } else if (!last_regex) {
         bad_prog(NO_REGEX);
     }
@@ -1162,824 +2051,3736 @@ void compile_regex(int slash)
     flush_buffer(b);
 }
 
-/* Store a label (or label reference) created by a ':', 'b', or 't'
-   comand so that the jump to/from the lable can be backpatched after
-   compilation is complete */
-struct sed_label *setup_jump(struct sed_label *list, struct sed_cmd *cmd, struct vector *vec)
+/* If PAT (SIZE bytes of regex, as rewritten by compile_regex) consists of
+ * ordinary characters only, perhaps with a leading '\`' or trailing '\'',
+ * record that in REGEX so that match_regex can look for it with memsearch.
+ * Anything with a backslash or a character that might be special left in
+ * it is left to the regex matcher. */
+void compile_literal(struct sed_regex *regex, char *pat, int size)
 {
-    struct sed_label *tmp;
-    VOID *b;
-    int ch;
+    int i;
 
-    b = init_buffer(); /* b 里面放置标记名称 */
+    regex->literal = 0;
+    regex->literal_len = 0;
+    regex->anchor_start = regex->anchor_end = 0;
 
-    while ((ch = inchar()) != EOF && isblank(ch)) {
-        // skip blank
+    if (size >= 2 && pat[0] == '\\' && pat[1] == '`') {
+        regex->anchor_start = 1;
+        pat += 2;
+        size -= 2;
     }
 
-    /* Possible non posixicity. */
-    while (ch != EOF && ch != '\n' && (!isblank(ch)) && ch != ';' && ch != '}') {
-        add1_buffer(b, ch);
-        ch = inchar();
+    if (size >= 2 && pat[size - 2] == '\\' && pat[size - 1] == '\'') {
+        regex->anchor_end = 1;
+        size -= 2;
     }
 
-    savchar(ch);
-    add1_buffer(b, '\0');
-
-    tmp = (struct sed_label *)ck_malloc(sizeof(struct sed_label));
-    tmp->v = vec;
-    tmp->v_index = cmd - vec->v; /* 当前 cmd 所在 vector 中的位置 */
-    tmp->name = ck_strdup(get_buffer(b)); /* 这里是 label 的名字 */
-    tmp->next = list; /* 跳转 label 是一个链表, 现在把新元素追加在链表头部 */
+    for (i = 0; i < size; i++) {
+        if (strchr("\\.[*^$", pat[i])) {
+            regex->anchor_start = regex->anchor_end = 0;
+            return;
+        }
+    }
 
-    flush_buffer(b);
-    return tmp;
+    regex->literal = ck_malloc(size);
+    bcopy(pat, regex->literal, size);
+    regex->literal_len = size;
 }
 
-/* read in a filename for a 'r', 'w', or 's///w' command, and
-   update the internal structure about files.  The file is
-   opened if it isn't already open. */
-FILE * compile_filename(int readit)
+/* Compile the SIZE bytes at REP, the replacement part of the s command
+ * CMD, into the list of pieces that append_replacement works from.  '&'
+ * stands for the whole match and '\N' for group N; any other character
+ * after a backslash stands for itself. */
+void compile_replacement(struct sed_cmd *cmd, char *rep, int size)
 {
-    char *file_name;
-    int n;
-    VOID *b;
-    int ch;
+    char *rep_end = rep + size;
+    char *text;         /* The literal parts, one after another */
+    int text_len = 0;
+    int piece_start = 0; /* Where the current piece's literal text begins */
+    struct replacement *pieces;
+    int npieces = 0;
+    int allocated = 4;
+
+    text = ck_malloc(size + 1);
+    pieces = (struct replacement *)ck_malloc(allocated * sizeof(struct replacement));
+
+    for (; rep <= rep_end; rep++) {
+        int id;
+
+        if (rep == rep_end) {
+            if (text_len == piece_start && npieces) {
+                break;
+            }
+            id = -1;
+        } else if (*rep == '&') {
+            id = 0;
+        } else if (*rep == '\\') {
+            if (++rep == rep_end) {
+                /* 末尾单独的 '\' 被丢弃 */
+                continue;
+            }
+            if (*rep < '0' || *rep > '9') {
+                text[text_len++] = *rep;
+                continue;
+            }
+            id = *rep - '0';
+        } else {
+            text[text_len++] = *rep;
+            continue;
+        }
 
-    if (inchar() != ' ') {
-        /* r/w or s///w 指令, 文件名开始之前都要求有一个空格 */
-        bad_prog("missing ' ' before filename");
+        if (npieces == allocated) {
+            allocated *= 2;
+            pieces = (struct replacement *)ck_realloc(pieces, allocated * sizeof(struct replacement));
+        }
+        pieces[npieces].prefix = text + piece_start;
+        pieces[npieces].prefix_length = text_len - piece_start;
+        pieces[npieces].subst_id = id;
+        npieces++;
+        piece_start = text_len;
     }
 
-    b = init_buffer();
-    while ((ch = inchar()) != EOF && ch != '\n') {
-        add1_buffer(b, ch);
+    cmd->x.cmd_regex.replacement = pieces;
+    cmd->x.cmd_regex.replace_pieces = npieces;
+    cmd->x.cmd_regex.replace_fixed = text_len;
+}
+
+/* Find the longest run of ordinary characters that every match of PAT
+ * (SIZE bytes, as for compile_literal) must contain, and save it as
+ * REGEX's required string.  Only the top level of the pattern is looked
+ * at: groups, bracket expressions and anything else we aren't sure of
+ * just end the current run, and an alternation there means nothing is
+ * required at all.  A character followed by a repetition operator may
+ * not be there, so it is dropped from the run. */
+void compile_required(struct sed_regex *regex, char *pat, int size)
+{
+    char *best = 0;
+    int best_len = 0;
+    char *run = 0; /* 当前这一段的字面量 */
+    int run_len = 0;
+    int depth = 0;
+    char *p = pat;
+    char *end = pat + size;
+
+    regex->required = 0;
+    regex->required_len = 0;
+
+    if (regex->literal) {
+        return;
     }
 
-    add1_buffer(b, '\0');
-    file_name = get_buffer(b);
-    for (n = 0; n < NUM_FPS; n++) {
-        /* 找到第一个可用的 file_ptrs 位置 */
-        if (!file_ptrs[n].name) {
+    run = (char *)ck_malloc(size);
+    best = (char *)ck_malloc(size);
+
+#define END_RUN()                                                             \
+    do {                                                                      \
+        if (depth == 0 && run_len > best_len) {                               \
+            bcopy(run, best, run_len);                                        \
+            best_len = run_len;                                               \
+        }                                                                     \
+        run_len = 0;                                                          \
+    } while (0)
+
+    while (p < end) {
+        int ch = *p++;
+
+        if (ch == '[') {
+            /* 跳过整个 [...], 注意 []...] 和 [^]...] 以及 [:alpha:] 的形式 */
+            END_RUN();
+            if (p < end && *p == '^') {
+                p++;
+            }
+            if (p < end && *p == ']') {
+                p++;
+            }
+            while (p < end && *p != ']') {
+                if (*p == '[' && p + 1 < end && (p[1] == ':' || p[1] == '.' || p[1] == '=')) {
+                    int delim = p[1];
+                    p += 2;
+                    while (p + 1 < end && !(p[0] == delim && p[1] == ']')) {
+                        p++;
+                    }
+                    p += 2;
+                } else {
+                    p++;
+                }
+            }
+            p++;
+        } else if (ch == '*') {
+            if (run_len) {
+                run_len--;
+            }
+            END_RUN();
+        } else if (ch == '.' || ch == '^' || ch == '$') {
+            END_RUN();
+        } else if (ch != '\\') {
+            if (depth == 0) {
+                run[run_len++] = ch;
+            }
+        } else if (p == end) {
             break;
-        }
-
-        if (!strcmp(file_ptrs[n].name, file_name)) {
-            if (file_ptrs[n].readit != readit) {
-                bad_prog("Can't open file for both reading and writing");
+        } else {
+            ch = *p++;
+            switch (ch) {
+                case '\\':
+                case '.':
+                case '*':
+                case '[':
+                case ']':
+                case '^':
+                case '$':
+                case '/':
+                    if (depth == 0) {
+                        run[run_len++] = ch;
+                    }
+                    break;
+                case '(':
+                    END_RUN();
+                    depth++;
+                    break;
+                case ')':
+                    END_RUN();
+                    if (depth > 0) {
+                        depth--;
+                    }
+                    break;
+                case '|':
+                    if (depth == 0) {
+                        free(run);
+                        free(best);
+                        return;
+                    }
+                    break;
+                case '?':
+                case '+':
+                    if (run_len) {
+                        run_len--;
+                    }
+                    END_RUN();
+                    break;
+                case '{':
+                    if (run_len) {
+                        run_len--;
+                    }
+                    END_RUN();
+                    while (p + 1 < end && !(p[0] == '\\' && p[1] == '}')) {
+                        p++;
+                    }
+                    p += 2;
+                    break;
+                default:
+                    END_RUN();
+                    break;
             }
-
-            flush_buffer(b);
-            return file_ptrs[n].phile;
         }
     }
+    END_RUN();
 
-    if (n < NUM_FPS) {
-        /* 正式打开文件, 将文件句柄保存到 file_ptrs */
-        file_ptrs[n].name = ck_strdup(file_name);
-        file_ptrs[n].readit = readit;
-
-        if (!readit) {
-            file_ptrs[n].phile = ck_fopen(file_name, "w");
-        } else {
-            file_ptrs[n].phile = ck_fopen(file_name, "r");
-        }
+#undef END_RUN
 
-        flush_buffer(b);
-        return file_ptrs[n].phile;
+    free(run);
+    if (best_len) {
+        regex->required = best;
+        regex->required_len = best_len;
     } else {
-        bad_prog("Hopelessely evil compiled in limit on number of open files.  re-compile sed");
-        return 0;
+        free(best);
     }
 }
 
-/* Read a file and apply the compiled script to it.
- * 请注意本函数只处理一个文件 */
-void read_file(char *name)
+/* Search for REGEX in the LENGTH bytes at TEXT, starting at START, the
+ * way re_search(pattern, TEXT, LENGTH, START, LENGTH - START, REGS) would,
+ * but taking any shortcut the pattern allows.  Return the position of the
+ * match, or -1 if there isn't one.  If REGS is null the caller only wants
+ * to know whether there is a match, and the return value is just
+ * non-negative if there is. */
+int match_regex(struct sed_regex *regex, char *text, int length, int start, struct re_registers *regs)
 {
-    if (*name == '-' && name[1] == '\0') {
-        input_file = stdin;
-    } else {
-        input_file = fopen(name, "r");
-        if (input_file == 0) {
-            bad_input++;
-            fprintf(stderr, "%s: can't read %s: %s\n", myname, name, strerror(errno));
-            return;
-        }
+    if (start > length) {
+        return -1;
     }
 
-    /* 从文件中读取模式空间, 模式空间会被报错在 line 全局变量里面
-     * 然后用 execute_program 处理模式空间里面的内容 */
-    while (read_pattern_space()) {
-        execute_program(the_program);
+    if (regs && regs->num_regs < RE_NREGS) {
+        regs->start = (regoff_t *)ck_realloc(regs->start, RE_NREGS * sizeof(regoff_t));
+        regs->end = (regoff_t *)ck_realloc(regs->end, RE_NREGS * sizeof(regoff_t));
+        regs->num_regs = RE_NREGS;
+    }
 
-        if (!no_default_output) {
-            ck_fwrite(line.text, 1, line.length, stdout);
-        }
+    if (regex->literal) {
+        char *lit = regex->literal;
+        int len = regex->literal_len;
+        char *p;
+        int i;
 
-        if (append.length) {
-            /* 这里, 如果有追加的内容, 打印出来 */
-            ck_fwrite(append.text, 1, append.length, stdout);
-            append.length = 0;
+        if (regex->anchor_start) {
+            p = text;
+            if (start > 0 || len > length || (regex->anchor_end && len != length) || memcmp(p, lit, len)) {
+                return -1;
+            }
+        } else if (regex->anchor_end) {
+            p = text + length - len;
+            if (p < text + start || memcmp(p, lit, len)) {
+                return -1;
+            }
+        } else if (!(p = memsearch(text + start, length - start, lit, len))) {
+            return -1;
         }
 
-        if (quit_cmd) {
-            break;
+        if (regs) {
+            regs->start[0] = p - text;
+            regs->end[0] = p - text + len;
+            for (i = 1; i < regs->num_regs; i++) {
+                regs->start[i] = regs->end[i] = -1;
+            }
         }
+
+        return p - text;
     }
 
-    ck_fclose(input_file);
-}
+    if (regex->required && !memsearch(text + start, length - start, regex->required, regex->required_len)) {
+        return -1;
+    }
 
-static char *eol_pos(char *str, int len)
-{
-    while (len--) {
-        if (*str++ == '\n') {
-            return --str;
+    /* 只需要知道是否匹配的时候, 用 DFA 即可 */
+    if (!regs && !start && regex->dfa) {
+        int match = re_dfa_search(regex->dfa, text, length);
+        if (match >= 0) {
+            return match ? 0 : -1;
         }
     }
 
-    return --str;
+    return re_search(&regex->pattern, text, length, start, length - start, regs);
 }
 
-static void chr_copy(char *dest, char *src, int len)
+/* Store a label (or label reference) created by a ':', 'b', or 't'
+   comand so that the jump to/from the lable can be backpatched after
+   compilation is complete */
+struct sed_label *setup_jump(struct sed_label *list, struct sed_cmd *cmd, struct vector *vec)
 {
-    while (len--) {
-        *dest++ = *src++;
-    }
-}
+    struct sed_label *tmp;
+    VOID *b;
+    int ch;
 
-static struct re_registers regs = {0, 0, 0};
+    b = init_buffer(); /* b 里面放置标记名称 */
 
-/* Execute the program 'vec' on the current input line. */
-void execute_program(struct vector *vec)
-{
-    struct sed_cmd *cur_cmd;
-    int n;
-    int addr_matched;
+    while ((ch = inchar()) != EOF && isblank(ch)) {
+        // skip blank
+    }
 
-    /* 这个变量指示退出编辑程序解释循环
-     * 也就是对当前的模式空间内容来说, 编辑程序解释完或者终止解释 */
-    static int end_cycle;
+    /* Possible non posixicity. */
+    while (ch != EOF && ch != '\n' && (!isblank(ch)) && ch != ';' && ch != '}') {
+        add1_buffer(b, ch);
+        ch = inchar();
+    }
 
-    int start;
-    int remain;
-    int offset;
+    savchar(ch);
+    add1_buffer(b, '\0');
 
-    static struct line tmp;
-    struct line t;
-    char *rep, *rep_end, *rep_next, *rep_cur;
+    tmp = (struct sed_label *)ck_malloc(sizeof(struct sed_label));
+    tmp->v = vec;
+    tmp->v_index = cmd - vec->v; /* 当前 cmd 所在 vector 中的位置 */
+    tmp->name = ck_strdup(get_buffer(b)); /* 这里是 label 的名字 */
+    tmp->next = list; /* 跳转 label 是一个链表, 现在把新元素追加在链表头部 */
 
-    int count;
-    struct vector *restart_vec = vec;
+    flush_buffer(b);
+    return tmp;
+}
 
-restart:
-    vec = restart_vec;
-    count = 0;
+/* Return the slot in label_table for the label called NAME: the one it
+   is in, or the empty one it would go in. */
+struct sed_label **find_label(char *name)
+{
+    unsigned mask = label_table_size - 1;
+    unsigned h = 0;
+    char *p;
 
-    end_cycle = 0;
+    for (p = name; *p; p++) {
+        h = h * 31 + (unsigned char)*p;
+    }
 
-    for (cur_cmd = vec->v, n = vec->v_length; n; cur_cmd++, n--) {
-    exe_loop:
-        addr_matched = 0;
-        if (cur_cmd->aflags & A1_MATCHED_BIT) {
-            /* 进入这个分支即, 之前 a1 已经匹配了, 现在尝试找匹配的 a2.
-             * a1 ~ a2 之间的行, 都会被认为是符合地址要求的 */
-            addr_matched = 1;
-            if (match_address(&(cur_cmd->a2))) {
-                /* a2 是结束地址, 这时候撤销标记位, 下次循环编辑程序就不生效了 */
-                cur_cmd->aflags &= ~A1_MATCHED_BIT;
-            }
-        } else if (match_address(&(cur_cmd->a1))) {
-            addr_matched = 1;
-            if (cur_cmd->a2.addr_type != addr_is_null) {
-                if ((cur_cmd->a2.addr_type == addr_is_regex) || !match_address(&(cur_cmd->a2))) {
-                    /* 如果 a2 是正则表达式, 或者当前不符合 a2 地址的时候.
-                     * 置标记位, 下次编辑循环就可以进到上面那个分支 */
-                    cur_cmd->aflags |= A1_MATCHED_BIT;
-                }
-            }
+    for (h &= mask; label_table[h]; h = (h + 1) & mask) {
+        if (!strcmp(label_table[h]->name, name)) {
+            break;
         }
+    }
+    return label_table + h;
+}
 
-        if (cur_cmd->aflags & ADDR_BANG_BIT) {
-            /* 这就是感叹号命令的实现, 对地址范围效果取反 */
-            addr_matched = !addr_matched;
+/* Put LBL in label_table, unless there is a label of that name already. */
+void add_label(struct sed_label *lbl)
+{
+    struct sed_label **slot;
+
+    /* Keep the table no more than half full */
+    if (2 * (num_labels + 1) > label_table_size) {
+        struct sed_label **old = label_table;
+        int old_size = label_table_size;
+        int i;
+
+        label_table_size = old_size ? 2 * old_size : 64;
+        label_table = (struct sed_label **)ck_malloc(label_table_size * sizeof(struct sed_label *));
+        memset(label_table, 0, label_table_size * sizeof(struct sed_label *));
+        for (i = 0; i < old_size; i++) {
+            if (old[i]) {
+                *find_label(old[i]->name) = old[i];
+            }
         }
-
-        if (!addr_matched) {
-            /* 如果未能匹配到地址, 则说明命令不适用于当前编辑位置, 略过即可 */
-            continue;
+        if (old) {
+            free(old);
         }
+    }
 
-        switch (cur_cmd->cmd) {
-            case '{': /* Execute sub-program */
-                if (cur_cmd->x.sub->v_length) {
-                    vec = cur_cmd->x.sub;
-                    cur_cmd = vec->v;
-                    n = vec->v_length;
-                    goto exe_loop;
-                }
-                break;
+    slot = find_label(lbl->name);
+    if (*slot) {
+        bad_prog("Duplicate label");
+    }
+    *slot = lbl;
+    num_labels++;
+}
 
-            case '}':
-                cur_cmd = vec->return_v->v + vec->return_i;
-                n = vec->return_v->v_length - vec->return_i;
-                vec = vec->return_v;
-                break;
+/* Point each jump compiled so far at its label, and hand back all that
+   has been compiled as a program of its own. */
+struct sed_program *link_program()
+{
+    struct sed_program *program;
+    struct sed_label *go, *lbl;
 
-            case ':': /* Executing labels is easy. */
-                break;
+    /* 在跳转指令部分, 追加跳转目的地信息 */
+    for (go = jumps; go; go = go->next) {
+        struct sed_cmd *cmd = go->v->v + go->v_index;
 
-            case '=':
-                printf("%d\n", input_line_number);
-                break;
+        if (!*go->name) {
+            continue;
+        }
 
-            case 'a':
-                while (append.alloc - append.length < cur_cmd->x.cmd_txt.text_len) {
-                    append.alloc *= 2;
-                    append.text = ck_realloc(append.text, append.alloc);
-                }
+        lbl = label_table ? *find_label(go->name) : 0;
+        if (!lbl) {
+            panic("Can't find label for jump to '%s'", go->name);
+        }
 
-                bcopy(cur_cmd->x.cmd_txt.text,append.text + append.length, cur_cmd->x.cmd_txt.text_len);
-                append.length += cur_cmd->x.cmd_txt.text_len;
-                break;
+        cmd->x.jump.target = lbl->v->v + lbl->v_index;
+        cmd->x.jump.v = lbl->v;
+        cmd->x.jump.n = lbl->v->v_length - lbl->v_index;
+    }
 
-            case 'b':
-                if (!cur_cmd->x.jump) {
-                    /* b 未指定跳转位置的话, 是需要跳转到编辑命令程序结束位置的 */
-                    end_cycle++;
-                } else {
-                    struct sed_label *j = cur_cmd->x.jump;
+    program = take_program();
 
-                    n = j->v->v_length - j->v_index;
-                    cur_cmd = j->v->v + j->v_index;
+    /* Without the default output, past the last line any command acts
+       on there is nothing more to do */
+    if (program->no_default_output) {
+        int last = program_last_line(program->vector);
 
-                    goto exe_loop;
-                }
-                break;
+        if (last >= 0) {
+            program->last_line = last > 0 ? last : 1;
+        }
+    } else {
+        program->windowed = program_is_windowed(program->vector);
+    }
 
-            case 'c':
-                line.length = 0;
+    /* --profile wants to see each regex tried on its own */
+    if (!profiling && program->num_regexes >= ADDR_SET_MIN) {
+        struct multisearch *set = multisearch_new();
 
-                /* 能执行到这个地方就说明 a1 已经是匹配的
-                 * 执行 c 命令只会在 a2 位置来执行, 而在 a2 位置, 会清除 A1_MATCHED_BIT 标记位 */
-                int a1_match = cur_cmd->aflags & A1_MATCHED_BIT;
-                if (!a1_match) {
-                    ck_fwrite(cur_cmd->x.cmd_txt.text,1, cur_cmd->x.cmd_txt.text_len, stdout);
-                }
+        if (program_address_set(set, program->vector) >= ADDR_SET_MIN) {
+            multisearch_compile(set);
+            program->addr_set = set;
+        } else {
+            struct sed_regex *regex;
 
-                end_cycle++;
-                break;
+            for (regex = program->regexes; regex; regex = regex->next) {
+                regex->in_set = 0;
+            }
+            multisearch_free(set);
+        }
+    }
 
-            case 'd':
-                line.length = 0;
-                end_cycle++;
-                break;
+    if (!profiling) {
+        fuse_substitutions(program->vector);
+    }
+    return program;
+}
 
-            case 'D': {
-                /* 清理掉模式空间里面的第一行内容, 并对剩余模式空间里面的内容再度执行编辑程序脚本 */
-                char *tmp;
-                int newlength;
+/* Move everything compiled so far, finished or not, into a new program,
+   and start afresh for the next one. */
+struct sed_program *take_program()
+{
+    struct sed_program *program;
+
+    program = (struct sed_program *)ck_malloc(sizeof(struct sed_program));
+    program->vector = the_program ? the_program : new_vector();
+    program->no_default_output = no_default_output;
+    program->last_line = 0;
+    program->windowed = 0;
+    program->num_ranges = num_ranges;
+    program->num_regexes = num_regexes;
+    program->jumps = jumps;
+    program->labels = labels;
+    program->regexes = regexes;
+    program->addr_set = 0;
+    program->files = script_files;
+
+    the_program = 0;
+    no_default_output = 0;
+    num_ranges = num_regexes = 0;
+    jumps = labels = 0;
+    if (label_table) {
+        free(label_table);
+    }
+    label_table = 0;
+    label_table_size = num_labels = 0;
+    regexes = last_regex = 0;
+    script_files = 0;
+    program_depth = 0;
+    return program;
+}
 
-                tmp = eol_pos(line.text, line.length); /* 找到模式空间中第一行的结尾 */
+/* Free the commands in VEC, and VEC itself.  Regexes are left to
+   free_program, as more than one command may use the same one. */
+void free_vector(struct vector *vec)
+{
+    struct sed_cmd *cur_cmd;
 
-                /* 看看模式空间还能剩余什么内容, 单行的话就什么都不剩了, 多行会有数据 */
-                newlength = line.length - (tmp - line.text) - 1;
-                if (newlength) {
-                    chr_copy(line.text, tmp + 1, newlength);
-                    line.length = newlength;
-                    goto restart; /* 删完了重新对模式空间的数据执行编辑程序 */
+    for (cur_cmd = vec->v; cur_cmd < vec->v + vec->v_length; cur_cmd++) {
+        switch (cur_cmd->cmd) {
+            case 'a':
+            case 'i':
+            case 'c':
+                free(cur_cmd->x.cmd_txt.text);
+                break;
+            case 's':
+                if (cur_cmd->x.cmd_regex.replacement) {
+                    /* The first piece's prefix is the start of the text */
+                    free(cur_cmd->x.cmd_regex.replacement[0].prefix);
+                    free(cur_cmd->x.cmd_regex.replacement);
                 }
-
-                line.length = 0;
-                end_cycle++;
-            } break;
-
-            case 'g':
-                /* Replace the contents of the pattern space with the contents of the hold space. */
-                line_copy(&hold, &line);
+                multisearch_free(cur_cmd->x.cmd_regex.fused);
                 break;
-
-            case 'G':
-                /* Append a newline to the contents of the pattern space,
-                 * and then append the contents of the hold space to that of the pattern space. */
-                line_append(&hold, &line);
+            case 'y':
+                free(cur_cmd->x.translate);
                 break;
-
-            case 'h':
-                /* Replace the contents of the hold space with the contents of the pattern space. */
-                line_copy(&line, &hold);
+            case '{':
+                if (cur_cmd->x.sub) {
+                    free_vector(cur_cmd->x.sub);
+                }
                 break;
+        }
+    }
 
-            case 'H':
-                /* Append a newline to the contents of the hold space,
-                 * and then append the contents of the pattern space to that of the hold space. */
-                line_append(&line, &hold);
-                break;
+    free(vec->v);
+    free(vec);
+}
 
-            case 'i':
-                ck_fwrite(cur_cmd->x.cmd_txt.text, 1, cur_cmd->x.cmd_txt.text_len, stdout);
-                break;
+/* Free PROGRAM and everything it holds, closing the files opened by its
+   r and w commands. */
+void free_program(struct sed_program *program)
+{
+    struct sed_label *lbl, *next_lbl;
+    struct sed_regex *regex, *next_regex;
+    int i;
 
-            case 'l': {
-                /* 打印模式空间
-                 * Print the pattern space in an unambiguous form.
-                 * This is useful for debugging and revealing unprintable characters. */
-                char *tmp;
-                int n;
-                int width = 0;
+    free_vector(program->vector);
 
-                n = line.length;
-                tmp = line.text;
-                while (n--) {
-                    /* Skip the trailing newline, if there is one */
-                    if (!n && (*tmp == '\n')) {
-                        break;
-                    }
+    for (i = 0; i < 2; i++) {
+        for (lbl = i ? program->labels : program->jumps; lbl; lbl = next_lbl) {
+            next_lbl = lbl->next;
+            free(lbl->name);
+            free(lbl);
+        }
+    }
 
-                    if (width > 77) {
-                        width = 0;
-                        putchar('\n');
-                    }
+    for (regex = program->regexes; regex; regex = next_regex) {
+        next_regex = regex->next;
+        regfree(&regex->pattern);
+        if (regex->dfa) {
+            re_dfa_free(regex->dfa);
+        }
+        free(regex->literal);
+        free(regex->required);
+        free(regex);
+    }
 
-                    if (*tmp == '\\') {
-                        printf("\\\\");
-                        width += 2;
+    multisearch_free(program->addr_set);
+    close_files(program);
+    free(program);
+}
+
+/* read in a filename for a 'r', 'w', or 's///w' command, and
+   update the internal structure about files.  The file is
+   opened if it isn't already open. */
+FILE * compile_filename(int readit)
+{
+    char *file_name;
+    struct sed_file *f;
+    VOID *b;
+    int ch;
+
+    if (inchar() != ' ') {
+        /* r/w or s///w 指令, 文件名开始之前都要求有一个空格 */
+        bad_prog("missing ' ' before filename");
+    }
+
+    b = init_buffer();
+    while ((ch = inchar()) != EOF && ch != '\n') {
+        add1_buffer(b, ch);
+    }
+
+    add1_buffer(b, '\0');
+    file_name = get_buffer(b);
+    for (f = script_files; f; f = f->next) {
+        if (!strcmp(f->name, file_name)) {
+            if (f->readit != readit) {
+                bad_prog("Can't open file for both reading and writing");
+            }
+
+            flush_buffer(b);
+            return f->phile;
+        }
+    }
+
+    /* 正式打开文件, 将文件句柄保存到 script_files */
+    f = (struct sed_file *)ck_malloc(sizeof(struct sed_file));
+    f->name = ck_strdup(file_name);
+    f->readit = readit;
+    f->phile = 0;
+    f->next = script_files;
+    script_files = f;
+
+    if (!readit) {
+        f->phile = ck_fopen(file_name, "w");
+    } else {
+        f->phile = ck_fopen(file_name, "r");
+    }
+
+    flush_buffer(b);
+    return f->phile;
+}
+
+/* Read a file and apply the compiled script to it.
+ * 请注意本函数只处理一个文件 */
+void read_file(struct sed_context *ctx, char *name)
+{
+    if (*name == '-' && name[1] == '\0') {
+        ctx->input.fd = 0;
+    } else {
+        ctx->input.fd = open(name, O_RDONLY);
+        if (ctx->input.fd < 0) {
+            ctx->bad_input++;
+            fprintf(stderr, "%s: can't read %s: %s\n", myname, name, strerror(errno));
+            return;
+        }
+    }
+
+    if (!ctx->input.buf) {
+        ctx->input.alloc = INPUT_BLOCK_SIZE;
+        ctx->input.buf = ck_malloc(ctx->input.alloc);
+    }
+
+    ctx->input.name = name;
+    ctx->input.cur = ctx->input.lim = ctx->input.buf;
+    ctx->input.eof = 0;
+    ctx->input.map = 0;
+    ctx->input.mapped = 0;
+
+    if (ctx->input.fd != 0 && (!pipelined || files_parallel)) {
+        map_input(ctx);
+    }
+
+    if (in_place && ctx->input.fd != 0 && !edit_start(ctx, name)) {
+        unmap_input(ctx);
+        close(ctx->input.fd);
+        return;
+    }
+
+    if (pipelined && !ctx->input.mapped && !files_parallel) {
+        start_reader(ctx);
+    }
+
+    if (!read_file_parallel(ctx)) {
+        process_input(ctx);
+    }
+
+    if (pipelined) {
+        stop_reader(ctx);
+    }
+
+    if (ctx->edit.name) {
+        edit_finish(ctx);
+    }
+    unmap_input(ctx);
+
+    if (ctx->input.fd != 0 && close(ctx->input.fd) < 0) {
+        panic("Couldn't close %s", name);
+    }
+}
+
+/* Make sure the input file NAME can be opened, as read_file would, but
+ * don't read it. */
+void check_file(struct sed_context *ctx, char *name)
+{
+    int fd;
+
+    if (*name == '-' && name[1] == '\0') {
+        return;
+    }
+
+    fd = open(name, O_RDONLY);
+    if (fd < 0) {
+        ctx->bad_input++;
+        fprintf(stderr, "%s: can't read %s: %s\n", myname, name, strerror(errno));
+        return;
+    }
+    close(fd);
+}
+
+/* Run the script over what's left of the input, a cycle per line. */
+void process_input(struct sed_context *ctx)
+{
+    /* 从文件中读取模式空间, 模式空间会被报错在 line 全局变量里面
+     * 然后用 execute_program 处理模式空间里面的内容 */
+    while (read_pattern_space(ctx)) {
+        if (ctx->line_streamed) {
+            /* Already run through the script and written out */
+            ctx->line_streamed = 0;
+        } else {
+            execute_program(ctx, ctx->program->vector);
+            if (ctx->profile) {
+                profile_enter(ctx, (struct sed_cmd *)0);
+            }
+
+            if (!ctx->no_default_output) {
+                output_write(ctx, ctx->line.text, ctx->line.length);
+            }
+        }
+
+        if (ctx->append.length) {
+            /* 这里, 如果有追加的内容, 打印出来 */
+            output_write(ctx, ctx->append.text, ctx->append.length);
+            ctx->append.length = 0;
+        }
+
+        if (ctx->output.line_buffered) {
+            output_flush(ctx);
+        }
+
+        if (ctx->quit_cmd) {
+            break;
+        }
+
+        /* Nothing more can happen: under -i that's the end of this file,
+           otherwise of all the input */
+        if (ctx->program->last_line && ctx->input_line_number >= ctx->program->last_line
+            && !memchr(ctx->range_open, 1, ctx->program->num_ranges)) {
+            if (!in_place) {
+                ctx->input_done++;
+            }
+            break;
+        }
+    }
+}
+
+/* Get ready to edit NAME, the current input file, in place.  Return 0 if
+ * it can't be. */
+int edit_start(struct sed_context *ctx, char *name)
+{
+    if (fstat(ctx->input.fd, &ctx->edit.st) < 0 || !S_ISREG(ctx->edit.st.st_mode)) {
+        ctx->bad_input++;
+        fprintf(stderr, "%s: couldn't edit %s: not a regular file\n", myname, name);
+        return 0;
+    }
+
+    /* Anything still waiting is for the standard output */
+    output_flush(ctx);
+
+    ctx->edit.name = name;
+    ctx->edit.in_fd = ctx->input.fd;
+    ctx->edit.same = 0;
+    ctx->edit.tmp_name = 0;
+    ctx->edit.out_fd = -1;
+    return 1;
+}
+
+/* How much of the LEN bytes at BUF is the same as what's in the file
+ * being edited, at the place the output has got to? */
+static int edit_compare(struct sed_context *ctx, char *buf, int len)
+{
+    char tmp[8192];
+    int n = 0;
+
+    if (ctx->edit.st.st_size - ctx->edit.same < len) {
+        len = ctx->edit.st.st_size - ctx->edit.same;
+    }
+
+    if (ctx->input.map && ctx->edit.same + len <= ctx->input.map_len) {
+        char *old = ctx->input.map + ctx->edit.same;
+
+        if (!memcmp(buf, old, len)) {
+            return len;
+        }
+        while (buf[n] == old[n]) {
+            n++;
+        }
+        return n;
+    }
+
+    while (n < len) {
+        int want = len - n < sizeof tmp ? len - n : sizeof tmp;
+        int got = pread(ctx->edit.in_fd, tmp, want, ctx->edit.same + n);
+        int i;
+
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (got <= 0) {
+            break;
+        }
+
+        for (i = 0; i < got && buf[n + i] == tmp[i]; i++)
+            ;
+        n += i;
+        if (i < got) {
+            break;
+        }
+    }
+    return n;
+}
+
+/* Copy the first edit.same bytes of the file being edited to the new one. */
+static void edit_copy_same(struct sed_context *ctx)
+{
+    char tmp[8192];
+    off_t off = 0;
+
+#ifdef HAVE_COPY_FILE_RANGE
+    while (off < ctx->edit.same) {
+        ssize_t n = copy_file_range(ctx->edit.in_fd, &off, ctx->edit.out_fd, 0, ctx->edit.same - off, 0);
+
+        if (n <= 0) {
+            /* Not on this system or between these file systems (or the
+               file shrank, which the loop below will find out) */
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            lseek(ctx->edit.out_fd, off, SEEK_SET);
+            break;
+        }
+    }
+#endif
+
+    while (off < ctx->edit.same) {
+        int want = ctx->edit.same - off < sizeof tmp ? ctx->edit.same - off : sizeof tmp;
+        int n = pread(ctx->edit.in_fd, tmp, want, off);
+        char *p = tmp;
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (n <= 0) {
+            panic("Read error on %s: %s", ctx->edit.name, n ? strerror(errno) : "file shrank");
+        }
+
+        off += n;
+        while (n > 0) {
+            int w = write(ctx->edit.out_fd, p, n);
+
+            if (w < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                panic("Couldn't write to %s: %s", ctx->edit.tmp_name, strerror(errno));
+            }
+            p += w;
+            n -= w;
+        }
+    }
+}
+
+/* Make the temporary file, next to the one being edited so that it can
+ * be renamed over it, and give it what was the same. */
+static void edit_open(struct sed_context *ctx)
+{
+    char *slash = strrchr(ctx->edit.name, '/');
+    int dir_len = slash ? slash - ctx->edit.name + 1 : 0;
+
+    ctx->edit.tmp_name = ck_malloc(dir_len + sizeof "sedXXXXXX");
+    memcpy(ctx->edit.tmp_name, ctx->edit.name, dir_len);
+    strcpy(ctx->edit.tmp_name + dir_len, "sedXXXXXX");
+
+    ctx->edit.out_fd = mkstemp(ctx->edit.tmp_name);
+    if (ctx->edit.out_fd < 0) {
+        panic("Couldn't open temporary file %s: %s", ctx->edit.tmp_name, strerror(errno));
+    }
+
+    /* The owner may not be ours to give it; the mode we can */
+    fchown(ctx->edit.out_fd, ctx->edit.st.st_uid, ctx->edit.st.st_gid);
+    fchmod(ctx->edit.out_fd, ctx->edit.st.st_mode & 07777);
+
+    edit_copy_same(ctx);
+}
+
+/* Called by output_all for the output of a file being edited. */
+void edit_write(struct sed_context *ctx, char *buf, int len)
+{
+    if (ctx->edit.out_fd < 0) {
+        int n = edit_compare(ctx, buf, len);
+
+        ctx->edit.same += n;
+        buf += n;
+        len -= n;
+        if (!len) {
+            return;
+        }
+        edit_open(ctx);
+    }
+
+    while (len > 0) {
+        int n = write(ctx->edit.out_fd, buf, len);
+
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            panic("Couldn't write to %s: %s", ctx->edit.tmp_name, strerror(errno));
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+/* The script is done with the file being edited.  Put the new one in its
+ * place (keeping the old one as a backup, if asked to), unless the output
+ * was exactly what was in it and there is no backup to make. */
+void edit_finish(struct sed_context *ctx)
+{
+    char *name = ctx->edit.name;
+
+    output_flush(ctx);
+
+    if (ctx->edit.out_fd < 0) {
+        if (ctx->edit.same == ctx->edit.st.st_size && !*in_place_suffix) {
+            ctx->edit.name = 0;
+            return;
+        }
+
+        /* The output stopped short, and the end of the file is to go, or
+           the backup is to be the old file and NAME a new one */
+        edit_open(ctx);
+    }
+
+    if (close(ctx->edit.out_fd) < 0) {
+        panic("Couldn't close %s: %s", ctx->edit.tmp_name, strerror(errno));
+    }
+    ctx->edit.out_fd = -1;
+
+    if (*in_place_suffix) {
+        char *backup = ck_malloc(strlen(name) + strlen(in_place_suffix) + 1);
+
+        strcpy(backup, name);
+        strcat(backup, in_place_suffix);
+
+        /* With a link, NAME is never missing, even for a moment */
+        unlink(backup);
+        if (link(name, backup) < 0 && rename(name, backup) < 0) {
+            panic("Couldn't make backup %s: %s", backup, strerror(errno));
+        }
+        free(backup);
+    }
+
+    if (rename(ctx->edit.tmp_name, name) < 0) {
+        panic("Couldn't rename %s to %s: %s", ctx->edit.tmp_name, name, strerror(errno));
+    }
+
+    free(ctx->edit.tmp_name);
+    ctx->edit.tmp_name = 0;
+    ctx->edit.name = 0;
+}
+
+/* On the way out with a file half edited: leave it as it was. */
+void edit_abandon(struct sed_context *ctx)
+{
+    ctx->output.length = 0;
+    if (ctx->edit.out_fd >= 0) {
+        close(ctx->edit.out_fd);
+        unlink(ctx->edit.tmp_name);
+    }
+    ctx->edit.name = 0;
+}
+
+/* Can each line's output be worked out from that line alone?  That's so
+ * if the script never looks at line numbers or the last line, has no
+ * ranges (which remember whether they're open), doesn't touch the hold
+ * space or read more input, and doesn't read or write files, whose order
+ * would get mixed up.  VEC is searched, '{' blocks included. */
+int program_is_stateless(struct vector *vec)
+{
+    struct sed_cmd *cmd;
+    int n;
+
+    for (cmd = vec->v, n = vec->v_length; n; cmd++, n--) {
+        if (cmd->a1.addr_type == addr_is_num || cmd->a1.addr_type == addr_is_last || cmd->a2.addr_type != addr_is_null) {
+            return 0;
+        }
+
+        switch (cmd->cmd) {
+            case '{':
+                if (!program_is_stateless(cmd->x.sub)) {
+                    return 0;
+                }
+                break;
+
+            case 's':
+                if (cmd->x.cmd_regex.flags & S_WRITE_BIT) {
+                    return 0;
+                }
+                break;
+
+            case '}':
+            case ':':
+            case 'a':
+            case 'b':
+            case 'c':
+            case 'd':
+            case 'i':
+            case 'l':
+            case 'p':
+            case 'P':
+            case 't':
+            case 'y':
+                break;
+
+            default:
+                return 0;
+        }
+    }
+
+    return 1;
+}
+
+/* Return the last input line on which a command in VEC can do anything,
+ * or -1 if there's no telling: if a command has no address (other than a
+ * '{' whose block can be told), or has '!', or a regex or '$' address.
+ * Anything a command jumps to runs on the jump's line, so that needn't
+ * be looked at, nor what is inside a '{' that has a line number.  A
+ * range counts up to its second line; past that it can only be open if
+ * N jumped over the second line, which process_input checks for. */
+int program_last_line(struct vector *vec)
+{
+    struct sed_cmd *cmd;
+    int last = 0;
+    int line;
+    int n;
+
+    for (cmd = vec->v, n = vec->v_length; n; cmd++, n--) {
+        if (cmd->cmd == ':' || cmd->cmd == '}') {
+            continue;
+        }
+
+        if (cmd->aflags & ADDR_BANG_BIT) {
+            return -1;
+        }
+
+        if (cmd->a1.addr_type == addr_is_null && cmd->cmd == '{') {
+            line = program_last_line(cmd->x.sub);
+        } else if (cmd->a1.addr_type != addr_is_num) {
+            return -1;
+        } else if (cmd->a2.addr_type == addr_is_null) {
+            line = cmd->a1.addr_number;
+        } else if (cmd->a2.addr_type == addr_is_num) {
+            line = cmd->a2.addr_number;
+        } else {
+            return -1;
+        }
+
+        if (line < 0) {
+            return -1;
+        }
+        if (line > last) {
+            last = line;
+        }
+    }
+
+    return last;
+}
+
+/* Can a line be run through the script in VEC in pieces, each written
+ * out as soon as it has been?  That's so if the script is only s
+ * commands whose regex is a plain string, with no '^' or '$', and whose
+ * replacement has nothing but text and '&', and y commands, none of
+ * them with an address or any flag but g or a number. */
+int program_is_windowed(struct vector *vec)
+{
+    struct sed_cmd *cmd;
+    int n;
+
+    if (!vec->v_length) {
+        return 0;
+    }
+
+    for (cmd = vec->v, n = vec->v_length; n; cmd++, n--) {
+        if (cmd->a1.addr_type != addr_is_null || (cmd->aflags & ADDR_BANG_BIT)) {
+            return 0;
+        }
+
+        if (cmd->cmd == 's' ? !subst_is_plain(cmd) : cmd->cmd != 'y') {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/* Is CMD an s command with a regex that is a plain string, with no '^'
+ * or '$', a replacement with nothing but text and '&', and no flag but
+ * g or a number?  Then what it does only depends on where that string
+ * is. */
+int subst_is_plain(struct sed_cmd *cmd)
+{
+    struct sed_regex *regex = cmd->x.cmd_regex.regx;
+    int i;
+
+    if (cmd->cmd != 's' || !regex->literal || regex->anchor_start || regex->anchor_end || (cmd->x.cmd_regex.flags & ~(S_GLOBAL_BIT | S_NUM_BIT))) {
+        return 0;
+    }
+    for (i = 0; i < cmd->x.cmd_regex.replace_pieces; i++) {
+        if (cmd->x.cmd_regex.replacement[i].subst_id > 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Look in VEC, and the blocks in it, for runs of s commands with no
+ * address, each of them plain (see subst_is_plain) with a string that
+ * isn't empty, and fuse them (see fuse_run). */
+void fuse_substitutions(struct vector *vec)
+{
+    struct sed_cmd *cmd, *next;
+    struct sed_cmd *end = vec->v + vec->v_length;
+
+    for (cmd = vec->v; cmd < end; cmd = next) {
+        for (next = cmd; next < end; next++) {
+            if (next->a1.addr_type != addr_is_null || (next->aflags & ADDR_BANG_BIT) || !subst_is_plain(next) || !next->x.cmd_regex.regx->literal_len) {
+                break;
+            }
+        }
+
+        if (next - cmd >= SUBST_SET_MIN) {
+            fuse_run(cmd, next - cmd);
+        } else if (next == cmd) {
+            if (cmd->cmd == '{') {
+                fuse_substitutions(cmd->x.sub);
+            }
+            next++;
+        }
+    }
+}
+
+/* Split the COUNT s commands at RUN into groups whose strings can all
+ * be looked for in the pattern space as it was before any of them was
+ * replaced (see multisearch_groups), and give the first command of each
+ * group of SUBST_SET_MIN or more a multisearch for the group's strings,
+ * with each command's place in the group as its id. */
+void fuse_run(struct sed_cmd *run, int count)
+{
+    char **needle = (char **)ck_malloc(2 * count * sizeof(char *));
+    char **repl = needle + count;
+    int *needle_len = (int *)ck_malloc(2 * count * sizeof(int));
+    int *repl_len = needle_len + count;
+    char *starts = ck_malloc(count + 1);
+    struct line text;
+    int i, j;
+
+    /* The replacements as they'd come out, with '&' filled in */
+    for (i = 0; i < count; i++) {
+        struct sed_cmd *cmd = run + i;
+
+        needle[i] = cmd->x.cmd_regex.regx->literal;
+        needle_len[i] = cmd->x.cmd_regex.regx->literal_len;
+        text.text = 0;
+        text.length = text.alloc = 0;
+        for (j = 0; j < cmd->x.cmd_regex.replace_pieces; j++) {
+            struct replacement *piece = &cmd->x.cmd_regex.replacement[j];
+
+            str_append(&text, piece->prefix, piece->prefix_length);
+            if (!piece->subst_id) {
+                str_append(&text, needle[i], needle_len[i]);
+            }
+        }
+        repl[i] = text.text;
+        repl_len[i] = text.length;
+    }
+
+    multisearch_groups(needle, needle_len, repl, repl_len, count, starts);
+
+    for (i = 0; i < count; i = j) {
+        for (j = i + 1; j < count && !starts[j]; j++) {
+        }
+
+        if (j - i >= SUBST_SET_MIN) {
+            struct multisearch *ms = multisearch_new();
+            int k;
+
+            for (k = i; k < j; k++) {
+                multisearch_add(ms, needle[k], needle_len[k], k - i);
+            }
+            multisearch_compile(ms);
+            run[i].x.cmd_regex.fused = ms;
+            run[i].x.cmd_regex.fused_cmds = j - i;
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        if (repl[i]) {
+            free(repl[i]);
+        }
+    }
+    free(needle);
+    free(needle_len);
+    free(starts);
+}
+
+/* Add to SET the string of each regex address in VEC that has one to
+ * look for: the whole regex if it's a plain string with no '^' or '$',
+ * or else the string any match must contain.  Mark those regexes
+ * in_set, and return how many there are.  An address whose string isn't
+ * in the pattern space can't match, and one that is just a string does
+ * if it is, so one pass of SET over the line answers for all of them,
+ * or leaves only the regexes whose string was there to try. */
+int program_address_set(struct multisearch *set, struct vector *vec)
+{
+    struct sed_cmd *cmd;
+    int count = 0;
+    int n, i;
+
+    for (cmd = vec->v, n = vec->v_length; n; cmd++, n--) {
+        for (i = 0; i < 2; i++) {
+            struct addr *addr = i ? &cmd->a2 : &cmd->a1;
+            struct sed_regex *regex = addr->addr_regex;
+
+            if (addr->addr_type != addr_is_regex || regex->in_set) {
+                continue;
+            }
+
+            if (regex->literal && regex->literal_len && !regex->anchor_start && !regex->anchor_end) {
+                multisearch_add(set, regex->literal, regex->literal_len, regex->id);
+            } else if (regex->required && regex->required_len) {
+                multisearch_add(set, regex->required, regex->required_len, regex->id);
+            } else {
+                continue;
+            }
+            regex->in_set = 1;
+            count++;
+        }
+
+        if (cmd->cmd == '{') {
+            count += program_address_set(set, cmd->x.sub);
+        }
+    }
+
+    return count;
+}
+
+/* Can the files edited in place be run through the script at the same
+ * time?  Each is a stream of its own anyway, so that's so unless the
+ * script reads or writes files, whose contents would get mixed up, or
+ * can quit, which should leave the files after the current one alone. */
+int program_is_file_local(struct vector *vec)
+{
+    struct sed_cmd *cmd;
+    int n;
+
+    for (cmd = vec->v, n = vec->v_length; n; cmd++, n--) {
+        switch (cmd->cmd) {
+            case '{':
+                if (!program_is_file_local(cmd->x.sub)) {
+                    return 0;
+                }
+                break;
+
+            case 's':
+                if (cmd->x.cmd_regex.flags & S_WRITE_BIT) {
+                    return 0;
+                }
+                break;
+
+            case 'q':
+            case 'r':
+            case 'w':
+                return 0;
+        }
+    }
+
+    return 1;
+}
+
+#ifndef NO_THREADS
+/* The job the worker threads share: the mapping of the current input
+ * file, cut into NCHUNKS pieces at line boundaries.  NEXT is the next
+ * piece to be taken, and WRITTEN the number whose output the main thread
+ * has written out.  The output of piece I is left in CHUNKS[I % WINDOW]
+ * until then. */
+struct chunk {
+    char *out;
+    int out_len;
+    int done;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work; /* Signalled when there may be a piece to take */
+    pthread_cond_t done; /* Signalled when a piece is finished */
+    int nthreads;
+    char *map;
+    size_t map_len;
+    int fd;
+    int nchunks;
+    int next;
+    int written;
+    int window;
+    struct chunk *chunks;
+} pool = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+/* Where piece I of the job starts: just after the first newline at or
+ * after I * CHUNK_SIZE - 1, so that it is the same place whoever works
+ * it out. */
+static char *chunk_start(int i)
+{
+    size_t off = (size_t)i * CHUNK_SIZE - 1;
+    char *nl;
+
+    if (i == 0) {
+        return pool.map;
+    }
+    if (i >= pool.nchunks || off >= pool.map_len) {
+        return pool.map + pool.map_len;
+    }
+
+    nl = memchr(pool.map + off, record_sep, pool.map_len - off);
+    return nl ? nl + 1 : pool.map + pool.map_len;
+}
+
+/* Take pieces of the job one at a time, run the script over each with
+ * this thread's own copy of the state, and hand the output back. */
+static void *chunk_worker(void *arg)
+{
+    struct sed_context *ctx;
+
+    ctx = (struct sed_context *)ck_malloc(sizeof(struct sed_context));
+    memset(ctx, 0, sizeof(struct sed_context));
+    context_init(ctx, (struct sed_program *)arg);
+    current_ctx = ctx;
+
+    pthread_mutex_lock(&pool.lock);
+    for (;;) {
+        struct chunk *c;
+        int i;
+
+        while (!(pool.next < pool.nchunks && pool.next - pool.written < pool.window)) {
+            pthread_cond_wait(&pool.work, &pool.lock);
+        }
+        i = pool.next++;
+        pthread_mutex_unlock(&pool.lock);
+
+        ctx->input.fd = pool.fd;
+        ctx->input.map = pool.map;
+        ctx->input.map_len = pool.map_len;
+        ctx->input.mapped = 1;
+        ctx->input.eof = 1;
+        ctx->input.cur = chunk_start(i);
+        ctx->input.lim = chunk_start(i + 1);
+        ctx->output.capture = 1;
+
+        process_input(ctx);
+        line_discard(ctx);
+
+        pthread_mutex_lock(&pool.lock);
+        c = &pool.chunks[i % pool.window];
+        c->out = ctx->output.buf;
+        c->out_len = ctx->output.length;
+        c->done = 1;
+        pthread_cond_broadcast(&pool.done);
+
+        ctx->output.buf = 0;
+        ctx->output.length = ctx->output.alloc = 0;
+    }
+    return arg;
+}
+
+/* If the script allows it and the current input is a big enough mapped
+ * file, run the script over it in pieces in the worker threads, starting
+ * them if need be, and write out their output in order.  Return zero if
+ * the input has been left for process_input. */
+int read_file_parallel(struct sed_context *ctx)
+{
+    int nchunks;
+    int i;
+
+    if (!stateless_program || parallel_threads < 2 || files_parallel || !ctx->input.mapped || ctx->input.map_len < 4 * CHUNK_SIZE || ctx->output.line_buffered) {
+        return 0;
+    }
+
+    nchunks = (int)((ctx->input.map_len + CHUNK_SIZE - 1) / CHUNK_SIZE);
+
+    pthread_mutex_lock(&pool.lock);
+    if (!pool.nthreads) {
+        pool.window = parallel_threads * CHUNK_WINDOW;
+        pool.chunks = (struct chunk *)ck_malloc(pool.window * sizeof(struct chunk));
+        memset(pool.chunks, 0, pool.window * sizeof(struct chunk));
+
+        for (i = 0; i < parallel_threads; i++) {
+            pthread_t tid;
+
+            if (pthread_create(&tid, 0, chunk_worker, ctx->program)) {
+                break;
+            }
+            pthread_detach(tid);
+        }
+
+        pool.nthreads = i;
+        if (!i) {
+            pthread_mutex_unlock(&pool.lock);
+            parallel_threads = 1;
+            return 0;
+        }
+    }
+
+    pool.map = ctx->input.map;
+    pool.map_len = ctx->input.map_len;
+    pool.fd = ctx->input.fd;
+    pool.next = pool.written = 0;
+    pool.nchunks = nchunks;
+    pthread_cond_broadcast(&pool.work);
+
+    for (i = 0; i < nchunks; i++) {
+        struct chunk *c = &pool.chunks[i % pool.window];
+        char *out;
+        int out_len;
+
+        while (!c->done) {
+            pthread_cond_wait(&pool.done, &pool.lock);
+        }
+        out = c->out;
+        out_len = c->out_len;
+        c->done = 0;
+        pool.written++;
+        pthread_cond_broadcast(&pool.work);
+        pthread_mutex_unlock(&pool.lock);
+
+        output_write(ctx, out, out_len);
+        free(out);
+
+        pthread_mutex_lock(&pool.lock);
+    }
+
+    pool.nchunks = pool.next = pool.written = 0;
+    pthread_mutex_unlock(&pool.lock);
+
+    ctx->input.cur = ctx->input.lim;
+    return 1;
+}
+
+/* Wait a little before looking at a ring again: yield for a while, then
+ * sleep, longer once it looks like the other side will be some time. */
+static void ring_backoff(int *spins)
+{
+    struct timespec ts;
+
+    if (++*spins < 64) {
+        sched_yield();
+        return;
+    }
+
+    ts.tv_sec = 0;
+    ts.tv_nsec = *spins < 128 ? 50000 : 1000000;
+    nanosleep(&ts, 0);
+}
+
+/* Producer: wait for a free slot in R, and return its index. */
+static int ring_reserve(struct ring *r, volatile int *stop)
+{
+    int spins = 0;
+
+    while (r->head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == RING_SLOTS) {
+        if (stop && *stop) {
+            return -1;
+        }
+        ring_backoff(&spins);
+    }
+    return r->head % RING_SLOTS;
+}
+
+/* Producer: hand the slot from ring_reserve, holding LEN bytes, over. */
+static void ring_publish(struct ring *r, int len)
+{
+    r->len[r->head % RING_SLOTS] = len;
+    __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+/* Consumer: wait for a filled slot in R, and return its index. */
+static int ring_take(struct ring *r)
+{
+    int spins = 0;
+
+    while (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == r->tail) {
+        ring_backoff(&spins);
+    }
+    return r->tail % RING_SLOTS;
+}
+
+/* Consumer: give the slot from ring_take back to the producer. */
+static void ring_release(struct ring *r)
+{
+    __atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+}
+
+static struct {
+    struct ring in;
+    pthread_t reader;
+    int reader_fd;
+    volatile int reader_stop;
+    int holding;  /* 'input' is looking at a slot of IN */
+
+    struct ring out;
+    pthread_t writer;
+    volatile int writer_errno;
+} pipeline;
+
+/* Read the input file a block at a time into the free slots of the ring.
+ * A slot's length is 0 at end of file, or minus errno after an error. */
+static void *reader_thread(void *arg)
+{
+    struct ring *r = &pipeline.in;
+
+    for (;;) {
+        int i = ring_reserve(r, &pipeline.reader_stop);
+        int n;
+
+        if (i < 0) {
+            break;
+        }
+
+        do {
+            n = read(pipeline.reader_fd, r->buf[i], INPUT_BLOCK_SIZE);
+        } while (n < 0 && errno == EINTR);
+
+        ring_publish(r, n < 0 ? -errno : n);
+        if (n <= 0) {
+            break;
+        }
+    }
+    return arg;
+}
+
+/* Start reading the current input file in the reader thread. */
+void start_reader(struct sed_context *ctx)
+{
+    int i;
+
+    if (!pipeline.in.buf[0]) {
+        for (i = 0; i < RING_SLOTS; i++) {
+            pipeline.in.buf[i] = ck_malloc(INPUT_BLOCK_SIZE);
+        }
+    }
+
+    pipeline.in.head = pipeline.in.tail = 0;
+    pipeline.reader_fd = ctx->input.fd;
+    pipeline.reader_stop = 0;
+    pipeline.holding = 0;
+    if (pthread_create(&pipeline.reader, 0, reader_thread, 0) == 0) {
+        ctx->input.piped = 1;
+    }
+}
+
+/* Stop the reader thread, which may be waiting in read() if the script
+ * quit early. */
+void stop_reader(struct sed_context *ctx)
+{
+    if (!ctx->input.piped) {
+        return;
+    }
+
+    pipeline.reader_stop = 1;
+    pthread_cancel(pipeline.reader);
+    pthread_join(pipeline.reader, 0);
+    ctx->input.piped = 0;
+    ctx->input.cur = ctx->input.lim = ctx->input.buf;
+}
+
+/* fill_input, for when the reader thread is doing the reading: let go of
+ * the block we've finished with and wait for the next one. */
+int fill_from_reader(struct sed_context *ctx)
+{
+    struct ring *r = &pipeline.in;
+    int i;
+    int n;
+
+    if (ctx->input.eof) {
+        return 0;
+    }
+
+    if (pipeline.holding) {
+        ring_release(r);
+        pipeline.holding = 0;
+    }
+
+    i = ring_take(r);
+    n = r->len[i];
+    pipeline.holding = 1;
+
+    if (n < 0) {
+        panic("Read error on %s: %s", ctx->input.name, strerror(-n));
+    }
+
+    if (n == 0) {
+        ctx->input.eof = 1;
+    }
+
+    ctx->input.cur = r->buf[i];
+    ctx->input.lim = r->buf[i] + n;
+    return n;
+}
+
+/* Write out the slots of the output ring as they fill.  A slot of length
+ * -1 means there will be no more.  After an error, the rest of the
+ * output is thrown away, and the main thread reports it. */
+static void *writer_thread(void *arg)
+{
+    struct ring *r = &pipeline.out;
+
+    for (;;) {
+        int i = ring_take(r);
+        char *buf = r->buf[i];
+        int len = r->len[i];
+
+        if (len < 0) {
+            ring_release(r);
+            break;
+        }
+
+        while (len > 0 && !pipeline.writer_errno) {
+            int n = write(1, buf, len);
+
+            if (n < 0) {
+                if (errno != EINTR) {
+                    pipeline.writer_errno = errno;
+                }
+                continue;
+            }
+            buf += n;
+            len -= n;
+        }
+        ring_release(r);
+    }
+    return arg;
+}
+
+/* Send standard output through the writer thread from now on. */
+void start_writer(struct sed_context *ctx)
+{
+    int i;
+
+    for (i = 0; i < RING_SLOTS; i++) {
+        pipeline.out.buf[i] = ck_malloc(OUTPUT_BLOCK_SIZE);
+    }
+
+    if (pthread_create(&pipeline.writer, 0, writer_thread, 0)) {
+        return;
+    }
+
+    ctx->output.piped = 1;
+    ctx->output.buf = pipeline.out.buf[0];
+    ctx->output.alloc = OUTPUT_BLOCK_SIZE;
+    ctx->output.length = 0;
+}
+
+/* output_flush, for when the writer thread is doing the writing: pass it
+ * the buffer and carry on in the next free one. */
+void writer_flush(struct sed_context *ctx)
+{
+    struct ring *r = &pipeline.out;
+
+    if (pipeline.writer_errno) {
+        ctx->output.length = 0;
+        if (!ctx->output.exiting) {
+            /* Don't have output_exit report it again */
+            ctx->output.piped = 0;
+            panic("couldn't write to stdout: %s", strerror(pipeline.writer_errno));
+        }
+        return;
+    }
+
+    if (!ctx->output.length) {
+        return;
+    }
+
+    ring_publish(r, ctx->output.length);
+    ctx->output.buf = r->buf[ring_reserve(r, 0)];
+    ctx->output.length = 0;
+}
+
+/* Pass on the last of the output, and wait for the writer thread to
+ * finish with it. */
+void stop_writer(struct sed_context *ctx)
+{
+    writer_flush(ctx);
+    ring_reserve(&pipeline.out, 0);
+    ring_publish(&pipeline.out, -1);
+    pthread_join(pipeline.writer, 0);
+    ctx->output.piped = 0;
+
+    if (pipeline.writer_errno) {
+        fprintf(stderr, "%s: couldn't write to stdout: %s\n", myname, strerror(pipeline.writer_errno));
+        _exit(4);
+    }
+}
+
+/* -j with -i: the files are edited several at a time, each by a worker
+ * thread with its own pattern space, hold space and so on.  The files
+ * are dealt out to the workers biggest first, into a deque each (a
+ * range of ORDER).  A worker takes files from the front of its own deque
+ * and, once that's empty, steals the back half of the fullest one, so
+ * a few big files and lots of small ones even out.  There is just the
+ * one lock, as it's only taken once per file. */
+static struct {
+    pthread_mutex_t lock;
+    struct sed_context *ctx;
+    char **names;
+    int *order;
+    int lo[MAX_THREADS];
+    int hi[MAX_THREADS];
+    int nworkers;
+    int bad;
+
+    /* Set, with why, once a worker has hit an error; the rest finish
+       the file they are on and stop */
+    int failed;
+    char error[256];
+} files = {PTHREAD_MUTEX_INITIALIZER};
+
+struct file_size {
+    off_t size;
+    int index;
+};
+
+static int bigger_file(const VOID *a, const VOID *b)
+{
+    off_t x = ((struct file_size *)a)->size;
+    off_t y = ((struct file_size *)b)->size;
+
+    return x > y ? -1 : x < y;
+}
+
+/* The index of the next file for worker W, or -1 if there are none left.
+ * Called with files.lock held. */
+static int next_file(int w)
+{
+    if (files.failed) {
+        return -1;
+    }
+
+    if (files.lo[w] == files.hi[w]) {
+        int victim = -1;
+        int most = 0;
+        int v;
+        int mid;
+
+        for (v = 0; v < files.nworkers; v++) {
+            if (files.hi[v] - files.lo[v] > most) {
+                most = files.hi[v] - files.lo[v];
+                victim = v;
+            }
+        }
+
+        if (victim < 0) {
+            return -1;
+        }
+
+        mid = files.lo[victim] + most / 2;
+        files.lo[w] = mid;
+        files.hi[w] = files.hi[victim];
+        files.hi[victim] = mid;
+    }
+
+    return files.order[files.lo[w]++];
+}
+
+static void *file_worker(void *arg)
+{
+    int w = (int)(long)arg;
+    struct sed_context *ctx = files.ctx;
+    struct sed_context worker_ctx;
+    jmp_buf env;
+    jmp_buf *outer = panic_jump;
+    int failed = 0;
+    int i;
+
+    if (w) {
+        ctx = &worker_ctx;
+        memset(ctx, 0, sizeof(struct sed_context));
+        context_init(ctx, files.ctx->program);
+        current_ctx = ctx;
+    }
+
+    /* An error mustn't exit from here, while the other workers are
+       still writing their files: leave this file as it was, and let
+       read_files_parallel report it once they are done */
+    panic_jump = &env;
+    if (setjmp(env)) {
+        failed = 1;
+        if (ctx->edit.name) {
+            edit_abandon(ctx);
+        }
+        pthread_mutex_lock(&files.lock);
+        if (!files.failed) {
+            files.failed = 1;
+            snprintf(files.error, sizeof files.error, "%s", panic_message);
+        }
+        pthread_mutex_unlock(&files.lock);
+    } else {
+        for (;;) {
+            pthread_mutex_lock(&files.lock);
+            i = next_file(w);
+            pthread_mutex_unlock(&files.lock);
+
+            if (i < 0) {
+                break;
+            }
+
+            new_stream(ctx);
+            read_file(ctx, files.names[i]);
+        }
+    }
+    panic_jump = outer;
+
+    if (w) {
+        pthread_mutex_lock(&files.lock);
+        files.bad += ctx->bad_input;
+        pthread_mutex_unlock(&files.lock);
+        current_ctx = 0;
+
+        /* What a failed run left in CTX is of no further use, and
+           we're about to exit anyway */
+        if (!failed) {
+            context_free(ctx);
+        }
+    }
+    return arg;
+}
+
+/* Edit the COUNT files at NAMES in place, with up to parallel_threads
+ * of them on the go at once.  The calling thread is worker 0. */
+void read_files_parallel(struct sed_context *ctx, char **names, int count)
+{
+    struct file_size *sizes;
+    pthread_t tids[MAX_THREADS];
+    int nworkers = parallel_threads < count ? parallel_threads : count;
+    int started;
+    int i;
+
+    sizes = (struct file_size *)ck_malloc(count * sizeof(struct file_size));
+    for (i = 0; i < count; i++) {
+        struct stat st;
+
+        sizes[i].size = stat(names[i], &st) < 0 ? 0 : st.st_size;
+        sizes[i].index = i;
+    }
+    qsort(sizes, count, sizeof(struct file_size), bigger_file);
+
+    /* Deal them out: worker W gets the W'th biggest, the W'th after
+       that, and so on */
+    files.ctx = ctx;
+    files.names = names;
+    files.order = (int *)ck_malloc(count * sizeof(int));
+    files.nworkers = nworkers;
+    for (i = 0; i < nworkers; i++) {
+        int j;
+
+        files.lo[i] = files.hi[i] = i ? files.hi[i - 1] : 0;
+        for (j = i; j < count; j += nworkers) {
+            files.order[files.hi[i]++] = sizes[j].index;
+        }
+    }
+    free(sizes);
+
+    files_parallel = 1;
+    for (started = 1; started < nworkers; started++) {
+        if (pthread_create(&tids[started], 0, file_worker, (VOID *)(long)started)) {
+            break;
+        }
+    }
+
+    /* Files dealt to workers that didn't start get stolen */
+    file_worker(0);
+
+    for (i = 1; i < started; i++) {
+        pthread_join(tids[i], 0);
+    }
+    files_parallel = 0;
+
+    ctx->bad_input += files.bad;
+    free(files.order);
+
+    if (files.failed) {
+        panic("%s", files.error);
+    }
+}
+#else
+void read_files_parallel(struct sed_context *ctx, char **names, int count)
+{
+    while (count--) {
+        new_stream(ctx);
+        read_file(ctx, *names++);
+    }
+}
+
+int read_file_parallel(struct sed_context *ctx) { return 0; }
+void start_reader(struct sed_context *ctx) {}
+void stop_reader(struct sed_context *ctx) {}
+int fill_from_reader(struct sed_context *ctx) { return 0; }
+void start_writer(struct sed_context *ctx) {}
+void writer_flush(struct sed_context *ctx) {}
+void stop_writer(struct sed_context *ctx) {}
+#endif /* NO_THREADS */
+
+#ifndef NO_MMAP
+/* Set by input_sigbus when a mapped input file has been truncated
+   under us.  The signal goes to the thread that touched the mapping. */
+static THREAD_LOCAL volatile sig_atomic_t input_truncated = 0;
+
+/* The SIGBUS handler there was before input_sigbus, and the page size,
+   both set once, before any fault can need them */
+static struct sigaction old_sigbus;
+static long input_page;
+
+/* Pass a fault that isn't in one of our mappings on to the handler
+   there was before.  If that was the default, put it back, and the
+   faulting access will get it when it is retried. */
+static void sigbus_pass(int sig, siginfo_t *info, void *uctx)
+{
+    if (old_sigbus.sa_flags & SA_SIGINFO) {
+        old_sigbus.sa_sigaction(sig, info, uctx);
+    } else if (old_sigbus.sa_handler == SIG_DFL || old_sigbus.sa_handler == SIG_IGN) {
+        struct sigaction dfl;
+
+        memset(&dfl, 0, sizeof dfl);
+        dfl.sa_handler = SIG_DFL;
+        sigemptyset(&dfl.sa_mask);
+        sigaction(sig, &dfl, 0);
+    } else {
+        old_sigbus.sa_handler(sig);
+    }
+}
+
+/* Touching a page of the mapping that is now past the end of the file
+   raises SIGBUS.  Put a page of zeros there so the faulting access can
+   finish, and leave a note for read_pattern_space to stop using the
+   mapping.  Faults anywhere else go to sigbus_pass. */
+static void input_sigbus(int sig, siginfo_t *info, void *uctx)
+{
+    struct input_buffer *input = current_ctx ? &current_ctx->input : 0;
+    char *addr = (char *)info->si_addr;
+
+    if (!input || !input->map || addr < input->map || addr >= input->map + input->map_len) {
+        sigbus_pass(sig, info, uctx);
+        return;
+    }
+
+    addr = input->map + ((addr - input->map) & ~(input_page - 1));
+    if (mmap(addr, input_page, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) {
+        sigbus_pass(sig, info, uctx);
+        return;
+    }
+
+    input_truncated = 1;
+}
+
+/* Install input_sigbus for the whole process, keeping the handler it
+   replaces.  Done once, by whichever thread maps a file first. */
+static void sigbus_install(void)
+{
+    struct sigaction sa;
+
+    input_page = sysconf(_SC_PAGESIZE);
+    memset(&sa, 0, sizeof sa);
+    sa.sa_sigaction = input_sigbus;
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGBUS, &sa, &old_sigbus);
+}
+
+#ifndef NO_THREADS
+static pthread_once_t sigbus_once = PTHREAD_ONCE_INIT;
+#endif
+
+/* If the current input is a non-empty regular file, map it and use the
+   mapping as the input block.  Otherwise leave things set up for read(). */
+void map_input(struct sed_context *ctx) {
+#ifdef NO_THREADS
+    static int handler_installed = 0;
+#endif
+    struct stat st;
+    VOID *map;
+
+    if (fstat(ctx->input.fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size <= 0 || st.st_size != (size_t)st.st_size) {
+        return;
+    }
+
+    map = mmap(0, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, ctx->input.fd, 0);
+    if (map == MAP_FAILED) {
+        return;
+    }
+
+#ifdef MADV_SEQUENTIAL
+    madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+#endif
+
+#ifndef NO_THREADS
+    pthread_once(&sigbus_once, sigbus_install);
+#else
+    if (!handler_installed) {
+        sigbus_install();
+        handler_installed = 1;
+    }
+#endif
+
+    input_truncated = 0;
+    ctx->input.map = (char *)map;
+    ctx->input.map_len = (size_t)st.st_size;
+    ctx->input.mapped = 1;
+    ctx->input.cur = ctx->input.map;
+    ctx->input.lim = ctx->input.map + ctx->input.map_len;
+}
+
+/* Stop reading from the mapping and carry on with read() from OFFSET. */
+static void leave_map(struct sed_context *ctx, off_t offset)
+{
+    ctx->input.mapped = 0;
+    ctx->input.cur = ctx->input.lim = ctx->input.buf;
+    if (lseek(ctx->input.fd, offset, SEEK_SET) < 0) {
+        panic("Couldn't seek on %s: %s", ctx->input.name, strerror(errno));
+    }
+}
+
+/* The file shrank while we were reading it through the mapping.  Don't
+   read past the new end of file, and don't hand the script the zeros that
+   stand in for the lost tail. */
+static void input_truncated_check(struct sed_context *ctx)
+{
+    struct stat st;
+    char *end;
+
+    input_truncated = 0;
+    if (!ctx->input.mapped || fstat(ctx->input.fd, &st) < 0 || st.st_size >= ctx->input.map_len) {
+        return;
+    }
+
+    end = ctx->input.map + st.st_size;
+    if (ctx->input.lim > end) {
+        ctx->input.lim = end < ctx->input.cur ? ctx->input.cur : end;
+    }
+
+    if (ctx->line_mapped && ctx->line.text + ctx->line.length > end) {
+        ctx->line.length = ctx->line.text < end ? end - ctx->line.text : 0;
+    }
+}
+
+/* Release the current input file's mapping, if there is one.  The pattern
+   space may still be looking at it, so that is let go of first. */
+void unmap_input(struct sed_context *ctx) {
+    if (!ctx->input.map) {
+        return;
+    }
+
+    line_discard(ctx);
+    munmap(ctx->input.map, ctx->input.map_len);
+    ctx->input.map = 0;
+    ctx->input.mapped = 0;
+}
+#else
+void map_input(struct sed_context *ctx) {}
+void unmap_input(struct sed_context *ctx) {}
+#endif /* NO_MMAP */
+
+/* Give the pattern space a private copy of a mapped view so that it can
+   be modified. */
+void line_unshare(struct sed_context *ctx) {
+    struct line view;
+
+    if (!ctx->line_mapped) {
+        return;
+    }
+
+    view = ctx->line;
+    line_discard(ctx);
+    str_append(&ctx->line, view.text, view.length);
+}
+
+/* Drop a mapped view of the pattern space without copying it, for when
+   the contents are about to be replaced anyway. */
+void line_discard(struct sed_context *ctx) {
+    if (!ctx->line_mapped) {
+        return;
+    }
+
+    ctx->line = ctx->line_store;
+    ctx->line.length = 0;
+    ctx->line_mapped = 0;
+}
+
+/* Return the end of the first line in the LEN bytes at STR: the first
+   record separator, or the last byte if there isn't one. */
+static char *eol_pos(char *str, int len)
+{
+    while (len--) {
+        if (*str++ == record_sep) {
+            return --str;
+        }
+    }
+
+    return --str;
+}
+
+static void chr_copy(char *dest, char *src, int len)
+{
+    while (len--) {
+        *dest++ = *src++;
+    }
+}
+
+/* Execute the program 'vec' on the current input line. */
+void execute_program(struct sed_context *ctx, struct vector *vec)
+{
+    struct sed_cmd *cur_cmd;
+    int n;
+    int addr_matched;
+    int start;
+    int offset;
+    struct line t;
+
+    int count;
+    struct vector *restart_vec = vec;
+
+restart:
+    vec = restart_vec;
+    count = 0;
+
+    ctx->end_cycle = 0;
+
+    for (cur_cmd = vec->v, n = vec->v_length; n; cur_cmd++, n--) {
+    exe_loop:
+        if (ctx->profile) {
+            profile_enter(ctx, cur_cmd);
+        }
+
+        addr_matched = 0;
+        if (ctx->range_open[cur_cmd->range_id]) {
+            /* 进入这个分支即, 之前 a1 已经匹配了, 现在尝试找匹配的 a2.
+             * a1 ~ a2 之间的行, 都会被认为是符合地址要求的 */
+            addr_matched = 1;
+            if (match_address(ctx, &(cur_cmd->a2))) {
+                /* a2 是结束地址, 这时候撤销标记位, 下次循环编辑程序就不生效了 */
+                ctx->range_open[cur_cmd->range_id] = 0;
+            }
+        } else if (match_address(ctx, &(cur_cmd->a1))) {
+            addr_matched = 1;
+            if (cur_cmd->a2.addr_type != addr_is_null) {
+                if ((cur_cmd->a2.addr_type == addr_is_regex) || !match_address(ctx, &(cur_cmd->a2))) {
+                    /* 如果 a2 是正则表达式, 或者当前不符合 a2 地址的时候.
+                     * 置标记位, 下次编辑循环就可以进到上面那个分支 */
+                    ctx->range_open[cur_cmd->range_id] = 1;
+                }
+            }
+        }
+
+        if (ctx->profile && cur_cmd->a1.addr_type != addr_is_null) {
+            ctx->profile[cur_cmd->range_id].evals++;
+            ctx->profile[cur_cmd->range_id].hits += addr_matched;
+        }
+
+        if (cur_cmd->aflags & ADDR_BANG_BIT) {
+            /* 这就是感叹号命令的实现, 对地址范围效果取反 */
+            addr_matched = !addr_matched;
+        }
+
+        if (!addr_matched) {
+            /* 如果未能匹配到地址, 则说明命令不适用于当前编辑位置, 略过即可 */
+            continue;
+        }
+
+        if (ctx->profile) {
+            ctx->profile[cur_cmd->range_id].runs++;
+        }
+
+        /* What the address set found holds only until the pattern space
+           changes, which any command but these might do */
+        if (ctx->addr_found_valid && !strchr("{}:=abhHilpPqrtw", cur_cmd->cmd)) {
+            ctx->addr_found_valid = 0;
+        }
+
+        switch (cur_cmd->cmd) {
+            case '{': /* Execute sub-program */
+                if (cur_cmd->x.sub->v_length) {
+                    vec = cur_cmd->x.sub;
+                    cur_cmd = vec->v;
+                    n = vec->v_length;
+                    goto exe_loop;
+                }
+                break;
+
+            case '}':
+                cur_cmd = vec->return_v->v + vec->return_i;
+                n = vec->return_v->v_length - vec->return_i;
+                vec = vec->return_v;
+                break;
+
+            case ':': /* Executing labels is easy. */
+                break;
+
+            case '=': {
+                char num[32];
+
+                sprintf(num, "%d\n", ctx->input_line_number);
+                output_write(ctx, num, strlen(num));
+            } break;
+
+            case 'a':
+                str_append(&ctx->append, cur_cmd->x.cmd_txt.text, cur_cmd->x.cmd_txt.text_len);
+                break;
+
+            case 'b':
+                if (!cur_cmd->x.jump.target) {
+                    /* b 未指定跳转位置的话, 是需要跳转到编辑命令程序结束位置的 */
+                    ctx->end_cycle++;
+                } else {
+                    vec = cur_cmd->x.jump.v;
+                    n = cur_cmd->x.jump.n;
+                    cur_cmd = cur_cmd->x.jump.target;
+
+                    goto exe_loop;
+                }
+                break;
+
+            case 'c':
+                ctx->line.length = 0;
+
+                /* 能执行到这个地方就说明 a1 已经是匹配的
+                 * 执行 c 命令只会在 a2 位置来执行, 而在 a2 位置, 会清除 range_open 标记 */
+                int a1_match = ctx->range_open[cur_cmd->range_id];
+                if (!a1_match) {
+                    output_write(ctx, cur_cmd->x.cmd_txt.text, cur_cmd->x.cmd_txt.text_len);
+                }
+
+                ctx->end_cycle++;
+                break;
+
+            case 'd':
+                ctx->line.length = 0;
+                ctx->end_cycle++;
+                break;
+
+            case 'D': {
+                /* 清理掉模式空间里面的第一行内容, 并对剩余模式空间里面的内容再度执行编辑程序脚本 */
+                char *tmp;
+                int newlength;
+
+                tmp = eol_pos(ctx->line.text, ctx->line.length); /* 找到模式空间中第一行的结尾 */
+
+                /* 看看模式空间还能剩余什么内容, 单行的话就什么都不剩了, 多行会有数据 */
+                newlength = ctx->line.length - (tmp - ctx->line.text) - 1;
+                if (newlength) {
+                    if (ctx->line_mapped) {
+                        /* A view into the input can just move forward */
+                        ctx->line.text = tmp + 1;
+                    } else {
+                        chr_copy(ctx->line.text, tmp + 1, newlength);
+                    }
+                    ctx->line.length = newlength;
+                    goto restart; /* 删完了重新对模式空间的数据执行编辑程序 */
+                }
+
+                ctx->line.length = 0;
+                ctx->end_cycle++;
+            } break;
+
+            case 'g':
+                /* Replace the contents of the pattern space with the contents of the hold space. */
+                line_discard(ctx);
+                line_copy(&ctx->hold, &ctx->line);
+                break;
+
+            case 'G':
+                /* Append a newline to the contents of the pattern space,
+                 * and then append the contents of the hold space to that of the pattern space. */
+                line_unshare(ctx);
+                line_append(&ctx->hold, &ctx->line);
+                break;
+
+            case 'h':
+                /* Replace the contents of the hold space with the contents of the pattern space. */
+                line_copy(&ctx->line, &ctx->hold);
+                break;
+
+            case 'H':
+                /* Append a newline to the contents of the hold space,
+                 * and then append the contents of the pattern space to that of the hold space. */
+                line_append(&ctx->line, &ctx->hold);
+                break;
+
+            case 'i':
+                output_write(ctx, cur_cmd->x.cmd_txt.text, cur_cmd->x.cmd_txt.text_len);
+                break;
+
+            case 'l': {
+                /* 打印模式空间
+                 * Print the pattern space in an unambiguous form.
+                 * This is useful for debugging and revealing unprintable characters.
+                 * 转义后的内容先放在 obuf 里面, 攒够了再一起输出 */
+                char obuf[512];
+                char *o = obuf;
+                char *tmp;
+                int n;
+                int width = 0;
+
+                n = ctx->line.length;
+                tmp = ctx->line.text;
+                while (n--) {
+                    /* Skip the trailing newline, if there is one */
+                    if (!n && (*tmp == record_sep)) {
+                        break;
+                    }
+
+                    /* 每个字符最多输出 5 个字节 */
+                    if (o - obuf > (int)sizeof(obuf) - 5) {
+                        output_write(ctx, obuf, o - obuf);
+                        o = obuf;
+                    }
+
+                    if (width > 77) {
+                        width = 0;
+                        *o++ = '\n';
+                    }
+
+                    if (*tmp == '\\') {
+                        *o++ = '\\';
+                        *o++ = '\\';
+                        width += 2;
                     } else if (isprint(*tmp)) {
-                        putchar(*tmp);
+                        *o++ = *tmp;
                         width++;
                     } else {
+                        *o++ = '\\';
                         switch (*tmp) {
 #if 0
                             /* Should print \00 instead of \0 because (a) POSIX */
                             /* requires it, and (b) this way \01 is unambiguous.  */
                           case '\0':
-                            printf ("\\0");
-                            width += 2;
+                            *o++ = '0';
                             break;
 #endif
                             case 007:
-                                printf("\\a");
-                                width += 2;
+                                *o++ = 'a';
                                 break;
                             case '\b':
-                                printf("\\b");
-                                width += 2;
+                                *o++ = 'b';
                                 break;
                             case '\f':
-                                printf("\\f");
-                                width += 2;
+                                *o++ = 'f';
                                 break;
                             case '\n':
-                                printf("\\n");
-                                width += 2;
+                                *o++ = 'n';
                                 break;
                             case '\r':
-                                printf("\\r");
-                                width += 2;
+                                *o++ = 'r';
                                 break;
                             case '\t':
-                                printf("\\t");
-                                width += 2;
+                                *o++ = 't';
                                 break;
                             case '\v':
-                                printf("\\v");
-                                width += 2;
+                                *o++ = 'v';
                                 break;
                             default:
-                                printf("\\%02x", (*tmp) & 0xFF);
-                                width += 2;
+                                *o++ = "0123456789abcdef"[(*tmp >> 4) & 0xF];
+                                *o++ = "0123456789abcdef"[*tmp & 0xF];
                                 break;
                         }
+                        width += 2;
                     }
 
                     tmp++;
                 }
-                putchar('\n');
+                *o++ = '\n';
+                output_write(ctx, obuf, o - obuf);
+            } break;
+
+            case 'n':
+                /* If auto-print is not disabled, print the pattern space,
+                 * then, regardless, replace the pattern space with the next line of input.
+                 *
+                 * If there is no more input then sed exits without processing any more commands. */
+                if (input_exhausted(ctx)) {
+                    goto quit;
+                }
+
+                if (!ctx->no_default_output) {
+                    output_write(ctx, ctx->line.text, ctx->line.length);
+                }
+
+                read_pattern_space(ctx);
+                break;
+
+            case 'N':
+                if (input_exhausted(ctx)) {
+                    ctx->line.length = 0;
+                    goto quit;
+                }
+
+                append_pattern_space(ctx);
+                break;
+
+            case 'p':
+                output_write(ctx, ctx->line.text, ctx->line.length);
+                break;
+
+            case 'P': {
+                /* Print the pattern space, up to the first newline. */
+                char *tmp = eol_pos(ctx->line.text, ctx->line.length);
+                int xtmp = tmp ? tmp - ctx->line.text + 1 : ctx->line.length;
+                output_write(ctx, ctx->line.text, xtmp);
+            } break;
+
+            case 'q':
+                /* Exit sed without processing any more commands or input. */
+            quit:
+                /* Under -i, running out of a file's lines only ends that
+                   file's stream */
+                if (!in_place || cur_cmd->cmd == 'q') {
+                    ctx->quit_cmd++;
+                }
+                ctx->end_cycle++;
+                break;
+
+            case 'r': {
+                /* 从文件中读取内容, 并追加到 append */
+                int n = 0;
+
+                if (cur_cmd->x.io_file) {
+                    rewind(cur_cmd->x.io_file);
+                    do {
+                        ctx->append.length += n;
+                        if (ctx->append.length == ctx->append.alloc) {
+                            ctx->append.alloc *= 2;
+                            ctx->append.text = ck_realloc(ctx->append.text, ctx->append.alloc);
+                        }
+                        n = (int) fread(ctx->append.text + ctx->append.length, sizeof(char),ctx->append.alloc - ctx->append.length, cur_cmd->x.io_file);
+                    } while (n > 0);
+
+                    if (ferror(cur_cmd->x.io_file)) {
+                        panic("Read error on input file to 'r' command");
+                    }
+                }
+            } break;
+
+            case 's': {
+                int trail_nl_p, length;
+
+                if (cur_cmd->x.cmd_regex.fused) {
+                    substitute_fused(ctx, cur_cmd);
+                    n -= cur_cmd->x.cmd_regex.fused_cmds - 1;
+                    cur_cmd += cur_cmd->x.cmd_regex.fused_cmds - 1;
+                    break;
+                }
+
+                /* 替换操作不会模式空间里面包含最末尾的换行符号 */
+                trail_nl_p = ctx->line.length && ctx->line.text[ctx->line.length - 1] == record_sep;
+                length = ctx->line.length - trail_nl_p;
+
+                count = 0; /* 记录匹配次数 */
+                start = 0;
+                ctx->subst.length = 0;
+
+                /* 大多数情况下, 结果和原来的模式空间差不多长 */
+                str_reserve(&ctx->subst, ctx->line.length + cur_cmd->x.cmd_regex.replace_fixed);
+
+                while ((offset = count_match(ctx, cur_cmd->x.cmd_regex.regx, ctx->line.text, length, start, &ctx->regs)) >= 0) {
+                    count++;
+
+                    /* offset 是匹配到的开始位置
+                     * regs.end[0] 是匹配到的最末位置 + 1 */
+                    if (offset - start) {
+                        /* 这是不需要替换处理的部分 */
+                        str_append(&ctx->subst, ctx->line.text + start, offset - start);
+                    }
+
+                    if (cur_cmd->x.cmd_regex.flags & S_NUM_BIT) {
+                        /* 正则表达式设置了替换位置的情况, 执行下面的 if 块, 并跳转到下次继续执行
+                         * 实际上就是把不符合替换条件的数据, 拷贝到 tmp 里面, 然后设置新的搜索目标, 执行搜索 */
+                        if (count != cur_cmd->x.cmd_regex.numb) {
+                            int matched = ctx->regs.end[0] - ctx->regs.start[0]; /* 这是说正则表达式匹配到的长度吗? */
+                            if (!matched) {
+                                if (offset == length) {
+                                    /* 行尾的空匹配, 后面没有东西了 */
+                                    start = length;
+                                    break;
+                                }
+                                matched = 1;
+                            }
+                            str_append(&ctx->subst, ctx->line.text + ctx->regs.start[0], matched);
+                            start = ctx->regs.start[0] + matched;
+                            continue;
+                        }
+                    }
+
+                    /* 比方说正则表达式是: s/aaa/XXX&YYY/, 把 XXX, aaa, YYY 依次追加到 tmp 里面 */
+                    append_replacement(&ctx->subst, cur_cmd, ctx->line.text, &ctx->regs);
+
+                    /* 正则表达式里面有空组就回出现满足 if 条件的场景
+                     * TODO: 还有什么场景? */
+                    if (offset == ctx->regs.end[0]) {
+                        if (offset == length) {
+                            /* 行尾的空匹配, 后面没有字符可以拷贝了 */
+                            start = length;
+                            break;
+                        }
+
+                        /* 拷贝走一个字符, 再继续处理剩余部分.
+                         * 不做这个拷贝就死循环了, 会一直能满足匹配 */
+                        str_append(&ctx->subst, ctx->line.text + offset, 1);
+                        ++ctx->regs.end[0]; /*  */
+                    }
+
+                    start = ctx->regs.end[0];
+
+                    if (!(cur_cmd->x.cmd_regex.flags & S_GLOBAL_BIT)) {
+                        break;
+                    }
+                }
+
+                /* 未执行任何替换的场景 */
+                if (!count) {
+                    break;
+                }
+
+                /* 下面是执行了替换的场景, 要更新临时存储内容到模式空间中 */
+                ctx->replaced = 1;
+                str_append(&ctx->subst, ctx->line.text + start, length - start + trail_nl_p);
+
+                /* The result is all in tmp, so a mapped view needn't be copied */
+                line_discard(ctx);
+                t.text = ctx->line.text;
+                t.length = ctx->line.length;
+                t.alloc = ctx->line.alloc;
+                ctx->line.text = ctx->subst.text;
+                ctx->line.length = ctx->subst.length;
+                ctx->line.alloc = ctx->subst.alloc;
+                ctx->subst.text = t.text;
+                ctx->subst.length = t.length;
+                ctx->subst.alloc = t.alloc;
+
+                if ((cur_cmd->x.cmd_regex.flags & S_WRITE_BIT) && cur_cmd->x.cmd_regex.wio_file) {
+                    ck_fwrite(ctx->line.text, 1, ctx->line.length, cur_cmd->x.cmd_regex.wio_file);
+                }
+
+                if (cur_cmd->x.cmd_regex.flags & S_PRINT_BIT) {
+                    output_write(ctx, ctx->line.text, ctx->line.length);
+                }
+
+                break;
+            }
+
+            case 't':
+                /* replaced 在替换命令完成之后会被设置
+                 * t 命令的含义是 test 指令, test 的条件就是是否发生了替换 */
+                if (ctx->replaced) {
+                    ctx->replaced = 0;
+                    if (!cur_cmd->x.jump.target)
+                        ctx->end_cycle++;
+                    else {
+                        vec = cur_cmd->x.jump.v;
+                        n = cur_cmd->x.jump.n;
+                        cur_cmd = cur_cmd->x.jump.target;
+                        goto exe_loop;
+                    }
+                }
+                break;
+
+
+            case 'w':
+                /* 将模式空间里面的内容输出到文件中 */
+                if (cur_cmd->x.io_file) {
+                    ck_fwrite(ctx->line.text, 1, ctx->line.length, cur_cmd->x.io_file);
+                }
+                break;
+
+            case 'x': {
+                /* 交换模式空间和持有空间的内容 */
+                struct line tmp;
+
+                line_unshare(ctx);
+                tmp = ctx->line;
+                ctx->line = ctx->hold;
+                ctx->hold = tmp;
             } break;
 
-            case 'n':
-                /* If auto-print is not disabled, print the pattern space,
-                 * then, regardless, replace the pattern space with the next line of input.
-                 *
-                 * If there is no more input then sed exits without processing any more commands. */
-                if (feof(input_file)) {
-                    goto quit;
-                }
+            case 'y': {
+                unsigned char *p, *e;
 
-                if (!no_default_output) {
-                    ck_fwrite(line.text, 1, line.length, stdout);
+                line_unshare(ctx);
+                for (p = (unsigned char *)(ctx->line.text), e = p + ctx->line.length; p < e; p++) {
+                    *p = cur_cmd->x.translate[*p];
                 }
+            } break;
 
-                read_pattern_space();
-                break;
+            default:
+                panic("INTERNAL ERROR: Bad cmd %c", cur_cmd->cmd);
+        }
 
-            case 'N':
-                if (feof(input_file)) {
-                    line.length = 0;
-                    goto quit;
+        if (ctx->end_cycle) {
+            break;
+        }
+    }
+}
+
+/* Return non-zero if the current line matches the address
+   pointed to by 'addr'. */
+int match_address(struct sed_context *ctx, struct addr *addr)
+{
+    switch (addr->addr_type) {
+        case addr_is_null:
+            return 1;
+
+        case addr_is_num:
+            return (ctx->input_line_number == addr->addr_number);
+
+        case addr_is_regex: {
+            struct sed_regex *regex = addr->addr_regex;
+            int trail_nl_p = ctx->line.length && ctx->line.text[ctx->line.length - 1] == record_sep;
+            int match;
+
+            if (regex->in_set) {
+                if (!ctx->addr_found_valid) {
+                    memset(ctx->addr_found, 0, ADDR_FOUND_WORDS(ctx->program) * sizeof(unsigned long));
+                    multisearch_mark(ctx->program->addr_set, ctx->line.text, ctx->line.length - trail_nl_p, ctx->addr_found);
+                    ctx->addr_found_valid = 1;
                 }
+                if (!(ctx->addr_found[regex->id / LONG_BITS] & (1UL << regex->id % LONG_BITS))) {
+                    return 0;
+                }
+                if (regex->literal) {
+                    return 1;
+                }
+            }
 
-                append_pattern_space();
-                break;
+            match = count_match(ctx, regex, ctx->line.text, ctx->line.length - trail_nl_p, 0, (struct re_registers *)0);
+            return (match >= 0) ? 1 : 0;
+        }
 
-            case 'p':
-                ck_fwrite(line.text, 1, line.length, stdout);
-                break;
+        case addr_is_last:
+            return (ctx->input_EOF) ? 1 : 0;
 
-            case 'P': {
-                /* Print the pattern space, up to the first newline. */
-                char *tmp = eol_pos(line.text, line.length);
-                int xtmp = tmp ? tmp - line.text + 1 : line.length;
-                ck_fwrite(line.text, 1, xtmp, stdout);
-            } break;
+        default:
+            panic("INTERNAL ERROR: bad address type");
+            break;
+    }
 
-            case 'q':
-                /* Exit sed without processing any more commands or input. */
-            quit:
-                quit_cmd++;
-                end_cycle++;
-                break;
+    return -1;
+}
 
-            case 'r': {
-                /* 从文件中读取内容, 并追加到 append */
-                int n = 0;
+/* Refill the input block from the current input file.
+ * Return zero if there is nothing more to read. */
+int fill_input(struct sed_context *ctx) {
+    int n;
 
-                if (cur_cmd->x.io_file) {
-                    rewind(cur_cmd->x.io_file);
-                    do {
-                        append.length += n;
-                        if (append.length == append.alloc) {
-                            append.alloc *= 2;
-                            append.text = ck_realloc(append.text, append.alloc);
-                        }
-                        n = (int) fread(append.text + append.length, sizeof(char),append.alloc - append.length, cur_cmd->x.io_file);
-                    } while (n > 0);
+#ifndef NO_THREADS
+    if (ctx->input.piped) {
+        return fill_from_reader(ctx);
+    }
+#endif
 
-                    if (ferror(cur_cmd->x.io_file)) {
-                        panic("Read error on input file to 'r' command");
+    if (ctx->input.mapped) {
+        /* A caller's buffer (see sed_run_buffer) is all there is */
+        if (ctx->input.eof) {
+            return 0;
+        }
+#ifndef NO_MMAP
+        leave_map(ctx, (off_t)ctx->input.map_len);
+#endif
+    }
+
+    if (ctx->input.eof) {
+        return 0;
+    }
+
+    if (ctx->input.source) {
+        n = (int)ctx->input.source(ctx->input.source_arg, ctx->input.buf, ctx->input.alloc);
+        if (n < 0) {
+            panic("Read error on %s", ctx->input.name);
+        }
+    } else {
+        do {
+            n = read(ctx->input.fd, ctx->input.buf, ctx->input.alloc);
+        } while (n < 0 && errno == EINTR);
+
+        if (n < 0) {
+            panic("Read error on %s: %s", ctx->input.name, strerror(errno));
+        }
+    }
+
+    if (n == 0) {
+        ctx->input.eof = 1;
+    }
+
+    ctx->input.cur = ctx->input.buf;
+    ctx->input.lim = ctx->input.buf + n;
+    return n;
+}
+
+/* Return non-zero if every byte of the current input file has been
+ * consumed.  The block is only refilled once it has been used up, so
+ * this costs a read() per block rather than a peek per line. */
+int input_exhausted(struct sed_context *ctx) {
+    return ctx->input.cur == ctx->input.lim && !fill_input(ctx);
+}
+
+/* Append the next line of input, including its newline if it has one,
+ * to the pattern space.  Return zero if there was no input left. */
+int read_input_line(struct sed_context *ctx) {
+    char *nl;
+    int got = 0;
+
+    for (;;) {
+        if (input_exhausted(ctx)) {
+            return got;
+        }
+
+        nl = memchr(ctx->input.cur, record_sep, ctx->input.lim - ctx->input.cur);
+#ifndef NO_MMAP
+        if (input_truncated) {
+            input_truncated_check(ctx);
+            continue;
+        }
+#endif
+        if (max_line_bytes && ctx->line.length + ((nl ? nl : ctx->input.lim) - ctx->input.cur) > max_line_bytes) {
+            return stream_line(ctx);
+        }
+
+        if (nl && ctx->input.mapped && (ctx->line_mapped ? ctx->line.text + ctx->line.length == ctx->input.cur : !ctx->line.length)) {
+            /* The line is all in the mapping, right after whatever is
+               already in the pattern space: just look at it there. */
+            if (!ctx->line_mapped) {
+                ctx->line_store = ctx->line;
+                ctx->line.text = ctx->input.cur;
+                ctx->line_mapped = 1;
+            }
+
+            ctx->line.length += nl + 1 - ctx->input.cur;
+            ctx->input.cur = nl + 1;
+            return 1;
+        }
+
+        line_unshare(ctx);
+        if (nl) {
+            str_append(&ctx->line, ctx->input.cur, nl + 1 - ctx->input.cur);
+            ctx->input.cur = nl + 1;
+            return 1;
+        }
+
+        /* 行跨越了块边界, 先把已读到的部分追加到模式空间 */
+        str_append(&ctx->line, ctx->input.cur, ctx->input.lim - ctx->input.cur);
+        ctx->input.cur = ctx->input.lim;
+        got = 1;
+    }
+}
+
+/* Read in the next line of input, and store it in the pattern space.
+ * Return zero if there was no more input. */
+int read_pattern_space(struct sed_context *ctx) {
+    if (input_exhausted(ctx)) {
+        /* 已经到达文件末尾, 返回 0 */
+        return 0;
+    }
+
+    ctx->input_line_number++;
+    ctx->replaced = 0;
+    ctx->addr_found_valid = 0;
+    line_discard(ctx);
+    ctx->line.length = 0;
+    read_input_line(ctx);
+
+    if (ctx->last_input_file && input_exhausted(ctx)) {
+        ctx->input_EOF++;
+    }
+
+    return 1;
+}
+
+/* Inplement the 'N' command, which appends the next line of input to
+   the pattern space. */
+void append_pattern_space(struct sed_context *ctx) {
+    ctx->input_line_number++;
+    ctx->replaced = 0;
+    read_input_line(ctx);
+
+    if (ctx->last_input_file && input_exhausted(ctx)) {
+        ctx->input_EOF++;
+    }
+}
+
+/* Pass the LENGTH bytes at TEXT through the windows from the W'th on,
+ * and write out what comes out of the last one.  FINAL is set for the
+ * last piece of the line, when everything held back is let go. */
+static void window_feed(struct sed_context *ctx, int w, char *text, int length, int final)
+{
+    struct line_window *win;
+    struct sed_cmd *cmd;
+    char *buf;
+    int len, pos, keep;
+
+    if (w == ctx->num_windows) {
+        output_write(ctx, text, length);
+        return;
+    }
+
+    win = &ctx->windows[w];
+    cmd = win->cmd;
+    win->out.length = 0;
+
+    if (cmd->cmd == 'y') {
+        unsigned char *trans = cmd->x.translate;
+        int i;
+
+        str_reserve(&win->out, length);
+        for (i = 0; i < length; i++) {
+            win->out.text[i] = trans[(unsigned char)text[i]];
+        }
+        win->out.length = length;
+        window_feed(ctx, w + 1, win->out.text, length, final);
+        return;
+    }
+
+    /* An s command with a literal regex: look for it in what was held
+       back and the new piece together */
+    str_append(&win->carry, text, length);
+    buf = win->carry.text;
+    len = win->carry.length;
+    pos = 0;
+
+    if (!win->done) {
+        struct sed_regex *regex = cmd->x.cmd_regex.regx;
+        int target = (cmd->x.cmd_regex.flags & S_NUM_BIT) ? cmd->x.cmd_regex.numb : 1;
+        char *p;
+
+        while (!win->done && (p = memsearch(buf + pos, len - pos, regex->literal, regex->literal_len))) {
+            str_append(&win->out, buf + pos, p - (buf + pos));
+            if (++win->count == target || (cmd->x.cmd_regex.flags & S_GLOBAL_BIT)) {
+                str_append(&win->out, win->replacement.text, win->replacement.length);
+                win->done = !(cmd->x.cmd_regex.flags & S_GLOBAL_BIT);
+            } else {
+                str_append(&win->out, p, regex->literal_len);
+            }
+            pos = p - buf + regex->literal_len;
+        }
+
+        /* A match could still begin in the last few bytes */
+        if (!final && !win->done && len - pos >= regex->literal_len) {
+            keep = len - (regex->literal_len - 1);
+        } else if (!final && !win->done) {
+            keep = pos;
+        } else {
+            keep = len;
+        }
+    } else {
+        keep = len;
+    }
+
+    str_append(&win->out, buf + pos, keep - pos);
+    memmove(buf, buf + keep, len - keep);
+    win->carry.length = len - keep;
+
+    window_feed(ctx, w + 1, win->out.text, win->out.length, final);
+}
+
+/* The pattern space is about to be filled with more than --max-line-bytes
+ * of the current line.  If the program is windowed, run the line through
+ * it a window of at most that many bytes at a time, write it out, and
+ * leave the pattern space empty, with line_streamed set; otherwise give
+ * up. */
+int stream_line(struct sed_context *ctx)
+{
+    int window = (int)max_line_bytes;
+    char *nl;
+    int i;
+
+    if (!ctx->program->windowed) {
+        panic("%s: line %d is longer than %ld bytes", ctx->input.name, ctx->input_line_number, max_line_bytes);
+    }
+
+    if (!ctx->windows) {
+        struct vector *vec = ctx->program->vector;
+
+        ctx->num_windows = vec->v_length;
+        ctx->windows = (struct line_window *)ck_malloc(vec->v_length * sizeof(struct line_window) + 1);
+        memset(ctx->windows, 0, vec->v_length * sizeof(struct line_window));
+        for (i = 0; i < vec->v_length; i++) {
+            struct line_window *win = &ctx->windows[i];
+            struct sed_cmd *cmd = vec->v + i;
+
+            win->cmd = cmd;
+            if (cmd->cmd == 's') {
+                struct replacement *r = cmd->x.cmd_regex.replacement;
+                struct replacement *end = r + cmd->x.cmd_regex.replace_pieces;
+
+                for (; r < end; r++) {
+                    str_append(&win->replacement, r->prefix, r->prefix_length);
+                    if (r->subst_id == 0) {
+                        str_append(&win->replacement, cmd->x.cmd_regex.regx->literal, cmd->x.cmd_regex.regx->literal_len);
                     }
                 }
-            } break;
+            }
+        }
+    }
 
-            case 's': {
-                /* 替换操作不会模式空间里面包含最末尾的换行符号 */
-                int trail_nl_p = line.text[line.length - 1] == '\n';
-                if (!tmp.alloc) {
-                    tmp.alloc = 50;
-                    tmp.text = ck_malloc(50);
-                }
+    for (i = 0; i < ctx->num_windows; i++) {
+        ctx->windows[i].carry.length = 0;
+        ctx->windows[i].count = 0;
+        ctx->windows[i].done = 0;
+    }
 
-                count = 0; /* 记录匹配次数 */
-                start = 0;
-                remain = line.length - trail_nl_p;
-                tmp.length = 0;
-                rep = cur_cmd->x.cmd_regex.replacement;
-                rep_end = rep + cur_cmd->x.cmd_regex.replace_length;
+    /* What has been read of the line so far is the first window */
+    window_feed(ctx, 0, ctx->line.text, ctx->line.length, 0);
+    line_discard(ctx);
+    ctx->line.length = 0;
 
-                int length = line.length - trail_nl_p;
-                while ((offset = re_search(cur_cmd->x.cmd_regex.regx, line.text,length, start, remain, &regs)) >= 0) {
-                    count++;
+    for (;;) {
+        int n;
 
-                    /* offset 是匹配到的开始位置
-                     * regs.end[0] 是匹配到的最末位置 + 1 */
-                    if (offset - start) {
-                        /* 这是不需要替换处理的部分 */
-                        str_append(&tmp, line.text + start, offset - start);
-                    }
+        if (input_exhausted(ctx)) {
+            window_feed(ctx, 0, ctx->input.cur, 0, 1);
+            break;
+        }
 
-                    if (cur_cmd->x.cmd_regex.flags & S_NUM_BIT) {
-                        /* 正则表达式设置了替换位置的情况, 执行下面的 if 块, 并跳转到下次继续执行
-                         * 实际上就是把不符合替换条件的数据, 拷贝到 tmp 里面, 然后设置新的搜索目标, 执行搜索 */
-                        if (count != cur_cmd->x.cmd_regex.numb) {
-                            int matched = regs.end[0] - regs.start[0]; /* 这是说正则表达式匹配到的长度吗? */
-                            if (!matched) matched = 1;
-                            str_append(&tmp, line.text + regs.start[0], matched);
-                            start = (offset == regs.end[0] ? offset + 1 : regs.end[0]);
-                            remain = (line.length - trail_nl_p) - start;
-                            continue;
-                        }
-                    }
+        n = ctx->input.lim - ctx->input.cur;
+        if (n > window) {
+            n = window;
+        }
+        nl = memchr(ctx->input.cur, record_sep, n);
+#ifndef NO_MMAP
+        if (input_truncated) {
+            input_truncated_check(ctx);
+            continue;
+        }
+#endif
+        if (nl) {
+            window_feed(ctx, 0, ctx->input.cur, nl - ctx->input.cur, 1);
+            output_write(ctx, nl, 1);
+            ctx->input.cur = nl + 1;
+            break;
+        }
 
-                    /* 比方说正则表达式是: s/aaa/XXX&YYY/ */
-                    /* 这里往下, 开始执行替换逻辑, 简单说就是将 replacement 替换到 tmp 里面来 */
-                    for (rep_next = rep_cur = rep; rep_next < rep_end; rep_next++) {
-                        if (*rep_next == '&') {
-                            /* 正则表达式里面的 & 符号有特殊含义, 它表示将匹配到的原始部分追加到匹配结果 */
-                            if (rep_next - rep_cur) {
-                                /* 拷贝 XXX 部分 */
-                                str_append(&tmp, rep_cur, rep_next - rep_cur);
-                            }
+        window_feed(ctx, 0, ctx->input.cur, n, 0);
+        ctx->input.cur += n;
+    }
 
-                            /* 拷贝 aaa 部分 */
-                            str_append(&tmp, line.text + regs.start[0], regs.end[0] - regs.start[0]);
-                            rep_cur = rep_next + 1;
-                        } else if (*rep_next == '\\') {
-                            /* 这里是替换成正则匹配组部分, 也即常见的 \1, \2 这种
-                             * 注意看对 \ 符号的处理, 如果后面不是数字, 那么这个 \ 符号就被丢弃了 */
-                            if (rep_next - rep_cur) {
-                                str_append(&tmp, rep_cur, rep_next - rep_cur);
-                            }
+    ctx->line_streamed = 1;
+    return 1;
+}
+
+/* Copy the contents of the line 'from' into the line 'to'.
+   This destroys the old contents of 'to'.  It will still work
+   if the line 'from' contains nulls. */
+void line_copy(struct line *from, struct line *to)
+{
+    to->text = ck_grow(to->text, &to->alloc, from->length);
+    bcopy(from->text, to->text, from->length);
+    to->length = from->length;
+}
+
+/* Append the contents of the line 'from' to the line 'to'.
+   This routine will work even if the line 'from' contains nulls */
+void line_append(struct line *from, struct line *to)
+{
+    to->text = ck_grow(to->text, &to->alloc, to->length + from->length);
+    bcopy(from->text, to->text + to->length, from->length);
+    to->length += from->length;
+}
+
+/* Append 'length' bytes from 'string' to the line 'to'
+   This routine *will* append bytes with nulls in them, without
+   failing. */
+void str_append(struct line *to, char *string, int length)
+{
+    to->text = ck_grow(to->text, &to->alloc, to->length + length);
+    bcopy(string, to->text + to->length, length);
+    to->length += length;
+}
+
+/* Make sure TO has room for LENGTH more bytes. */
+void str_reserve(struct line *to, int length)
+{
+    to->text = ck_grow(to->text, &to->alloc, to->length + length);
+}
+
+/* Append to TO the replacement of the s command CMD for the match
+ * described by REGS in TEXT.  The room needed is worked out first, so
+ * the pieces can be copied in without checking again. */
+void append_replacement(struct line *to, struct sed_cmd *cmd, char *text, struct re_registers *regs)
+{
+    struct replacement *p = cmd->x.cmd_regex.replacement;
+    struct replacement *end = p + cmd->x.cmd_regex.replace_pieces;
+    int length = cmd->x.cmd_regex.replace_fixed;
+    char *dest;
+
+    for (; p < end; p++) {
+        if (p->subst_id >= 0 && regs->start[p->subst_id] >= 0) {
+            length += regs->end[p->subst_id] - regs->start[p->subst_id];
+        }
+    }
+
+    str_reserve(to, length);
+    dest = to->text + to->length;
+
+    for (p = cmd->x.cmd_regex.replacement; p < end; p++) {
+        memcpy(dest, p->prefix, p->prefix_length);
+        dest += p->prefix_length;
+        if (p->subst_id >= 0 && regs->start[p->subst_id] >= 0) {
+            int n = regs->end[p->subst_id] - regs->start[p->subst_id];
+
+            memcpy(dest, text + regs->start[p->subst_id], n);
+            dest += n;
+        }
+    }
+
+    to->length += length;
+}
+
+/* Order the matches substitute_fused found by command, and then by
+ * where they are. */
+static int fused_by_cmd(const void *a, const void *b)
+{
+    const int *x = (const int *)a, *y = (const int *)b;
+
+    return x[0] != y[0] ? x[0] - y[0] : x[1] - y[1];
+}
+
+/* Order the matches to be replaced by where they are. */
+static int fused_by_place(const void *a, const void *b)
+{
+    return ((const int *)a)[1] - ((const int *)b)[1];
+}
+
+/* Do the fused s commands starting with CMD (see fuse_run) in one pass
+ * over the pattern space.  Every match of their strings is found at
+ * once, and then the commands are gone through in order, each taking
+ * its matches, as it would have found them, from those that don't
+ * overlap one another or what an earlier command replaced.  Nothing a
+ * command puts in can make a new match for a later one, so that is the
+ * same as running them one by one. */
+void substitute_fused(struct sed_context *ctx, struct sed_cmd *cmd)
+{
+    int trail_nl_p = ctx->line.length && ctx->line.text[ctx->line.length - 1] == record_sep;
+    int length = ctx->line.length - trail_nl_p;
+    char *text = ctx->line.text;
+    char *taken;
+    int *found;
+    int n, i, kept = 0;
+    int matched = 0;
+    int start = 0;
+    regoff_t match_start, match_end;
+    struct re_registers regs;
+    struct line t;
+
+    n = multisearch_all(cmd->x.cmd_regex.fused, text, length, &ctx->fused_found, &ctx->fused_alloc);
+    if (!n) {
+        return;
+    }
+    found = ctx->fused_found;
+    qsort(found, n, 2 * sizeof(int), fused_by_cmd);
+
+    str_reserve(&ctx->fused_taken, length);
+    taken = ctx->fused_taken.text;
+    memset(taken, 0, length);
+
+    for (i = 0; i < n;) {
+        struct sed_cmd *c = cmd + found[2 * i];
+        int len = c->x.cmd_regex.regx->literal_len;
+        int count = 0, last_end = 0;
+
+        for (; i < n && cmd + found[2 * i] == c; i++) {
+            int end = found[2 * i + 1];
+
+            /* Not there once an earlier command has replaced part of it,
+               and not a match if it overlaps this command's last one */
+            if (end - len < last_end || memchr(taken + end - len, 1, len)) {
+                continue;
+            }
+            last_end = end;
+            count++;
 
-                            rep_next++;
-                            if (rep_next != rep_end) {
-                                int n;
+            if ((c->x.cmd_regex.flags & S_NUM_BIT) ? count != c->x.cmd_regex.numb : !(c->x.cmd_regex.flags & S_GLOBAL_BIT) && count > 1) {
+                continue;
+            }
 
-                                if (*rep_next >= '0' && *rep_next <= '9') {
-                                    n = *rep_next - '0';
-                                    str_append(&tmp, line.text + regs.start[n], regs.end[n] - regs.start[n]);
-                                } else {
-                                    str_append(&tmp, rep_next, 1);
-                                }
-                            }
+            memset(taken + end - len, 1, len);
+            found[2 * kept] = found[2 * i];
+            found[2 * kept + 1] = end;
+            kept++;
+        }
 
-                            rep_cur = rep_next + 1;
-                        }
-                    }
+        /* A command that only counted matches still counts for t */
+        matched |= count;
+    }
 
-                    if (rep_next - rep_cur) {
-                        str_append(&tmp, rep_cur, rep_next - rep_cur);
-                    }
+    if (!matched) {
+        return;
+    }
+    ctx->replaced = 1;
 
-                    printf("offset %d, regs.end[0]: %d\n", offset, regs.end[0]);
+    qsort(found, kept, 2 * sizeof(int), fused_by_place);
 
-                    /* 正则表达式里面有空组就回出现满足 if 条件的场景
-                     * TODO: 还有什么场景? */
-                    if (offset == regs.end[0]) {
-                        /* 拷贝走一个字符, 再继续处理剩余部分.
-                         * 不做这个拷贝就死循环了, 会一直能满足匹配 */
-                        str_append(&tmp, line.text + offset, 1);
-                        ++regs.end[0]; /*  */
-                    }
+    regs.num_regs = 1;
+    regs.start = &match_start;
+    regs.end = &match_end;
 
-                    start = regs.end[0];
-                    remain = (line.length - trail_nl_p) - start;
-                    if (remain < 0) {
-                        break;
-                    }
+    ctx->subst.length = 0;
+    str_reserve(&ctx->subst, ctx->line.length + cmd->x.cmd_regex.replace_fixed);
+    for (i = 0; i < kept; i++) {
+        struct sed_cmd *c = cmd + found[2 * i];
 
-                    if (!(cur_cmd->x.cmd_regex.flags & S_GLOBAL_BIT)) {
-                        break;
-                    }
-                }
+        match_end = found[2 * i + 1];
+        match_start = match_end - c->x.cmd_regex.regx->literal_len;
+        str_append(&ctx->subst, text + start, match_start - start);
+        append_replacement(&ctx->subst, c, text, &regs);
+        start = match_end;
+    }
+    str_append(&ctx->subst, text + start, length - start + trail_nl_p);
 
-                /* 未执行任何替换的场景 */
-                if (!count) {
-                    break;
-                }
+    line_discard(ctx);
+    t = ctx->line;
+    ctx->line = ctx->subst;
+    ctx->subst = t;
+}
 
-                /* 下面是执行了替换的场景, 要更新临时存储内容到模式空间中 */
-                replaced = 1;
-                str_append(&tmp, line.text + start, remain + trail_nl_p);
-
-                t.text = line.text;
-                t.length = line.length;
-                t.alloc = line.alloc;
-                line.text = tmp.text;
-                line.length = tmp.length;
-                line.alloc = tmp.alloc;
-                tmp.text = t.text;
-                tmp.length = t.length;
-                tmp.alloc = t.alloc;
+/* Write all of BUF..BUF+LEN to the standard output (or the file being
+ * edited in place, or a library caller's sink). */
+static void output_all(struct sed_context *ctx, char *buf, int len)
+{
+    if (ctx->edit.name) {
+        edit_write(ctx, buf, len);
+        return;
+    }
 
-                if ((cur_cmd->x.cmd_regex.flags & S_WRITE_BIT) && cur_cmd->x.cmd_regex.wio_file) {
-                    ck_fwrite(line.text, 1, line.length, cur_cmd->x.cmd_regex.wio_file);
-                }
+    if (ctx->output.sink) {
+        if (len > 0 && ctx->output.sink(ctx->output.sink_arg, buf, len)) {
+            panic("couldn't write output");
+        }
+        return;
+    }
 
-                if (cur_cmd->x.cmd_regex.flags & S_PRINT_BIT) {
-                    ck_fwrite(line.text, 1, line.length, stdout);
-                }
+    while (len > 0) {
+        int n = write(1, buf, len);
 
-                break;
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
             }
+            /* Don't try again at exit */
+            ctx->output.length = 0;
+            if (ctx->output.exiting) {
+                /* panic() would call exit() again */
+                fprintf(stderr, "%s: couldn't write to stdout: %s\n", myname, strerror(errno));
+                _exit(4);
+            }
+            panic("couldn't write to stdout: %s", strerror(errno));
+        }
+        buf += n;
+        len -= n;
+    }
+}
 
-            case 't':
-                /* replaced 在替换命令完成之后会被设置
-                 * t 命令的含义是 test 指令, test 的条件就是是否发生了替换 */
-                if (replaced) {
-                    replaced = 0;
-                    if (!cur_cmd->x.jump)
-                        end_cycle++;
-                    else {
-                        struct sed_label *j = cur_cmd->x.jump;
-
-                        n = j->v->v_length - j->v_index;
-                        cur_cmd = j->v->v + j->v_index;
-                        goto exe_loop;
-                    }
-                }
-                break;
+/* Queue LENGTH bytes from TEXT for the standard output.  If they don't
+ * fit in what's left of the buffer, they go out together with what's
+ * in it, in one writev(2), without being copied. */
+void output_write(struct sed_context *ctx, char *text, int length)
+{
+    if (ctx->output.capture) {
+        ctx->output.buf = ck_grow(ctx->output.buf, &ctx->output.alloc, ctx->output.length + length);
+        memcpy(ctx->output.buf + ctx->output.length, text, length);
+        ctx->output.length += length;
+        return;
+    }
 
+#ifndef NO_THREADS
+    if (ctx->output.piped) {
+        /* The writer thread's buffers have to be filled by copying */
+        while (length > ctx->output.alloc - ctx->output.length) {
+            int room = ctx->output.alloc - ctx->output.length;
+
+            memcpy(ctx->output.buf + ctx->output.length, text, room);
+            ctx->output.length += room;
+            text += room;
+            length -= room;
+            writer_flush(ctx);
+        }
+        memcpy(ctx->output.buf + ctx->output.length, text, length);
+        ctx->output.length += length;
+        return;
+    }
+#endif
 
-            case 'w':
-                /* 将模式空间里面的内容输出到文件中 */
-                if (cur_cmd->x.io_file) {
-                    ck_fwrite(line.text, 1, line.length, cur_cmd->x.io_file);
-                }
-                break;
+    if (!ctx->output.buf) {
+        ctx->output.alloc = OUTPUT_BLOCK_SIZE;
+        ctx->output.buf = ck_malloc(ctx->output.alloc);
+    }
 
-            case 'x': {
-                /* 交换模式空间和持有空间的内容 */
-                struct line tmp;
+    if (length <= ctx->output.alloc - ctx->output.length) {
+        memcpy(ctx->output.buf + ctx->output.length, text, length);
+        ctx->output.length += length;
+        return;
+    }
 
-                tmp = line;
-                line = hold;
-                hold = tmp;
-            } break;
+    if (ctx->edit.name || ctx->output.sink) {
+        output_flush(ctx);
+    } else if (ctx->output.length) {
+        struct iovec iov[2];
+        int n;
 
-            case 'y': {
-                unsigned char *p, *e;
+        iov[0].iov_base = ctx->output.buf;
+        iov[0].iov_len = ctx->output.length;
+        iov[1].iov_base = text;
+        iov[1].iov_len = length;
 
-                for (p = (unsigned char *)(line.text), e = p + line.length; p < e; p++) {
-                    *p = cur_cmd->x.translate[*p];
-                }
-            } break;
+        do {
+            n = writev(1, iov, 2);
+        } while (n < 0 && errno == EINTR);
 
-            default:
-                panic("INTERNAL ERROR: Bad cmd %c", cur_cmd->cmd);
+        if (n < 0) {
+            n = 0; /* Let output_all report the error */
         }
 
-        if (end_cycle) {
-            break;
+        if (n < ctx->output.length) {
+            output_all(ctx, ctx->output.buf + n, ctx->output.length - n);
+            n = 0;
+        } else {
+            n -= ctx->output.length;
         }
+        ctx->output.length = 0;
+        text += n;
+        length -= n;
     }
+
+    output_all(ctx, text, length);
 }
 
-/* Return non-zero if the current line matches the address
-   pointed to by 'addr'. */
-int match_address(struct addr *addr)
+/* Write out whatever is waiting in the output buffer. */
+void output_flush(struct sed_context *ctx)
 {
-    switch (addr->addr_type) {
-        case addr_is_null:
-            return 1;
+    int n = ctx->output.length;
 
-        case addr_is_num:
-            return (input_line_number == addr->addr_number);
+    if (ctx->output.capture) {
+        return;
+    }
 
-        case addr_is_regex: {
-            int trail_nl_p = line.text[line.length - 1] == '\n';
-            int match = re_search(addr->addr_regex, line.text,line.length - trail_nl_p,0,line.length - trail_nl_p,(struct re_registers *)0);
-            return (match >= 0) ? 1 : 0;
-        }
+#ifndef NO_THREADS
+    if (ctx->output.piped) {
+        writer_flush(ctx);
+        return;
+    }
+#endif
 
-        case addr_is_last:
-            return (input_EOF) ? 1 : 0;
+    ctx->output.length = 0;
+    output_all(ctx, ctx->output.buf, n);
+}
 
-        default:
-            panic("INTERNAL ERROR: bad address type");
-            break;
+/* Called by exit() */
+void output_exit()
+{
+    struct sed_context *ctx = current_ctx;
+
+    if (!ctx) {
+        return;
     }
 
-    return -1;
+    ctx->output.exiting = 1;
+    if (ctx->edit.name) {
+        edit_abandon(ctx);
+    }
+#ifndef NO_THREADS
+    if (ctx->output.piped) {
+        stop_writer(ctx);
+        return;
+    }
+#endif
+    output_flush(ctx);
 }
 
-/* Read in the next line of input, and store it in the pattern space.
- * Return non-zero if this is the last line of input */
-int read_pattern_space() {
-    int n;
-    char *p;
-    int ch;
+#ifndef NO_THREADS
+/* The compiler keeps its state in globals, so library callers take turns */
+static pthread_mutex_t compile_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
 
-    p = line.text;
-    n = line.alloc;
+/* Compile SCRIPT for the library (see libsed.h).  Errors come back here
+   through panic_jump, and whatever was compiled before one is freed. */
+struct sed_program *sed_compile(const char *script, int flags)
+{
+    jmp_buf env;
+    jmp_buf *outer = panic_jump;
+    char *volatile copy = 0;
+    struct sed_program *volatile program = 0;
 
-    if (feof(input_file)) {
-        /* 已经到达文件末尾, 返回 0 */
-        return 0;
+#ifndef NO_THREADS
+    pthread_mutex_lock(&compile_lock);
+#endif
+    panic_jump = &env;
+    if (setjmp(env)) {
+        panic_jump = outer;
+        flush_all_buffers();
+        free_program(take_program());
+    } else {
+        re_set_syntax(RE_SYNTAX_POSIX_BASIC);
+        no_default_output = (flags & SED_QUIET) != 0;
+        /* savchar writes into the script, so give it a copy */
+        copy = ck_strdup((char *)script);
+        compile_string(copy);
+        program = link_program();
+        panic_jump = outer;
     }
+#ifndef NO_THREADS
+    pthread_mutex_unlock(&compile_lock);
+#endif
+    free(copy);
+    return program;
+}
 
-    input_line_number++;
-    replaced = 0;
-    for (;;) {
-        if (n == 0) {
-            line.text = ck_realloc(line.text, line.alloc * 2);
-            p = line.text + line.alloc;
-            n = line.alloc;
-            line.alloc *= 2;
+void sed_program_free(struct sed_program *program)
+{
+    if (program) {
+        free_program(program);
+    }
+}
+
+/* Run PROGRAM over the input set up in CTX (which is otherwise zeroed)
+ * for sed_run_buffer or sed_run_stream, and free what the run needed.
+ * Return 0, or -1 with the reason in panic_message. */
+static int run_program(struct sed_context *ctx, const struct sed_program *program)
+{
+    jmp_buf env;
+    jmp_buf *outer = panic_jump;
+    struct sed_context *outer_ctx = current_ctx;
+    volatile int status = -1;
+
+    panic_jump = &env;
+    current_ctx = ctx;
+    if (!setjmp(env)) {
+        context_init(ctx, (struct sed_program *)program);
+        ctx->last_input_file = 1;
+        ctx->input.fd = -1;
+        ctx->input.name = "input";
+        if (ctx->input.source) {
+            ctx->input.alloc = INPUT_BLOCK_SIZE;
+            ctx->input.buf = ck_malloc(ctx->input.alloc);
+            ctx->input.cur = ctx->input.lim = ctx->input.buf;
         }
 
-        ch = getc(input_file);
-        if (ch == EOF) {
-            if (n == line.alloc) {
-                return 0;
-            }
+        process_input(ctx);
+        output_flush(ctx);
+        status = 0;
+    }
+    panic_jump = outer;
+    current_ctx = outer_ctx;
 
-            line.length = line.alloc - n;
-            if (last_input_file) {
-                input_EOF++;
-            }
+    context_free(ctx);
+    return status;
+}
 
-            return 1; /* 遇到 EOF, 返回非零(1). 下次在尝试读取模式空间, feof 会直接报告结束 */
-        }
+/* The LEN bytes at BUF are used as the input block, just as a mapped
+   file is, and lines are looked at there rather than copied. */
+int sed_run_buffer(const struct sed_program *program, const char *buf, size_t len, sed_sink sink, void *sink_arg)
+{
+    struct sed_context ctx;
+
+    memset(&ctx, 0, sizeof(struct sed_context));
+    ctx.input.cur = (char *)buf;
+    ctx.input.lim = (char *)buf + len;
+    ctx.input.mapped = 1;
+    ctx.input.eof = 1;
+    ctx.output.sink = sink;
+    ctx.output.sink_arg = sink_arg;
+    return run_program(&ctx, program);
+}
 
-        *p++ = ch;
-        --n;
-        if (ch == '\n') {
-            line.length = line.alloc - n;
-            break;
+int sed_run_stream(const struct sed_program *program, sed_source source, void *source_arg, sed_sink sink, void *sink_arg)
+{
+    struct sed_context ctx;
+
+    memset(&ctx, 0, sizeof(struct sed_context));
+    ctx.input.source = source;
+    ctx.input.source_arg = source_arg;
+    ctx.output.sink = sink;
+    ctx.output.sink_arg = sink_arg;
+    return run_program(&ctx, program);
+}
+
+const char *sed_error()
+{
+    return panic_message;
+}
+
+#ifndef LIBSED
+/* --serve: keep the compiled script and run it over documents sent to
+   a Unix domain socket.  A request is a 4-byte length, most significant
+   byte first, and that many bytes of input.  The reply is a 4-byte
+   length and that many bytes of output; if SERVE_ERROR is set in the
+   length, the run failed and the rest of it is the length of the error
+   message that follows.  A connection can carry any number of requests.
+
+   The main thread polls the listening socket and every open connection.
+   A connection with a request waiting is taken out of the poll set and
+   queued for the parallel_threads workers; whichever is free reads that
+   one request, answers it in a context of its own, and hands the
+   connection back to be polled again.  So an idle connection holds no
+   worker, however long the client keeps it open.  Without threads the
+   main thread answers each request itself. */
+
+#define SERVE_ERROR 0x80000000u
+/* The largest request or reply */
+#define SERVE_MAX_SIZE (256 * 1024 * 1024)
+/* The most a worker keeps of its request and reply buffers between requests */
+#define SERVE_KEEP_SIZE (1024 * 1024)
+/* How long to stop accepting, in milliseconds, when out of descriptors */
+#define SERVE_BACKOFF 100
+
+static struct
+{
+    int fd;
+    struct sed_program *program;
+#ifndef NO_THREADS
+    int workers;
+    pthread_mutex_t lock;
+    pthread_cond_t ready_cond;
+    int *ready; /* connections with a request waiting, oldest first */
+    int n_ready;
+    int ready_alloc;
+    int *done; /* connections answered, to be polled again */
+    int n_done;
+    int done_alloc;
+    int wake[2]; /* a byte written to wake[1] says there is something in done */
+#endif
+} server;
+
+/* A reply, with room for its length at the front */
+struct reply {
+    char *buf;
+    int length;
+    int alloc;
+};
+
+/* Read exactly LEN bytes from FD.  Return 0 at end of file or on error. */
+static int read_full(int fd, char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = read(fd, buf, len);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return 0;
         }
+        buf += n;
+        len -= n;
     }
 
-    ch = getc(input_file);
-    if (ch != EOF) {
-        ungetc(ch, input_file);
-    } else if (last_input_file) {
-        input_EOF++;
+    return 1;
+}
+
+/* Write all LEN bytes at BUF to FD.  Return 0 on error. */
+static int write_full(int fd, char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return 0;
+        }
+        buf += n;
+        len -= n;
     }
 
     return 1;
 }
 
-/* Inplement the 'N' command, which appends the next line of input to
-   the pattern space. */
-void append_pattern_space() {
-    char *p;
-    int n;
-    int ch;
+static int serve_sink(void *arg, const char *buf, size_t len)
+{
+    struct reply *r = (struct reply *)arg;
 
-    p = line.text + line.length;
-    n = line.alloc - line.length;
+    if (len > SERVE_MAX_SIZE - r->length) {
+        return 1;
+    }
+    r->buf = ck_grow(r->buf, &r->alloc, r->length + len);
+    memcpy(r->buf + r->length, buf, len);
+    r->length += len;
+    return 0;
+}
 
-    input_line_number++;
-    replaced = 0;
-    for (;;) {
-        ch = getc(input_file);
-        if (ch == EOF) {
-            if (n == line.alloc)
-                return;
-            /* *p++ = '\n'; */
-            /* --n; */
-            line.length = line.alloc - n;
-            if (last_input_file)
-                input_EOF++;
-            return;
-        }
-        if (n == 0) {
-            line.text = ck_realloc(line.text, line.alloc * 2);
-            p = line.text + line.alloc;
-            n = line.alloc;
-            line.alloc *= 2;
+/* Read the request waiting on FD and answer it.  REQ and REP are the
+ * caller's buffers.  Return 1 if the connection stays open for more,
+ * 0 if it has been closed. */
+static int serve_request(int fd, struct line *req, struct reply *rep)
+{
+    unsigned char head[4];
+    unsigned long len;
+    int hang_up = 0;
+
+    if (!rep->buf) {
+        rep->alloc = 4096;
+        rep->buf = ck_malloc(rep->alloc);
+    }
+    if (!read_full(fd, (char *)head, 4)) {
+        close(fd);
+        return 0;
+    }
+    len = (unsigned long)head[0] << 24 | head[1] << 16 | head[2] << 8 | head[3];
+    rep->length = 4;
+
+    if (len > SERVE_MAX_SIZE) {
+        /* Not worth reading: say so, and let the client go */
+        serve_sink(rep, "Request too large", 17);
+        len = SERVE_ERROR | (rep->length - 4);
+        hang_up = 1;
+    } else {
+        req->text = ck_grow(req->text, &req->alloc, (int)len);
+        if (!read_full(fd, req->text, len)) {
+            close(fd);
+            return 0;
         }
-        *p++ = ch;
-        --n;
-        if (ch == '\n') {
-            line.length = line.alloc - n;
-            break;
+
+        if (sed_run_buffer(server.program, req->text, len, serve_sink, rep)) {
+            rep->length = 4;
+            serve_sink(rep, panic_message, strlen(panic_message));
+            len = SERVE_ERROR | (rep->length - 4);
+        } else {
+            len = rep->length - 4;
         }
     }
-    ch = getc(input_file);
-    if (ch != EOF)
-        ungetc(ch, input_file);
-    else if (last_input_file)
-        input_EOF++;
+
+    rep->buf[0] = len >> 24;
+    rep->buf[1] = len >> 16;
+    rep->buf[2] = len >> 8;
+    rep->buf[3] = len;
+    if (!write_full(fd, rep->buf, rep->length) || hang_up) {
+        close(fd);
+        return 0;
+    }
+    return 1;
 }
 
-/* Copy the contents of the line 'from' into the line 'to'.
-   This destroys the old contents of 'to'.  It will still work
-   if the line 'from' contains nulls. */
-void line_copy(struct line *from, struct line *to)
+/* Give back what an unusually large request or reply made REQ or REP
+ * grow to, so a worker doesn't hold on to it while idle. */
+static void serve_trim(struct line *req, struct reply *rep)
 {
-    if (from->length > to->alloc) {
-        to->alloc = from->length;
-        to->text = ck_realloc(to->text, to->alloc);
+    if (req->alloc > SERVE_KEEP_SIZE) {
+        free(req->text);
+        req->text = 0;
+        req->alloc = 0;
+    }
+    if (rep->alloc > SERVE_KEEP_SIZE) {
+        free(rep->buf);
+        rep->buf = 0;
+        rep->alloc = 0;
     }
+}
 
-    bcopy(from->text, to->text, from->length);
-    to->length = from->length;
+#ifndef NO_THREADS
+/* Add FD to the LIST of *N, with room for *ALLOC bytes */
+static int *fd_push(int *list, int *n, int *alloc, int fd)
+{
+    list = ck_grow(list, alloc, (*n + 1) * (int)sizeof(int));
+    list[(*n)++] = fd;
+    return list;
 }
 
-/* Append the contents of the line 'from' to the line 'to'.
-   This routine will work even if the line 'from' contains nulls */
-void line_append(struct line *from, struct line *to)
+static void *serve_worker(void *arg)
 {
-    if (from->length > (to->alloc - to->length)) {
-        to->alloc += from->length;
-        to->text = ck_realloc(to->text, to->alloc);
+    struct line req;
+    struct reply rep;
+    int fd;
+
+    memset(&req, 0, sizeof req);
+    memset(&rep, 0, sizeof rep);
+
+    for (;;) {
+        pthread_mutex_lock(&server.lock);
+        while (!server.n_ready) {
+            pthread_cond_wait(&server.ready_cond, &server.lock);
+        }
+        fd = server.ready[0];
+        server.n_ready--;
+        memmove(server.ready, server.ready + 1, server.n_ready * sizeof(int));
+        pthread_mutex_unlock(&server.lock);
+
+        if (serve_request(fd, &req, &rep)) {
+            pthread_mutex_lock(&server.lock);
+            server.done = fd_push(server.done, &server.n_done, &server.done_alloc, fd);
+            pthread_mutex_unlock(&server.lock);
+            /* A full pipe already has the poller's attention */
+            while (write(server.wake[1], "", 1) < 0 && errno == EINTR) {
+            }
+        }
+        serve_trim(&req, &rep);
     }
+    return arg;
+}
+#endif
 
-    bcopy(from->text, to->text + to->length, from->length);
-    to->length += from->length;
+/* Add FD to the poll set POLL of *N, with room for *ALLOC bytes */
+static struct pollfd *poll_add(struct pollfd *poll, int *n, int *alloc, int fd)
+{
+    poll = ck_grow(poll, alloc, (*n + 1) * (int)sizeof(struct pollfd));
+    poll[*n].fd = fd;
+    poll[*n].events = POLLIN;
+    poll[*n].revents = 0;
+    (*n)++;
+    return poll;
 }
 
-/* Append 'length' bytes from 'string' to the line 'to'
-   This routine *will* append bytes with nulls in them, without
-   failing. */
-void str_append(struct line *to, char *string, int length)
+/* Listen on the socket PATH and answer requests with PROGRAM until
+   killed.  A socket left at PATH by an earlier server is replaced. */
+void serve(struct sed_program *program, char *path)
 {
-    if (length > to->alloc - to->length) {
-        to->alloc += length;
-        to->text = ck_realloc(to->text, to->alloc);
+    struct sockaddr_un addr;
+    struct stat st;
+    struct pollfd *fds = 0;
+    int n_fds = 0;
+    int fds_alloc = 0;
+    int first = 1; /* the first connection in fds */
+    struct line req;
+    struct reply rep;
+    int i;
+
+    if (strlen(path) >= sizeof addr.sun_path) {
+        panic("Socket name too long: %s", path);
+    }
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+
+    server.program = program;
+    server.fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server.fd < 0 || bind(server.fd, (struct sockaddr *)&addr, sizeof addr) < 0 || listen(server.fd, 128) < 0) {
+        panic("Couldn't listen on %s: %s", path, strerror(errno));
+    }
+
+    /* A client going away is its own business */
+    signal(SIGPIPE, SIG_IGN);
+
+    memset(&req, 0, sizeof req);
+    memset(&rep, 0, sizeof rep);
+    fds = poll_add(fds, &n_fds, &fds_alloc, server.fd);
+
+#ifndef NO_THREADS
+    pthread_mutex_init(&server.lock, 0);
+    pthread_cond_init(&server.ready_cond, 0);
+    if (pipe(server.wake) < 0) {
+        panic("Couldn't make a pipe: %s", strerror(errno));
+    }
+    fcntl(server.wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(server.wake[1], F_SETFL, O_NONBLOCK);
+    fds = poll_add(fds, &n_fds, &fds_alloc, server.wake[0]);
+    first = 2;
+
+    for (server.workers = 0; server.workers < parallel_threads; server.workers++) {
+        pthread_t tid;
+
+        if (pthread_create(&tid, 0, serve_worker, 0)) {
+            break;
+        }
+        pthread_detach(tid);
+    }
+#endif
+
+    for (;;) {
+        if (poll(fds, n_fds, fds[0].fd < 0 ? SERVE_BACKOFF : -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            panic("Couldn't poll: %s", strerror(errno));
+        }
+
+        if (fds[0].fd < 0) {
+            /* Out of descriptors last time: try again after a pause */
+            fds[0].fd = server.fd;
+        } else if (fds[0].revents & POLLIN) {
+            int fd = accept(server.fd, 0, 0);
+
+            if (fd >= 0) {
+                fds = poll_add(fds, &n_fds, &fds_alloc, fd);
+            } else if (errno == EMFILE || errno == ENFILE) {
+                /* Leave the pending connections in the backlog until a
+                   request has been answered or a client has gone */
+                fds[0].fd = -1;
+            } else if (errno != EINTR && errno != ECONNABORTED && errno != EAGAIN) {
+                panic("Couldn't accept a connection: %s", strerror(errno));
+            }
+        }
+
+#ifndef NO_THREADS
+        if (fds[1].revents & POLLIN) {
+            char drain[64];
+
+            while (read(server.wake[0], drain, sizeof drain) > 0) {
+            }
+            pthread_mutex_lock(&server.lock);
+            for (i = 0; i < server.n_done; i++) {
+                fds = poll_add(fds, &n_fds, &fds_alloc, server.done[i]);
+            }
+            server.n_done = 0;
+            pthread_mutex_unlock(&server.lock);
+        }
+#endif
+
+        /* Backwards, so a connection moved into a slot has been seen */
+        for (i = n_fds - 1; i >= first; i--) {
+            int fd = fds[i].fd;
+
+            if (!fds[i].revents) {
+                continue;
+            }
+            fds[i] = fds[--n_fds];
+
+#ifndef NO_THREADS
+            if (server.workers) {
+                pthread_mutex_lock(&server.lock);
+                server.ready = fd_push(server.ready, &server.n_ready, &server.ready_alloc, fd);
+                pthread_cond_signal(&server.ready_cond);
+                pthread_mutex_unlock(&server.lock);
+                continue;
+            }
+#endif
+            if (serve_request(fd, &req, &rep)) {
+                fds = poll_add(fds, &n_fds, &fds_alloc, fd);
+            }
+            serve_trim(&req, &rep);
+        }
     }
-    bcopy(string, to->text + to->length, length);
-    to->length += length;
 }
 
 void usage(int status)
 {
     fprintf(status ? stderr : stdout,
             "\
-Usage: %s [-nV] [--quiet] [--silent] [--version] [-e script]\n\
-        [-f script-file] [--expression=script] [--file=script-file] [file...]\n",
+Usage: %s [-nuVz] [-i[suffix]] [-j jobs] [--quiet] [--silent] [--unbuffered]\n\
+        [--pipeline] [--in-place[=suffix]] [--jobs=jobs] [--serve=socket]\n\
+        [--profile] [--max-line-bytes=bytes] [--null-data]\n\
+        [--record-separator=char] [--version]\n\
+        [-e script] [-f script-file] [--expression=script] [--file=script-file]\n\
+        [file...]\n",
             myname);
     exit(status);
 }
+#endif /* LIBSED */
@@ -25,6 +25,8 @@
 #endif
 
 #include <stdio.h>
+#include <limits.h>
+#include <setjmp.h>
 #if HAVE_STRING_H || defined(STDC_HEADERS)
 #include <string.h>
 #else
@@ -41,13 +43,34 @@ VOID *ck_malloc();
 
 char *myname;
 
+/* As in sed.c */
+#if defined(__GNUC__) && !defined(NO_THREADS)
+#define THREAD_LOCAL __thread
+#else
+#define THREAD_LOCAL
+#endif
+
+/* While a library caller (see sed_compile and sed_run_buffer) has set
+   this, panic leaves its message in panic_message and jumps back there
+   instead of exiting. */
+#define PANIC_MESSAGE_SIZE 256
+THREAD_LOCAL jmp_buf *panic_jump;
+THREAD_LOCAL char panic_message[PANIC_MESSAGE_SIZE];
+
 #ifdef __STDC__
 #include <stdarg.h>
 
-/* Print an error message and exit */
+/* Print an error message and exit (but see panic_jump) */
 void panic(char *str, ...) {
     va_list iggy;
 
+    if (panic_jump) {
+        va_start(iggy, str);
+        vsnprintf(panic_message, PANIC_MESSAGE_SIZE, str, iggy);
+        va_end(iggy);
+        longjmp(*panic_jump, 1);
+    }
+
     fprintf(stderr, "%s: ", myname);
     va_start(iggy, str);
 #ifdef HAVE_VPRINTF
@@ -112,6 +135,21 @@ char * __fp_name(FILE *fp)
     return "{Unknown file pointer}";
 }
 
+/* Drop FP from __id_s, once it has been closed or is about to be */
+void __fp_forget(FILE *fp)
+{
+    int n;
+
+    for (n = 0; n < N_FILE; n++) {
+        if (__id_s[n].fp == fp) {
+            free((VOID *)__id_s[n].name);
+            __id_s[n].fp = (FILE *)0;
+            __id_s[n].name = 0;
+            break;
+        }
+    }
+}
+
 /* Panic on failing fopen */
 FILE *ck_fopen(char *name, char *mode)
 {
@@ -152,8 +190,11 @@ void ck_fwrite(char *ptr, int size, int nmemb, FILE *stream)
 /* Panic on failing fclose */
 void ck_fclose(FILE *stream)
 {
-    if (fclose(stream) == EOF)
+    int status = fclose(stream);
+
+    if (status == EOF)
         panic("Couldn't close %s", __fp_name(stream));
+    __fp_forget(stream);
 }
 
 /* Panic on failing malloc */
@@ -186,6 +227,29 @@ VOID *ck_realloc(VOID *ptr, int size)
     return ret;
 }
 
+/* Make sure the block at PTR, which has room for *ALLOC bytes, can hold
+   NEED bytes, and return it (it may have moved).  A block that has to
+   grow at least doubles, so one built up a piece at a time is copied
+   only a logarithmic number of times.  NEED is negative if the caller's
+   arithmetic overflowed. */
+VOID *ck_grow(VOID *ptr, int *alloc, int need)
+{
+    int size = *alloc;
+
+    if (need <= size)
+        return ptr;
+    if (need < 0)
+        panic("Couldn't re-allocate memory");
+
+    if (size < 50)
+        size = 50;
+    while (size < need)
+        size = size > INT_MAX / 2 ? INT_MAX : size * 2;
+
+    *alloc = size;
+    return ck_realloc(ptr, size);
+}
+
 /* Return a malloc()'d copy of a string */
 char *
     ck_strdup(str) char *str;
@@ -204,10 +268,15 @@ struct buffer {
     int allocated;
     int length;
     char *b;
+    struct buffer *next;
 };
 
 #define MIN_ALLOCATE 50
 
+/* The buffers not yet flushed, so that those an error left behind can be
+   got rid of by flush_all_buffers. */
+static struct buffer *live_buffers;
+
 VOID * init_buffer() {
     struct buffer *b;
 
@@ -215,14 +284,20 @@ VOID * init_buffer() {
     b->allocated = MIN_ALLOCATE;
     b->b = (char *)ck_malloc(MIN_ALLOCATE);
     b->length = 0;
+    b->next = live_buffers;
+    live_buffers = b;
     return (VOID *)b;
 }
 
 void flush_buffer(VOID *bb)
 {
     struct buffer *b;
+    struct buffer **p;
 
     b = (struct buffer *)bb;
+    for (p = &live_buffers; *p != b; p = &(*p)->next)
+        ;
+    *p = b->next;
     free(b->b);
     b->b = 0;
     b->allocated = 0;
@@ -230,6 +305,12 @@ void flush_buffer(VOID *bb)
     free(b);
 }
 
+void flush_all_buffers()
+{
+    while (live_buffers)
+        flush_buffer((VOID *)live_buffers);
+}
+
 /* 查看当前缓存的大小 */
 int size_buffer(VOID *b)
 {
@@ -246,10 +327,7 @@ void add_buffer(VOID *bb, char *p, int n)
     char *cp;
 
     b = (struct buffer *)bb;
-    if (b->length + n > b->allocated) {
-        b->allocated *= 2;
-        b->b = (char *)ck_realloc(b->b, b->allocated);
-    }
+    b->b = (char *)ck_grow(b->b, &b->allocated, b->length + n);
 
     x = n;
     cp = b->b + b->length;
@@ -265,10 +343,8 @@ void add1_buffer(VOID *bb, int ch)
     struct buffer *b;
 
     b = (struct buffer *)bb;
-    if (b->length + 1 > b->allocated) {
-        b->allocated *= 2;
-        b->b = (char *)ck_realloc(b->b, b->allocated);
-    }
+    if (b->length == b->allocated)
+        b->b = (char *)ck_grow(b->b, &b->allocated, b->length + 1);
 
     b->b[b->length] = ch;
     b->length++;